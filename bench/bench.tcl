@@ -0,0 +1,161 @@
+# bench.tcl --
+#
+#	End-to-end benchmarks for the bonjour package.  These are meant to
+#	be run through "make bench", which preloads the local stand-in for
+#	the dns_sd library (fake_dns_sd.c) so that no mDNS daemon or network
+#	is needed.  Each benchmark reports its throughput along with the
+#	change in resident memory.
+#
+#	Options (all optional):
+#	    -services <n>	instances reported per browse (default 2000)
+#	    -browses <n>	browse operations to run (default 20)
+#	    -resolves <n>	resolves/address lookups to run (default 5000)
+#	    -concurrency <n>	resolves outstanding at once (default 50)
+#	    -registrations <n>	services to register (default 1000)
+#	    -latency <usec>	fake daemon reply latency (default 0)
+#	    -churn <hz>		fake remove/add rate per browse (default 0)
+
+package require Tcl 8.5
+package require bonjour
+
+array set options {
+    -services 2000
+    -browses 20
+    -resolves 5000
+    -concurrency 50
+    -registrations 1000
+    -latency 0
+    -churn 0
+}
+array set options $argv
+
+set env(FAKE_DNS_SD_SERVICES) $options(-services)
+set env(FAKE_DNS_SD_LATENCY_US) $options(-latency)
+set env(FAKE_DNS_SD_CHURN_HZ) $options(-churn)
+
+# Returns the resident set size of this process in kB, or 0 where
+# it can't be determined.
+proc rss {} {
+    if {[catch {open /proc/self/status r} f]} {
+	return 0
+    }
+    set status [read $f]
+    close $f
+    if {[regexp {VmRSS:\s+(\d+)} $status -> kb]} {
+	return $kb
+    }
+    return 0
+}
+
+# Runs script, returning the elapsed time in microseconds and the
+# change in resident memory.
+proc measure {script} {
+    set before [rss]
+    set start [clock microseconds]
+    uplevel 1 $script
+    set elapsed [expr {max(1, [clock microseconds] - $start)}]
+    return [list $elapsed [expr {[rss] - $before}]]
+}
+
+proc report {name count unit result} {
+    lassign $result elapsed memory
+    puts [format "%-16s %8d %-9s %10.3f s %12.1f %s/s %+8d kB" \
+	$name $count $unit [expr {$elapsed / 1e6}] \
+	[expr {$count * 1e6 / $elapsed}] $unit $memory]
+}
+
+# ---------------------------------------------------------------------
+# browse: start browses and wait for every instance to be reported
+# ---------------------------------------------------------------------
+
+proc browseEvent {action name domain} {
+    incr ::browseEvents
+}
+
+proc benchBrowse {browses services} {
+    set ::browseEvents 0
+    set expected [expr {$browses * $services}]
+    set result [measure {
+	for {set i 0} {$i < $browses} {incr i} {
+	    ::bonjour::browse start _bench$i._tcp browseEvent
+	}
+	while {$::browseEvents < $expected} {
+	    vwait ::browseEvents
+	}
+	for {set i 0} {$i < $browses} {incr i} {
+	    ::bonjour::browse stop _bench$i._tcp
+	}
+    }]
+    report browse $::browseEvents events $result
+}
+
+# ---------------------------------------------------------------------
+# resolve / resolve_address: keep a fixed number of lookups in flight
+# ---------------------------------------------------------------------
+
+proc lookupDone {command args} {
+    incr ::lookupsDone
+    if {$::lookupsStarted < $::lookupsWanted} {
+	startLookup $command
+    }
+}
+
+proc startLookup {command} {
+    set i [incr ::lookupsStarted]
+    if {$command eq "resolve"} {
+	::bonjour::resolve instance-$i _bench._tcp local. \
+	    [list lookupDone $command]
+    } else {
+	::bonjour::resolve_address instance-$i.local. \
+	    [list lookupDone $command]
+    }
+}
+
+proc benchLookup {command count concurrency} {
+    set ::lookupsStarted 0
+    set ::lookupsDone 0
+    set ::lookupsWanted $count
+    set result [measure {
+	for {set i 0} {$i < min($concurrency, $count)} {incr i} {
+	    startLookup $command
+	}
+	while {$::lookupsDone < $count} {
+	    vwait ::lookupsDone
+	}
+    }]
+    report $command $count lookups $result
+}
+
+# ---------------------------------------------------------------------
+# register: register services under distinct regtypes
+# ---------------------------------------------------------------------
+
+proc benchRegister {count} {
+    set result [measure {
+	for {set i 0} {$i < $count} {incr i} {
+	    ::bonjour::register -name bench$i _benchreg$i._tcp 9000 \
+		[list id $i txtvers 1]
+	}
+    }]
+    report register $count services $result
+}
+
+puts "bonjour [package require bonjour] against fake dns_sd:\
+    services=$options(-services) latency=$options(-latency)us\
+    churn=$options(-churn)Hz"
+benchBrowse $options(-browses) $options(-services)
+benchLookup resolve $options(-resolves) $options(-concurrency)
+benchLookup resolve_address $options(-resolves) $options(-concurrency)
+benchRegister $options(-registrations)
+puts "resident memory: [rss] kB"
+
+puts "\nlatency (usec):"
+dict for {op histograms} [::bonjour::latency] {
+    dict for {kind histogram} $histograms {
+	if {[dict get $histogram count] == 0} {
+	    continue
+	}
+	puts [format "  %-16s %-9s count %-8d p50 %-8d p90 %-8d p99 %-8d max %d" \
+	    $op $kind {*}[dict values [dict remove $histogram mean]]]
+    }
+}
@@ -0,0 +1,1299 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+/*
+*  A local stand-in for the dns_sd client library, used to benchmark
+*  the bonjour package without an mDNS daemon or network.  It is
+*  built as a shared library and preloaded in place of the real
+*  libdns_sd (see the "bench" target in Makefile.in).
+*
+*  Every DNSServiceRef gets a pipe whose read end is returned by
+*  DNSServiceRefSockFD.  Replies are synthesized when an operation
+*  starts, held until they are due and then made readable on the
+*  pipe.  The pipe holds a single byte whenever replies are waiting,
+*  so it behaves like the level-triggered daemon socket.
+*
+*  The following environment variables control the replies, and are
+*  read each time an operation is started:
+*
+*     FAKE_DNS_SD_SERVICES     instances reported per browse (100)
+*     FAKE_DNS_SD_INTERFACES   interfaces each instance is seen on (1)
+*     FAKE_DNS_SD_LATENCY_US   delay before each reply (0)
+*     FAKE_DNS_SD_CHURN_HZ     remove/add pairs per second per browse (0)
+*     FAKE_DNS_SD_TXT_BYTES    approximate size of resolved TXT records (32)
+*     FAKE_DNS_SD_TYPES        regtypes reported by a browse for
+*                              _services._dns-sd._udp (10)
+*
+*  A browse of a subtype ("_http._tcp,_api") only reports every
+*  tenth instance, and the services registered with that subtype.
+*  A service registered in the process resolves to its own port and
+*  TXT record, as last set by DNSServiceUpdateRecord.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <dns_sd.h>
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// the regtype browsed to enumerate regtypes
+#define FAKE_META_REGTYPE "_services._dns-sd._udp"
+
+// the kinds of operation a reference can be for
+typedef enum {
+   FAKE_BROWSE,
+   FAKE_RESOLVE,
+   FAKE_QUERY,
+   FAKE_REGISTER,
+   FAKE_CONNECTION
+} fake_op;
+
+// a synthesized reply waiting to be delivered
+typedef struct fake_reply {
+   struct fake_reply *next;
+   DNSServiceRef target;   // reference the reply is for
+   DNSServiceFlags flags;
+   uint32_t interfaceIndex;
+   int instance;           // index of the instance being reported
+   int churn;              // non-zero for a churn timer tick
+} fake_reply;
+
+// a service registered through DNSServiceRegister,
+// reported to any browse of the same regtype
+typedef struct fake_service {
+   struct fake_service *next;
+   DNSServiceRef owner;
+   char *name;
+   char *regtype;
+   uint16_t port;          // in network byte order
+   uint16_t txtLen;
+   void *txtRecord;
+} fake_service;
+
+struct _DNSServiceRef_t {
+   struct _DNSServiceRef_t *next;   // list of all live references
+   struct _DNSServiceRef_t *primary; // connection shared through
+                                     // kDNSServiceFlagsShareConnection
+   fake_op op;
+   int fds[2];                      // pipe signalling ready replies
+   fake_reply *readyHead;           // replies ready for delivery
+   fake_reply *readyTail;
+   void *callback;
+   void *context;
+   char *name;                      // service name or fullname
+   char *regtype;
+   char *domain;
+   int numServices;                 // instances reported by a browse
+   int stride;                      // gap between instance numbers
+   int churnNext;                   // next instance to churn
+   long churnInterval;              // usec between churn ticks
+   int txtBytes;
+};
+
+// an entry in the schedule of pending replies
+typedef struct {
+   long long due;                   // time the reply is due (usec)
+   DNSServiceRef ref;
+   fake_reply *reply;
+} fake_timer;
+
+// everything below is protected by fakeLock
+static pthread_mutex_t fakeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fakeWakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t fakeThread;
+static int fakeThreadStarted = 0;
+static DNSServiceRef fakeRefs = NULL;
+static fake_service *fakeServices = NULL;
+
+// binary heap of pending replies ordered on due time
+static fake_timer *fakeTimers = NULL;
+static int fakeNumTimers = 0;
+static int fakeMaxTimers = 0;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static long long fake_now(void);
+static int fake_getenv(const char *name, int defaultValue);
+static char *fake_strdup(const char *string);
+static int fake_regtype_matches(const char *registered, const char *browsed);
+static DNSServiceRef fake_ref_create(fake_op op, void *callback, void *context);
+static void fake_schedule(DNSServiceRef ref, fake_reply *reply, long long due);
+static void fake_make_ready(DNSServiceRef ref, fake_reply *reply);
+static void fake_timer_push(fake_timer timer);
+static fake_timer fake_timer_pop(void);
+static void *fake_thread_main(void *arg);
+
+////////////////////////////////////////////////////
+// returns the current monotonic time in usec
+////////////////////////////////////////////////////
+static long long fake_now(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+////////////////////////////////////////////////////
+// reads an integer setting from the environment
+////////////////////////////////////////////////////
+static int fake_getenv(const char *name, int defaultValue)
+{
+   const char *value = getenv(name);
+
+   if(value == NULL || *value == '\0') {
+      return defaultValue;
+   }
+
+   return atoi(value);
+}
+
+////////////////////////////////////////////////////
+// copies a string, allowing for NULL
+////////////////////////////////////////////////////
+static char *fake_strdup(const char *string)
+{
+   return (string == NULL) ? NULL : strdup(string);
+}
+
+////////////////////////////////////////////////////
+// whether a service registered as "type,sub,sub..."
+// is found by a browse of "type" or "type,sub"
+////////////////////////////////////////////////////
+static int fake_regtype_matches(const char *registered, const char *browsed)
+{
+   size_t typeLength = strcspn(registered, ",");
+   const char *subtype = strchr(browsed, ',');
+   const char *c;
+
+   if(strcspn(browsed, ",") != typeLength ||
+      strncmp(registered, browsed, typeLength) != 0) {
+      return 0;
+   }
+   if(subtype == NULL) {
+      return 1;
+   }
+
+   for(c = registered + typeLength; *c == ','; c += strcspn(c + 1, ",") + 1) {
+      if(strncmp(c, subtype, strlen(subtype)) == 0 &&
+         (c[strlen(subtype)] == ',' || c[strlen(subtype)] == '\0')) {
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+////////////////////////////////////////////////////
+// allocates a reference and its pipe and adds it to
+// the list of live references.  Must be called with
+// fakeLock held.
+////////////////////////////////////////////////////
+static DNSServiceRef fake_ref_create(fake_op op, void *callback, void *context)
+{
+   DNSServiceRef ref = (DNSServiceRef)calloc(1, sizeof(*ref));
+
+   if(ref == NULL) {
+      return NULL;
+   }
+
+   if(pipe(ref->fds) != 0) {
+      free(ref);
+      return NULL;
+   }
+   fcntl(ref->fds[0], F_SETFL, O_NONBLOCK);
+   fcntl(ref->fds[1], F_SETFL, O_NONBLOCK);
+
+   ref->op = op;
+   ref->callback = callback;
+   ref->context = context;
+   ref->txtBytes = fake_getenv("FAKE_DNS_SD_TXT_BYTES", 32);
+
+   ref->next = fakeRefs;
+   fakeRefs = ref;
+
+   // start the delivery thread the first time around
+   if(!fakeThreadStarted) {
+      pthread_create(&fakeThread, NULL, fake_thread_main, NULL);
+      pthread_detach(fakeThread);
+      fakeThreadStarted = 1;
+   }
+
+   return ref;
+}
+
+////////////////////////////////////////////////////
+// queues a reply for delivery at the given time.
+// Must be called with fakeLock held.
+////////////////////////////////////////////////////
+static void fake_schedule(DNSServiceRef ref, fake_reply *reply, long long due)
+{
+   fake_timer timer;
+
+   if(due <= fake_now()) {
+      fake_make_ready(ref, reply);
+      return;
+   }
+
+   timer.due = due;
+   timer.ref = ref;
+   timer.reply = reply;
+   fake_timer_push(timer);
+
+   pthread_cond_signal(&fakeWakeup);
+}
+
+////////////////////////////////////////////////////
+// moves a reply onto the ready list of a reference,
+// making the pipe readable if it wasn't already.
+// Must be called with fakeLock held.
+////////////////////////////////////////////////////
+static void fake_make_ready(DNSServiceRef ref, fake_reply *reply)
+{
+   // replies to an operation sharing a connection are
+   // read from the connection
+   reply->target = ref;
+   if(ref->primary != NULL) {
+      ref = ref->primary;
+   }
+
+   reply->next = NULL;
+
+   if(ref->readyTail == NULL) {
+      ref->readyHead = ref->readyTail = reply;
+      if(write(ref->fds[1], "x", 1) != 1) {
+         // the pipe already holds its byte
+      }
+   }
+   else {
+      ref->readyTail->next = reply;
+      ref->readyTail = reply;
+   }
+}
+
+////////////////////////////////////////////////////
+// binary heap operations on the schedule
+////////////////////////////////////////////////////
+static void fake_timer_push(fake_timer timer)
+{
+   int i;
+
+   if(fakeNumTimers == fakeMaxTimers) {
+      fakeMaxTimers = (fakeMaxTimers == 0) ? 256 : fakeMaxTimers * 2;
+      fakeTimers = (fake_timer *)realloc(
+         fakeTimers, fakeMaxTimers * sizeof(fake_timer));
+   }
+
+   i = fakeNumTimers++;
+   while(i > 0 && fakeTimers[(i - 1) / 2].due > timer.due) {
+      fakeTimers[i] = fakeTimers[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   fakeTimers[i] = timer;
+}
+
+static fake_timer fake_timer_pop(void)
+{
+   fake_timer top = fakeTimers[0];
+   fake_timer last = fakeTimers[--fakeNumTimers];
+   int i = 0;
+
+   for(;;) {
+      int child = 2 * i + 1;
+
+      if(child >= fakeNumTimers) {
+         break;
+      }
+      if(child + 1 < fakeNumTimers &&
+         fakeTimers[child + 1].due < fakeTimers[child].due) {
+         child++;
+      }
+      if(last.due <= fakeTimers[child].due) {
+         break;
+      }
+
+      fakeTimers[i] = fakeTimers[child];
+      i = child;
+   }
+   if(fakeNumTimers > 0) {
+      fakeTimers[i] = last;
+   }
+
+   return top;
+}
+
+////////////////////////////////////////////////////
+// delivery thread.  Waits for the next scheduled
+// reply to come due and makes it ready.  Churn
+// ticks are turned into a remove/add pair and the
+// next tick scheduled.
+////////////////////////////////////////////////////
+static void *fake_thread_main(void *arg)
+{
+   pthread_mutex_lock(&fakeLock);
+
+   for(;;) {
+      long long now = fake_now();
+
+      if(fakeNumTimers == 0) {
+         pthread_cond_wait(&fakeWakeup, &fakeLock);
+         continue;
+      }
+
+      if(fakeTimers[0].due > now) {
+         struct timespec deadline;
+         long long due = fakeTimers[0].due;
+
+         // the condition variable uses the realtime
+         // clock, so convert the relative delay
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         due = (long long)deadline.tv_sec * 1000000 +
+               deadline.tv_nsec / 1000 + (due - now);
+         deadline.tv_sec = due / 1000000;
+         deadline.tv_nsec = (due % 1000000) * 1000;
+
+         pthread_cond_timedwait(&fakeWakeup, &fakeLock, &deadline);
+         continue;
+      }
+
+      fake_timer timer = fake_timer_pop();
+      if(timer.reply->churn) {
+         DNSServiceRef ref = timer.ref;
+         fake_reply *removed = (fake_reply *)calloc(1, sizeof(fake_reply));
+         fake_reply *added = (fake_reply *)calloc(1, sizeof(fake_reply));
+
+         removed->instance = added->instance = ref->churnNext * ref->stride;
+         removed->interfaceIndex = added->interfaceIndex = 1;
+         added->flags = kDNSServiceFlagsAdd;
+         ref->churnNext = (ref->churnNext + 1) % ref->numServices;
+
+         fake_make_ready(ref, removed);
+         fake_make_ready(ref, added);
+
+         fake_timer_push((fake_timer){
+            timer.due + ref->churnInterval, ref, timer.reply
+         });
+      }
+      else {
+         fake_make_ready(timer.ref, timer.reply);
+      }
+   }
+
+   return NULL;
+}
+
+////////////////////////////////////////////////////
+// dns_sd connection management
+////////////////////////////////////////////////////
+int DNSServiceRefSockFD(DNSServiceRef sdRef)
+{
+   // like the real library, an operation sharing a
+   // connection has no socket of its own
+   if(sdRef == NULL || sdRef->primary != NULL) {
+      return -1;
+   }
+
+   return sdRef->fds[0];
+}
+
+void DNSServiceRefDeallocate(DNSServiceRef sdRef)
+{
+   DNSServiceRef *link;
+   fake_service **service;
+   fake_reply *reply;
+   int i, j;
+
+   if(sdRef == NULL) {
+      return;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+
+   // unlink the reference
+   for(link = &fakeRefs; *link != NULL; link = &(*link)->next) {
+      if(*link == sdRef) {
+         *link = sdRef->next;
+         break;
+      }
+   }
+
+   // drop any services it registered
+   service = &fakeServices;
+   while(*service != NULL) {
+      if((*service)->owner == sdRef) {
+         fake_service *dead = *service;
+         *service = dead->next;
+         free(dead->name);
+         free(dead->regtype);
+         free(dead->txtRecord);
+         free(dead);
+      }
+      else {
+         service = &(*service)->next;
+      }
+   }
+
+   // drop any scheduled replies and rebuild the heap
+   for(i = 0, j = 0; i < fakeNumTimers; i++) {
+      if(fakeTimers[i].ref == sdRef) {
+         free(fakeTimers[i].reply);
+      }
+      else {
+         fakeTimers[j++] = fakeTimers[i];
+      }
+   }
+   if(j != fakeNumTimers) {
+      fake_timer *timers = fakeTimers;
+      int numTimers = j;
+
+      fakeNumTimers = 0;
+      fakeTimers = NULL;
+      fakeMaxTimers = 0;
+      for(i = 0; i < numTimers; i++) {
+         fake_timer_push(timers[i]);
+      }
+      free(timers);
+   }
+
+   // drop its replies waiting on a shared connection
+   if(sdRef->primary != NULL) {
+      DNSServiceRef primary = sdRef->primary;
+      fake_reply **ready = &primary->readyHead;
+
+      primary->readyTail = NULL;
+      while(*ready != NULL) {
+         if((*ready)->target == sdRef) {
+            reply = *ready;
+            *ready = reply->next;
+            free(reply);
+         }
+         else {
+            primary->readyTail = *ready;
+            ready = &(*ready)->next;
+         }
+      }
+      if(primary->readyHead == NULL) {
+         char byte;
+
+         if(read(primary->fds[0], &byte, 1) != 1) {
+            // nothing to drain
+         }
+      }
+   }
+
+   pthread_mutex_unlock(&fakeLock);
+
+   while((reply = sdRef->readyHead) != NULL) {
+      sdRef->readyHead = reply->next;
+      free(reply);
+   }
+
+   close(sdRef->fds[0]);
+   close(sdRef->fds[1]);
+   free(sdRef->name);
+   free(sdRef->regtype);
+   free(sdRef->domain);
+   free(sdRef);
+}
+
+////////////////////////////////////////////////////
+// delivers the next ready reply, blocking until
+// one is available
+////////////////////////////////////////////////////
+DNSServiceErrorType DNSServiceProcessResult(DNSServiceRef sdRef)
+{
+   fake_reply *reply;
+   char fullname[kDNSServiceMaxDomainName];
+   char instance[kDNSServiceMaxServiceName];
+   char byte;
+
+   if(sdRef == NULL) {
+      return kDNSServiceErr_BadReference;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+   while(sdRef->readyHead == NULL) {
+      struct pollfd pfd;
+
+      pthread_mutex_unlock(&fakeLock);
+      pfd.fd = sdRef->fds[0];
+      pfd.events = POLLIN;
+      poll(&pfd, 1, -1);
+      pthread_mutex_lock(&fakeLock);
+   }
+
+   reply = sdRef->readyHead;
+   sdRef->readyHead = reply->next;
+   if(sdRef->readyHead == NULL) {
+      sdRef->readyTail = NULL;
+      if(read(sdRef->fds[0], &byte, 1) != 1) {
+         // nothing to drain
+      }
+   }
+   pthread_mutex_unlock(&fakeLock);
+
+   // a connection delivers the replies of the operations
+   // sharing it
+   sdRef = reply->target;
+
+   snprintf(instance, sizeof(instance), "instance-%d", reply->instance);
+
+   switch(sdRef->op) {
+   case FAKE_BROWSE:
+      if(reply->instance < 0) {
+         // a registered service, reported by name
+         ((DNSServiceBrowseReply)sdRef->callback)(
+            sdRef, reply->flags, reply->interfaceIndex,
+            kDNSServiceErr_NoError, sdRef->name, sdRef->regtype,
+            "local.", sdRef->context);
+         break;
+      }
+      if(strcmp(sdRef->regtype, FAKE_META_REGTYPE) == 0) {
+         // regtype N is reported as the service "_fakeN"
+         // of type "_tcp.local."
+         snprintf(instance, sizeof(instance), "_fake%d", reply->instance);
+         ((DNSServiceBrowseReply)sdRef->callback)(
+            sdRef, reply->flags, reply->interfaceIndex,
+            kDNSServiceErr_NoError, instance, "_tcp.local.",
+            "local.", sdRef->context);
+         break;
+      }
+      ((DNSServiceBrowseReply)sdRef->callback)(
+         sdRef, reply->flags, reply->interfaceIndex,
+         kDNSServiceErr_NoError, instance, sdRef->regtype,
+         "local.", sdRef->context);
+      break;
+   case FAKE_RESOLVE: {
+      TXTRecordRef txt;
+      fake_service *service;
+      char hostname[kDNSServiceMaxDomainName];
+      char value[256];
+      unsigned int hash = 0;
+      const char *c;
+      int padding;
+
+      for(c = sdRef->name; *c != '\0'; c++) {
+         hash = hash * 31 + (unsigned char)*c;
+      }
+
+      DNSServiceConstructFullName(fullname, sdRef->name,
+                                  sdRef->regtype, sdRef->domain);
+      snprintf(hostname, sizeof(hostname), "%s.local.", sdRef->name);
+
+      // a service registered in this process is resolved
+      // to what it registered
+      pthread_mutex_lock(&fakeLock);
+      for(service = fakeServices; service != NULL; service = service->next) {
+         if(strcmp(service->name, sdRef->name) == 0 &&
+            fake_regtype_matches(service->regtype, sdRef->regtype)) {
+            break;
+         }
+      }
+      if(service != NULL) {
+         uint16_t port = service->port, txtLen = service->txtLen;
+         void *txtRecord = malloc(txtLen + 1);
+
+         memcpy(txtRecord, service->txtRecord, txtLen);
+         pthread_mutex_unlock(&fakeLock);
+
+         ((DNSServiceResolveReply)sdRef->callback)(
+            sdRef, 0, reply->interfaceIndex, kDNSServiceErr_NoError,
+            fullname, hostname, port, txtLen, txtRecord, sdRef->context);
+
+         free(txtRecord);
+         break;
+      }
+      pthread_mutex_unlock(&fakeLock);
+
+      TXTRecordCreate(&txt, 0, NULL);
+      TXTRecordSetValue(&txt, "txtvers", 1, "1");
+      TXTRecordSetValue(&txt, "id", strlen(sdRef->name), sdRef->name);
+      snprintf(value, sizeof(value), "%u", 1 + hash % 4);
+      TXTRecordSetValue(&txt, "weight", strlen(value), value);
+      padding = sdRef->txtBytes - TXTRecordGetLength(&txt) - 5;
+      if(padding > 0) {
+         if(padding > 250) {
+            padding = 250;
+         }
+         memset(value, 'x', padding);
+         TXTRecordSetValue(&txt, "pad", padding, value);
+      }
+
+      ((DNSServiceResolveReply)sdRef->callback)(
+         sdRef, 0, reply->interfaceIndex, kDNSServiceErr_NoError,
+         fullname, hostname, htons(10000 + hash % 50000),
+         TXTRecordGetLength(&txt), TXTRecordGetBytesPtr(&txt),
+         sdRef->context);
+
+      TXTRecordDeallocate(&txt);
+      break;
+   }
+   case FAKE_QUERY: {
+      unsigned char address[4];
+      unsigned int hash = 0;
+      const char *c;
+
+      for(c = sdRef->name; *c != '\0'; c++) {
+         hash = hash * 31 + (unsigned char)*c;
+      }
+
+      address[0] = 10;
+      address[1] = (hash >> 16) & 0xff;
+      address[2] = (hash >> 8) & 0xff;
+      address[3] = hash & 0xff;
+
+      ((DNSServiceQueryRecordReply)sdRef->callback)(
+         sdRef, kDNSServiceFlagsAdd, reply->interfaceIndex,
+         kDNSServiceErr_NoError, sdRef->name, kDNSServiceType_A,
+         kDNSServiceClass_IN, sizeof(address), address, 120,
+         sdRef->context);
+      break;
+   }
+   case FAKE_REGISTER:
+      ((DNSServiceRegisterReply)sdRef->callback)(
+         sdRef, kDNSServiceFlagsAdd, kDNSServiceErr_NoError,
+         sdRef->name, sdRef->regtype, "local.", sdRef->context);
+      break;
+   case FAKE_CONNECTION:
+      break;
+   }
+
+   free(reply);
+
+   return kDNSServiceErr_NoError;
+}
+
+////////////////////////////////////////////////////
+// dns_sd operations
+////////////////////////////////////////////////////
+DNSServiceErrorType DNSServiceCreateConnection(DNSServiceRef *sdRef)
+{
+   DNSServiceRef ref;
+
+   if(sdRef == NULL) {
+      return kDNSServiceErr_BadParam;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+   ref = fake_ref_create(FAKE_CONNECTION, NULL, NULL);
+   pthread_mutex_unlock(&fakeLock);
+   if(ref == NULL) {
+      return kDNSServiceErr_NoMemory;
+   }
+
+   *sdRef = ref;
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSServiceBrowse(
+   DNSServiceRef *sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   const char *regtype,
+   const char *domain,
+   DNSServiceBrowseReply callBack,
+   void *context
+) {
+   DNSServiceRef ref;
+   fake_service *service;
+   long long due;
+   int numInterfaces, latency, churn;
+   int i, j;
+
+   if(sdRef == NULL || regtype == NULL || callBack == NULL) {
+      return kDNSServiceErr_BadParam;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+
+   ref = fake_ref_create(FAKE_BROWSE, (void *)callBack, context);
+   if(ref == NULL) {
+      pthread_mutex_unlock(&fakeLock);
+      return kDNSServiceErr_NoMemory;
+   }
+   ref->regtype = fake_strdup(regtype);
+   if(flags & kDNSServiceFlagsShareConnection) {
+      ref->primary = *sdRef;
+   }
+   ref->numServices = fake_getenv("FAKE_DNS_SD_SERVICES", 100);
+   ref->stride = 1;
+   if(strcmp(regtype, FAKE_META_REGTYPE) == 0) {
+      ref->numServices = fake_getenv("FAKE_DNS_SD_TYPES", 10);
+   }
+   else if(strchr(regtype, ',') != NULL) {
+      ref->stride = 10;
+      ref->numServices = (ref->numServices + 9) / 10;
+   }
+   numInterfaces = fake_getenv("FAKE_DNS_SD_INTERFACES", 1);
+   latency = fake_getenv("FAKE_DNS_SD_LATENCY_US", 0);
+   churn = fake_getenv("FAKE_DNS_SD_CHURN_HZ", 0);
+
+   // report every synthesized instance on every
+   // interface (or just the one asked for)
+   due = fake_now() + latency;
+   for(i = 0; i < ref->numServices; i++) {
+      for(j = 1; j <= numInterfaces; j++) {
+         fake_reply *reply;
+
+         if(interfaceIndex != 0 && interfaceIndex != (uint32_t)j) {
+            continue;
+         }
+
+         reply = (fake_reply *)calloc(1, sizeof(fake_reply));
+         reply->flags = kDNSServiceFlagsAdd;
+         if(i != ref->numServices - 1 || j != numInterfaces) {
+            reply->flags |= kDNSServiceFlagsMoreComing;
+         }
+         reply->interfaceIndex = j;
+         reply->instance = i * ref->stride;
+         fake_schedule(ref, reply, due);
+      }
+   }
+
+   // report services registered in this process
+   for(service = fakeServices; service != NULL; service = service->next) {
+      if(fake_regtype_matches(service->regtype, regtype) && ref->name == NULL) {
+         fake_reply *reply = (fake_reply *)calloc(1, sizeof(fake_reply));
+
+         ref->name = fake_strdup(service->name);
+         reply->flags = kDNSServiceFlagsAdd;
+         reply->interfaceIndex = 1;
+         reply->instance = -1;
+         fake_schedule(ref, reply, due);
+      }
+   }
+
+   // start churning once the initial replies are out
+   if(churn > 0 && ref->numServices > 0) {
+      fake_reply *tick = (fake_reply *)calloc(1, sizeof(fake_reply));
+
+      tick->churn = 1;
+      ref->churnInterval = 1000000 / churn;
+      fake_timer_push((fake_timer){ due + ref->churnInterval, ref, tick });
+      pthread_cond_signal(&fakeWakeup);
+   }
+
+   pthread_mutex_unlock(&fakeLock);
+
+   *sdRef = ref;
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSServiceResolve(
+   DNSServiceRef *sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   const char *name,
+   const char *regtype,
+   const char *domain,
+   DNSServiceResolveReply callBack,
+   void *context
+) {
+   DNSServiceRef ref;
+   fake_reply *reply;
+
+   if(sdRef == NULL || name == NULL || regtype == NULL ||
+      domain == NULL || callBack == NULL) {
+      return kDNSServiceErr_BadParam;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+
+   ref = fake_ref_create(FAKE_RESOLVE, (void *)callBack, context);
+   if(ref == NULL) {
+      pthread_mutex_unlock(&fakeLock);
+      return kDNSServiceErr_NoMemory;
+   }
+   ref->name = fake_strdup(name);
+   ref->regtype = fake_strdup(regtype);
+   ref->domain = fake_strdup(domain);
+   if(flags & kDNSServiceFlagsShareConnection) {
+      ref->primary = *sdRef;
+   }
+
+   reply = (fake_reply *)calloc(1, sizeof(fake_reply));
+   reply->interfaceIndex = (interfaceIndex == 0) ? 1 : interfaceIndex;
+   fake_schedule(ref, reply,
+      fake_now() + fake_getenv("FAKE_DNS_SD_LATENCY_US", 0));
+
+   pthread_mutex_unlock(&fakeLock);
+
+   *sdRef = ref;
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSServiceQueryRecord(
+   DNSServiceRef *sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   const char *fullname,
+   uint16_t rrtype,
+   uint16_t rrclass,
+   DNSServiceQueryRecordReply callBack,
+   void *context
+) {
+   DNSServiceRef ref;
+   fake_reply *reply;
+
+   if(sdRef == NULL || fullname == NULL || callBack == NULL) {
+      return kDNSServiceErr_BadParam;
+   }
+   if(rrtype != kDNSServiceType_A || rrclass != kDNSServiceClass_IN) {
+      return kDNSServiceErr_Unsupported;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+
+   ref = fake_ref_create(FAKE_QUERY, (void *)callBack, context);
+   if(ref == NULL) {
+      pthread_mutex_unlock(&fakeLock);
+      return kDNSServiceErr_NoMemory;
+   }
+   ref->name = fake_strdup(fullname);
+
+   reply = (fake_reply *)calloc(1, sizeof(fake_reply));
+   reply->interfaceIndex = (interfaceIndex == 0) ? 1 : interfaceIndex;
+   fake_schedule(ref, reply,
+      fake_now() + fake_getenv("FAKE_DNS_SD_LATENCY_US", 0));
+
+   pthread_mutex_unlock(&fakeLock);
+
+   *sdRef = ref;
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSServiceRegister(
+   DNSServiceRef *sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   const char *name,
+   const char *regtype,
+   const char *domain,
+   const char *host,
+   uint16_t port,
+   uint16_t txtLen,
+   const void *txtRecord,
+   DNSServiceRegisterReply callBack,
+   void *context
+) {
+   DNSServiceRef ref;
+   fake_service *service;
+
+   if(sdRef == NULL || regtype == NULL) {
+      return kDNSServiceErr_BadParam;
+   }
+
+   pthread_mutex_lock(&fakeLock);
+
+   ref = fake_ref_create(FAKE_REGISTER, (void *)callBack, context);
+   if(ref == NULL) {
+      pthread_mutex_unlock(&fakeLock);
+      return kDNSServiceErr_NoMemory;
+   }
+   ref->name = fake_strdup((name == NULL || *name == '\0') ? "fake" : name);
+   ref->regtype = fake_strdup(regtype);
+
+   service = (fake_service *)calloc(1, sizeof(fake_service));
+   service->owner = ref;
+   service->name = fake_strdup(ref->name);
+   service->regtype = fake_strdup(regtype);
+   service->port = port;
+   service->txtLen = txtLen;
+   service->txtRecord = malloc(txtLen + 1);
+   if(txtLen > 0) {
+      memcpy(service->txtRecord, txtRecord, txtLen);
+   }
+   service->next = fakeServices;
+   fakeServices = service;
+
+   if(callBack != NULL) {
+      fake_reply *reply = (fake_reply *)calloc(1, sizeof(fake_reply));
+
+      fake_schedule(ref, reply,
+         fake_now() + fake_getenv("FAKE_DNS_SD_LATENCY_US", 0));
+   }
+
+   pthread_mutex_unlock(&fakeLock);
+
+   *sdRef = ref;
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType DNSServiceUpdateRecord(
+   DNSServiceRef sdRef,
+   DNSRecordRef RecordRef,
+   DNSServiceFlags flags,
+   uint16_t rdlen,
+   const void *rdata,
+   uint32_t ttl
+) {
+   fake_service *service;
+
+   if(sdRef == NULL) {
+      return kDNSServiceErr_BadReference;
+   }
+
+   // only the primary TXT record is kept
+   if(RecordRef == NULL) {
+      pthread_mutex_lock(&fakeLock);
+      for(service = fakeServices; service != NULL; service = service->next) {
+         if(service->owner == sdRef) {
+            free(service->txtRecord);
+            service->txtLen = rdlen;
+            service->txtRecord = malloc(rdlen + 1);
+            if(rdlen > 0) {
+               memcpy(service->txtRecord, rdata, rdlen);
+            }
+         }
+      }
+      pthread_mutex_unlock(&fakeLock);
+   }
+
+   return kDNSServiceErr_NoError;
+}
+
+////////////////////////////////////////////////////
+// builds name.regtype.domain., escaping dots and
+// backslashes in the service name
+////////////////////////////////////////////////////
+int DNSServiceConstructFullName(
+   char *fullName,
+   const char *service,
+   const char *regtype,
+   const char *domain
+) {
+   char *out = fullName;
+   char *end = fullName + kDNSServiceMaxDomainName - 1;
+   const char *parts[2];
+   int i;
+
+   if(fullName == NULL || regtype == NULL || domain == NULL) {
+      return -1;
+   }
+
+   for(; service != NULL && *service != '\0'; service++) {
+      if(*service == '.' || *service == '\\') {
+         if(out >= end) {
+            return -1;
+         }
+         *out++ = '\\';
+      }
+      if(out >= end) {
+         return -1;
+      }
+      *out++ = *service;
+   }
+   if(out != fullName) {
+      if(out >= end) {
+         return -1;
+      }
+      *out++ = '.';
+   }
+
+   parts[0] = regtype;
+   parts[1] = domain;
+   for(i = 0; i < 2; i++) {
+      size_t len = strlen(parts[i]);
+
+      if(len == 0) {
+         continue;
+      }
+      if(out + len + 1 > end) {
+         return -1;
+      }
+      memcpy(out, parts[i], len);
+      out += len;
+      if(out[-1] != '.') {
+         *out++ = '.';
+      }
+   }
+   *out = '\0';
+
+   return 0;
+}
+
+////////////////////////////////////////////////////
+// TXT record construction and parsing.  These
+// follow the layout of a DNS TXT record: a series
+// of strings, each preceded by a length byte.
+////////////////////////////////////////////////////
+
+// private layout of a TXTRecordRef
+typedef struct {
+   uint8_t *buffer;
+   uint16_t bufferLen;
+   uint16_t dataLen;
+   uint8_t allocated;
+} fake_txt;
+
+// finds the string holding key, returning its
+// offset or -1
+static int fake_txt_find(
+   uint16_t txtLen,
+   const uint8_t *txt,
+   const char *key,
+   int *itemLen
+) {
+   size_t keyLen = strlen(key);
+   int offset = 0;
+
+   while(offset < txtLen) {
+      int len = txt[offset];
+
+      if(offset + 1 + len > txtLen) {
+         break;
+      }
+      if(len >= (int)keyLen &&
+         strncasecmp((const char *)txt + offset + 1, key, keyLen) == 0 &&
+         (len == (int)keyLen || txt[offset + 1 + keyLen] == '=')) {
+         *itemLen = len;
+         return offset;
+      }
+
+      offset += 1 + len;
+   }
+
+   return -1;
+}
+
+void TXTRecordCreate(
+   TXTRecordRef *txtRecord,
+   uint16_t bufferLen,
+   void *buffer
+) {
+   fake_txt *txt = (fake_txt *)txtRecord;
+
+   txt->buffer = (uint8_t *)buffer;
+   txt->bufferLen = (buffer == NULL) ? 0 : bufferLen;
+   txt->dataLen = 0;
+   txt->allocated = 0;
+}
+
+void TXTRecordDeallocate(TXTRecordRef *txtRecord)
+{
+   fake_txt *txt = (fake_txt *)txtRecord;
+
+   if(txt->allocated) {
+      free(txt->buffer);
+   }
+   txt->buffer = NULL;
+}
+
+DNSServiceErrorType TXTRecordRemoveValue(
+   TXTRecordRef *txtRecord,
+   const char *key
+) {
+   fake_txt *txt = (fake_txt *)txtRecord;
+   int itemLen;
+   int offset = fake_txt_find(txt->dataLen, txt->buffer, key, &itemLen);
+
+   if(offset < 0) {
+      return kDNSServiceErr_NoSuchKey;
+   }
+
+   memmove(txt->buffer + offset, txt->buffer + offset + 1 + itemLen,
+      txt->dataLen - offset - 1 - itemLen);
+   txt->dataLen -= 1 + itemLen;
+
+   return kDNSServiceErr_NoError;
+}
+
+DNSServiceErrorType TXTRecordSetValue(
+   TXTRecordRef *txtRecord,
+   const char *key,
+   uint8_t valueSize,
+   const void *value
+) {
+   fake_txt *txt = (fake_txt *)txtRecord;
+   size_t keyLen = strlen(key);
+   size_t itemLen = keyLen + ((value == NULL) ? 0 : 1 + valueSize);
+   uint8_t *item;
+   size_t i;
+
+   if(keyLen == 0 || itemLen > 255 || strchr(key, '=') != NULL) {
+      return kDNSServiceErr_Invalid;
+   }
+
+   // like the real library, only printable ASCII keys
+   for(i = 0; i < keyLen; i++) {
+      if((unsigned char)key[i] < 0x20 || (unsigned char)key[i] > 0x7e) {
+         return kDNSServiceErr_Invalid;
+      }
+   }
+
+   TXTRecordRemoveValue(txtRecord, key);
+
+   if(txt->dataLen + 1 + itemLen > 65535) {
+      return kDNSServiceErr_NoMemory;
+   }
+   if(txt->dataLen + 1 + itemLen > txt->bufferLen) {
+      size_t newLen = txt->dataLen + 1 + itemLen + 256;
+      uint8_t *buffer;
+
+      if(newLen > 65535) {
+         newLen = 65535;
+      }
+      buffer = (uint8_t *)malloc(newLen);
+      if(buffer == NULL) {
+         return kDNSServiceErr_NoMemory;
+      }
+      if(txt->dataLen > 0) {
+         memcpy(buffer, txt->buffer, txt->dataLen);
+      }
+      if(txt->allocated) {
+         free(txt->buffer);
+      }
+      txt->buffer = buffer;
+      txt->bufferLen = (uint16_t)newLen;
+      txt->allocated = 1;
+   }
+
+   item = txt->buffer + txt->dataLen;
+   item[0] = (uint8_t)itemLen;
+   memcpy(item + 1, key, keyLen);
+   if(value != NULL) {
+      item[1 + keyLen] = '=';
+      memcpy(item + 2 + keyLen, value, valueSize);
+   }
+   txt->dataLen += 1 + itemLen;
+
+   return kDNSServiceErr_NoError;
+}
+
+uint16_t TXTRecordGetLength(const TXTRecordRef *txtRecord)
+{
+   return ((const fake_txt *)txtRecord)->dataLen;
+}
+
+const void *TXTRecordGetBytesPtr(const TXTRecordRef *txtRecord)
+{
+   return ((const fake_txt *)txtRecord)->buffer;
+}
+
+int TXTRecordContainsKey(
+   uint16_t txtLen,
+   const void *txtRecord,
+   const char *key
+) {
+   int itemLen;
+
+   return fake_txt_find(txtLen, (const uint8_t *)txtRecord, key, &itemLen) >= 0;
+}
+
+const void *TXTRecordGetValuePtr(
+   uint16_t txtLen,
+   const void *txtRecord,
+   const char *key,
+   uint8_t *valueLen
+) {
+   const uint8_t *txt = (const uint8_t *)txtRecord;
+   size_t keyLen = strlen(key);
+   int itemLen;
+   int offset = fake_txt_find(txtLen, txt, key, &itemLen);
+
+   if(offset < 0 || itemLen == (int)keyLen) {
+      return NULL;
+   }
+
+   *valueLen = (uint8_t)(itemLen - keyLen - 1);
+   return txt + offset + 2 + keyLen;
+}
+
+uint16_t TXTRecordGetCount(uint16_t txtLen, const void *txtRecord)
+{
+   const uint8_t *txt = (const uint8_t *)txtRecord;
+   uint16_t count = 0;
+   int offset = 0;
+
+   while(offset < txtLen) {
+      offset += 1 + txt[offset];
+      if(offset > txtLen) {
+         break;
+      }
+      count++;
+   }
+
+   return count;
+}
+
+DNSServiceErrorType TXTRecordGetItemAtIndex(
+   uint16_t txtLen,
+   const void *txtRecord,
+   uint16_t itemIndex,
+   uint16_t keyBufLen,
+   char *key,
+   uint8_t *valueLen,
+   const void **value
+) {
+   const uint8_t *txt = (const uint8_t *)txtRecord;
+   const uint8_t *item, *equals;
+   int offset = 0;
+   int len, keyLen;
+
+   while(itemIndex > 0 && offset < txtLen) {
+      offset += 1 + txt[offset];
+      itemIndex--;
+   }
+   if(offset >= txtLen || offset + 1 + txt[offset] > txtLen) {
+      return kDNSServiceErr_Invalid;
+   }
+
+   len = txt[offset];
+   item = txt + offset + 1;
+   equals = (const uint8_t *)memchr(item, '=', len);
+   keyLen = (equals == NULL) ? len : (int)(equals - item);
+   if(keyLen + 1 > keyBufLen) {
+      return kDNSServiceErr_NoMemory;
+   }
+
+   memcpy(key, item, keyLen);
+   key[keyLen] = '\0';
+   if(equals == NULL) {
+      *value = NULL;
+      *valueLen = 0;
+   }
+   else {
+      *value = equals + 1;
+      *valueLen = (uint8_t)(len - keyLen - 1);
+   }
+
+   return kDNSServiceErr_NoError;
+}
@@ -0,0 +1,227 @@
+# soak.tcl --
+#
+#	Long running stress test for the bonjour package.  Browses are
+#	started and stopped, services resolved and registrations added and
+#	withdrawn in a loop against the local dns_sd stand-in (see "make
+#	soak").  Resident memory, Tcl's allocator totals (when Tcl is built
+#	with TCL_MEM_DEBUG) and the package's own gauges are sampled as it
+#	runs.  The run fails if resident memory, allocated bytes or the
+#	operations in flight keep growing once it has reached a steady
+#	state, or if any operation is left behind at the end.
+#
+#	Options (all optional):
+#	    -duration <sec>	how long to run (default 3600)
+#	    -interval <sec>	time between samples (default 10)
+#	    -warmup <sec>	time before the baseline is taken (default 60)
+#	    -maxgrowth <kB>	allowed growth over the baseline (default 1024)
+#	    -maxallocated <kB>	allowed growth of the allocated bytes over the
+#				baseline (default 256)
+#	    -maxinflight <n>	allowed growth of the operations in flight over
+#				the baseline (default 0)
+#	    -services <n>	instances reported per browse (default 200)
+#	    -browses <n>	browses per cycle (default 10)
+#	    -resolves <n>	resolves and address lookups per cycle (default 200)
+#	    -registrations <n>	registrations per cycle (default 50)
+#	    -churn <hz>		remove/add pairs per second on the queued,
+#				two interface browse of each cycle (default 10000)
+
+package require Tcl 8.5
+package require bonjour
+
+array set options {
+    -duration 3600
+    -interval 10
+    -warmup 60
+    -maxgrowth 1024
+    -maxallocated 256
+    -maxinflight 0
+    -services 200
+    -browses 10
+    -resolves 200
+    -registrations 50
+    -churn 10000
+}
+array set options $argv
+
+set env(FAKE_DNS_SD_SERVICES) $options(-services)
+set env(FAKE_DNS_SD_CHURN_HZ) 0
+
+# Returns the resident set size of this process in kB, or 0 where
+# it can't be determined.
+proc rss {} {
+    if {[catch {open /proc/self/status r} f]} {
+	return 0
+    }
+    set status [read $f]
+    close $f
+    if {[regexp {VmRSS:\s+(\d+)} $status -> kb]} {
+	return $kb
+    }
+    return 0
+}
+
+# Returns the bytes currently allocated through ckalloc, or 0 if Tcl
+# wasn't built with memory debugging.
+proc allocated {} {
+    if {[llength [info commands memory]] == 0 ||
+	[catch {memory info} info]} {
+	return 0
+    }
+    if {[regexp {current bytes allocated\s+(\d+)} $info -> bytes]} {
+	return $bytes
+    }
+    return 0
+}
+
+# Returns the total number of operations in flight.
+proc inFlight {} {
+    set total 0
+    dict for {op counters} [dict get [::bonjour::stats] operations] {
+	incr total [dict get $counters inFlight]
+    }
+    return $total
+}
+
+proc browseEvent {args} {
+    incr ::events
+}
+
+proc lookupDone {args} {
+    incr ::lookups
+}
+
+# One cycle of churn: browse everything, resolve a batch of instances,
+# then register and withdraw a batch of services.  Last, a queued browse
+# sees every instance on two interfaces while they are removed and added
+# again, so that replies for the same service replace and cancel each
+# other in its queue.
+proc cycle {n} {
+    global options env
+
+    set ::events 0
+    for {set i 0} {$i < $options(-browses)} {incr i} {
+	::bonjour::browse start _soak$i._tcp browseEvent
+    }
+    set expected [expr {$options(-browses) * $options(-services)}]
+    while {$::events < $expected} {
+	vwait ::events
+    }
+    for {set i 0} {$i < $options(-browses)} {incr i} {
+	::bonjour::browse stop _soak$i._tcp
+    }
+
+    set ::lookups 0
+    for {set i 0} {$i < $options(-resolves)} {incr i} {
+	::bonjour::resolve instance-$i _soak._tcp local. lookupDone
+	::bonjour::resolve_address instance-$i.local. lookupDone
+    }
+    while {$::lookups < 2 * $options(-resolves)} {
+	vwait ::lookups
+    }
+
+    for {set i 0} {$i < $options(-registrations)} {incr i} {
+	::bonjour::register -name soak$n-$i _soakreg$i._tcp 9000 \
+	    [list cycle $n instance $i]
+    }
+    for {set i 0} {$i < $options(-registrations)} {incr i} {
+	::bonjour::unregister _soakreg$i._tcp
+    }
+
+    set env(FAKE_DNS_SD_INTERFACES) 2
+    set env(FAKE_DNS_SD_CHURN_HZ) $options(-churn)
+    ::bonjour::browse start -queue 64 _soakchurn._tcp browseEvent
+    after 200 [list set ::churned $n]
+    vwait ::churned
+    ::bonjour::browse stop _soakchurn._tcp
+    set env(FAKE_DNS_SD_INTERFACES) 1
+    set env(FAKE_DNS_SD_CHURN_HZ) 0
+}
+
+set start [clock seconds]
+set nextSample $start
+set baseline {}
+set peak 0
+set allocatedPeak 0
+set inFlightPeak 0
+set cycles 0
+set failed 0
+
+puts [format "%8s %8s %10s %12s %8s %8s" \
+    elapsed cycles rss(kB) ckalloc(B) inFlight openFds]
+
+while {[clock seconds] - $start < $options(-duration)} {
+    cycle $cycles
+    incr cycles
+
+    set now [clock seconds]
+    if {$now < $nextSample} {
+	continue
+    }
+    set nextSample [expr {$now + $options(-interval)}]
+
+    set elapsed [expr {$now - $start}]
+    set kb [rss]
+    set bytes [allocated]
+    set ops [inFlight]
+    puts [format "%8d %8d %10d %12d %8d %8d" $elapsed $cycles $kb \
+	$bytes $ops [dict get [::bonjour::stats] openFds]]
+    flush stdout
+
+    # take the baselines once warmed up, then track the largest
+    # growth seen over them
+    if {$elapsed >= $options(-warmup)} {
+	if {$baseline eq ""} {
+	    set baseline $kb
+	    set allocatedBaseline $bytes
+	    set inFlightBaseline $ops
+	} else {
+	    if {$kb - $baseline > $peak} {
+		set peak [expr {$kb - $baseline}]
+	    }
+	    if {$bytes - $allocatedBaseline > $allocatedPeak} {
+		set allocatedPeak [expr {$bytes - $allocatedBaseline}]
+	    }
+	    if {$ops - $inFlightBaseline > $inFlightPeak} {
+		set inFlightPeak [expr {$ops - $inFlightBaseline}]
+	    }
+	}
+    }
+}
+
+if {$baseline eq ""} {
+    puts "run too short to reach the end of the warmup period"
+} elseif {$peak > $options(-maxgrowth)} {
+    puts "FAILED: memory grew by $peak kB over the steady state\
+	baseline of $baseline kB (limit $options(-maxgrowth) kB)"
+    set failed 1
+} else {
+    puts "memory growth over the steady state: $peak kB"
+}
+
+# allocated is always 0 without TCL_MEM_DEBUG, so this check
+# only bites in a memory debugging build
+if {$baseline ne ""} {
+    if {$allocatedPeak > $options(-maxallocated) * 1024} {
+	puts "FAILED: allocated bytes grew by $allocatedPeak over the\
+	    steady state baseline of $allocatedBaseline\
+	    (limit $options(-maxallocated) kB)"
+	set failed 1
+    } else {
+	puts "allocated growth over the steady state: $allocatedPeak bytes"
+    }
+    if {$inFlightPeak > $options(-maxinflight)} {
+	puts "FAILED: operations in flight grew by $inFlightPeak over the\
+	    steady state baseline of $inFlightBaseline\
+	    (limit $options(-maxinflight))"
+	set failed 1
+    }
+}
+
+set stats [::bonjour::stats]
+if {[inFlight] != 0 || [dict get $stats openFds] != 0} {
+    puts "FAILED: operations left behind: $stats"
+    set failed 1
+}
+
+puts "$cycles cycles in [expr {[clock seconds] - $start}] seconds"
+exit $failed
@@ -33,10 +33,6 @@ DAMAGE.
 
 /*
 * TODO:
-*  - Keep track of the active_resolve structures so that
-*    they can be deallocated in the event of a call to
-*    bonjour_cleanup.  (If the program exits in the
-*    middle of a resolution, for example.)
 *  - Fix handling of protocol errors returned by bonjour
 *    in the Tcl_BackgroundError function calls.  More
 *    descriptive error messages are necessary.
@@ -44,11 +40,44 @@ DAMAGE.
 */
 
 #include <string.h>
+#include <time.h>
+#include <net/if.h>
 
 #include <tcl.h>
 #include <dns_sd.h>
 
 #include "bonjour.h"
+#include "epoll.h"
+#include "probes.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// per-thread state
+typedef struct {
+   int initialized;        // non-zero once the state exists
+   Tcl_HashTable owners;   // type of the operation owning each
+                           // service reference registered with the
+                           // event loop, used to tag trace records
+} bonjour_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static bonjour_thread_data *bonjour_thread_data_get(void);
+static bonjour_op_type bonjour_owner(
+   DNSServiceRef sdRef
+);
+static void bonjour_thread_cleanup(
+   ClientData clientData
+);
 
 ////////////////////////////////////////////////////
 // initialize the package
@@ -68,6 +97,13 @@ int Bonjour_Init(
    Browse_Init(interp);
    Register_Init(interp);
    Resolve_Init(interp);
+   Stats_Init(interp);
+   Trace_Init(interp);
+   Replay_Init(interp);
+   Snapshot_Init(interp);
+   Dispatch_Init(interp);
+   Inventory_Init(interp);
+   Pick_Init(interp);
 
    return(TCL_OK);
 }
@@ -82,14 +118,164 @@ void bonjour_tcl_callback(
 ) {
    DNSServiceRef sdRef = (DNSServiceRef)clientData;
 
+   // the owner is looked up first, as processing may
+   // stop the operation
+   bonjour_op_type op =
+      bonjourTraceEnabled ? bonjour_owner(sdRef) : BONJOUR_OP_COUNT;
+
+   BONJOUR_STATS_INCR(events);
+
    // process the incoming data
-   DNSServiceProcessResult(sdRef);
+   BONJOUR_PROBE1(process__start, sdRef);
+   DNSServiceErrorType error = DNSServiceProcessResult(sdRef);
+   BONJOUR_PROBE2(process__done, sdRef, error);
+   BONJOUR_TRACE(BONJOUR_TRACE_PROCESS, op, sdRef, 0, 0, error, 0, 0);
+   if(error != kDNSServiceErr_NoError) {
+      bonjour_stats_error(error);
+   }
+}
+
+////////////////////////////////////////////////////
+// evaluates a callback script at the global level,
+// recording how long the evaluation took
+////////////////////////////////////////////////////
+int bonjour_eval_callback(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   bonjour_op_type op,
+   DNSServiceRef sdRef
+) {
+   Tcl_WideInt startTime = bonjour_time_now();
+   Tcl_WideInt elapsed;
+   int result;
+
+   BONJOUR_PROBE2(callback__start, op, interp);
+   result = Tcl_GlobalEvalObj(interp, callback);
+   BONJOUR_PROBE2(callback__done, op, result);
+
+   // replayed callbacks are left out of the live
+   // histograms
+   elapsed = bonjour_time_now() - startTime;
+   if(!BONJOUR_REPLAYED(sdRef)) {
+      bonjour_histogram_record(&bonjourStats.callback[op], elapsed);
+   }
+   BONJOUR_TRACE(BONJOUR_TRACE_DISPATCH, op, sdRef, 0, 0, result,
+                 (uint32_t)elapsed, 0);
+
+   return(result);
+}
+
+////////////////////////////////////////////////////
+// registers the socket used by a DNS service
+// reference with the Tcl event loop so that
+// bonjour_tcl_callback is called when there is
+// data to be read
+////////////////////////////////////////////////////
+void bonjour_create_file_handler(
+   DNSServiceRef sdRef,
+   bonjour_op_type op
+) {
+   bonjour_thread_data *tsdPtr = bonjour_thread_data_get();
+   int newFlag;
+
+   BONJOUR_STATS_INCR(openFds);
+
+   Tcl_SetHashValue(
+      Tcl_CreateHashEntry(&tsdPtr->owners, (char *)sdRef, &newFlag),
+      (ClientData)(size_t)op);
+
+#ifdef BONJOUR_ENABLE_EPOLL
+   // fall back to a file handler if epoll can't be used
+   if(bonjour_epoll_watch(sdRef)) {
+      return;
+   }
+#endif
+
+   Tcl_CreateFileHandler(
+      DNSServiceRefSockFD(sdRef),
+      TCL_READABLE,
+      bonjour_tcl_callback,
+      sdRef);
+}
+
+////////////////////////////////////////////////////
+// removes the file handler created by
+// bonjour_create_file_handler
+////////////////////////////////////////////////////
+void bonjour_delete_file_handler(
+   DNSServiceRef sdRef
+) {
+   bonjour_thread_data *tsdPtr = bonjour_thread_data_get();
+   Tcl_HashEntry *hashEntry;
+
+   BONJOUR_STATS_DECR(openFds);
+
+   hashEntry = Tcl_FindHashEntry(&tsdPtr->owners, (char *)sdRef);
+   if(hashEntry != NULL) {
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+
+#ifdef BONJOUR_ENABLE_EPOLL
+   if(bonjour_epoll_unwatch(sdRef)) {
+      return;
+   }
+#endif
+
+   Tcl_DeleteFileHandler(DNSServiceRefSockFD(sdRef));
+}
+
+////////////////////////////////////////////////////
+// returns the calling thread's state, creating it
+// if need be
+////////////////////////////////////////////////////
+static bonjour_thread_data *bonjour_thread_data_get(void) {
+   bonjour_thread_data *tsdPtr;
+
+   tsdPtr = (bonjour_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(bonjour_thread_data));
+   if(!tsdPtr->initialized) {
+      Tcl_InitHashTable(&tsdPtr->owners, TCL_ONE_WORD_KEYS);
+      Tcl_CreateThreadExitHandler(bonjour_thread_cleanup, tsdPtr);
+      tsdPtr->initialized = 1;
+   }
+
+   return(tsdPtr);
+}
+
+////////////////////////////////////////////////////
+// returns the type of the operation owning a service
+// reference registered with the event loop
+////////////////////////////////////////////////////
+static bonjour_op_type bonjour_owner(
+   DNSServiceRef sdRef
+) {
+   bonjour_thread_data *tsdPtr = bonjour_thread_data_get();
+   Tcl_HashEntry *hashEntry;
+
+   hashEntry = Tcl_FindHashEntry(&tsdPtr->owners, (char *)sdRef);
+   if(hashEntry == NULL) {
+      return(BONJOUR_OP_COUNT);
+   }
+
+   return((bonjour_op_type)(size_t)Tcl_GetHashValue(hashEntry));
+}
+
+////////////////////////////////////////////////////
+// frees the calling thread's state when it exits
+////////////////////////////////////////////////////
+static void bonjour_thread_cleanup(
+   ClientData clientData
+) {
+   bonjour_thread_data *tsdPtr = (bonjour_thread_data *)clientData;
+
+   Tcl_DeleteHashTable(&tsdPtr->owners);
+   tsdPtr->initialized = 0;
 }
 
 ////////////////////////////////////////////////////
 // translates a DNSServiceErrorType into a string
 ////////////////////////////////////////////////////
-static const char *get_dnsserviceerror_string(DNSServiceErrorType errorCode)
+const char *get_dnsserviceerror_string(DNSServiceErrorType errorCode)
 {
    switch(errorCode)
    {
@@ -160,10 +346,47 @@ static const char *get_dnsserviceerror_string(DNSServiceErrorType errorCode)
    return NULL;
 }
 
+////////////////////////////////////////////////////
+// translates a bonjour_op_type into a string
+////////////////////////////////////////////////////
+const char *get_operation_name(bonjour_op_type op)
+{
+   switch(op)
+   {
+      case BONJOUR_OP_BROWSE:
+         return "browse";
+      case BONJOUR_OP_RESOLVE:
+         return "resolve";
+      case BONJOUR_OP_RESOLVE_ADDRESS:
+         return "resolve_address";
+      case BONJOUR_OP_REGISTER:
+         return "register";
+      default:
+         break;
+   } // end switch(op)
+
+   return NULL;
+}
+
+////////////////////////////////////////////////////
+// returns the current value of a monotonic clock
+// in microseconds
+////////////////////////////////////////////////////
+Tcl_WideInt bonjour_time_now(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   return (Tcl_WideInt)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 ////////////////////////////////////////////////////
 // creates and returns an error message indiciating
 // a problem in one of the DNSService* series of
-// functions.
+// functions.  The error isn't counted here: it is
+// counted once, where dns_sd returned or delivered
+// it.
 ////////////////////////////////////////////////////
 Tcl_Obj *create_dnsservice_error(
    Tcl_Interp *interp,
@@ -171,6 +394,7 @@ Tcl_Obj *create_dnsservice_error(
    DNSServiceErrorType errorCode
 ) {
    Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+
    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj("error in dns_sd", -1));
    Tcl_ListObjAppendElement(interp, result, Tcl_NewStringObj(functionName, -1));
 
@@ -186,3 +410,34 @@ Tcl_Obj *create_dnsservice_error(
 
    return result;
 }
+
+////////////////////////////////////////////////////
+// converts the value of an -interface option, either
+// an interface name or index, into an interface
+// index for the DNSService* functions
+////////////////////////////////////////////////////
+int bonjour_get_interface(
+   Tcl_Interp *interp,
+   Tcl_Obj *obj,
+   uint32_t *interfaceIndex
+) {
+   int index;
+
+   if(Tcl_GetIntFromObj(NULL, obj, &index) == TCL_OK) {
+      if(index < 0) {
+         Tcl_SetResult(interp, "interface index must not be negative", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+      *interfaceIndex = (uint32_t)index;
+      return(TCL_OK);
+   }
+
+   *interfaceIndex = if_nametoindex(Tcl_GetString(obj));
+   if(*interfaceIndex == 0) {
+      Tcl_AppendResult(interp, "unknown interface \"",
+         Tcl_GetString(obj), "\"", NULL);
+      return(TCL_ERROR);
+   }
+
+   return(TCL_OK);
+}
@@ -27,6 +27,18 @@ DAMAGE.
 #ifndef __BONJOUR_H
 #define __BONJOUR_H
 
+////////////////////////////////////////////////////
+// Types of dns_sd operation performed by the
+// package, used for instrumentation
+////////////////////////////////////////////////////
+typedef enum {
+   BONJOUR_OP_BROWSE,
+   BONJOUR_OP_RESOLVE,
+   BONJOUR_OP_RESOLVE_ADDRESS,
+   BONJOUR_OP_REGISTER,
+   BONJOUR_OP_COUNT
+} bonjour_op_type;
+
 ////////////////////////////////////////////////////
 // called by the Tcl event loop when there is data
 // on the socket used by the DNS service reference
@@ -36,6 +48,31 @@ void bonjour_tcl_callback(
    int mask
 );
 
+////////////////////////////////////////////////////
+// register/unregister the socket used by a DNS
+// service reference with the Tcl event loop.  op is
+// the type of the operation owning the reference.
+////////////////////////////////////////////////////
+void bonjour_create_file_handler(
+   DNSServiceRef sdRef,
+   bonjour_op_type op
+);
+void bonjour_delete_file_handler(
+   DNSServiceRef sdRef
+);
+
+////////////////////////////////////////////////////
+// evaluates a callback script at the global level,
+// recording how long the evaluation took.  sdRef is
+// the service reference of the operation, or NULL.
+////////////////////////////////////////////////////
+int bonjour_eval_callback(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   bonjour_op_type op,
+   DNSServiceRef sdRef
+);
+
 ////////////////////////////////////////////////////
 // Component initialization functions
 ////////////////////////////////////////////////////
@@ -48,6 +85,27 @@ int Register_Init(
 int Resolve_Init(
    Tcl_Interp *interp
 );
+int Stats_Init(
+   Tcl_Interp *interp
+);
+int Trace_Init(
+   Tcl_Interp *interp
+);
+int Replay_Init(
+   Tcl_Interp *interp
+);
+int Snapshot_Init(
+   Tcl_Interp *interp
+);
+int Dispatch_Init(
+   Tcl_Interp *interp
+);
+int Inventory_Init(
+   Tcl_Interp *interp
+);
+int Pick_Init(
+   Tcl_Interp *interp
+);
 
 ////////////////////////////////////////////////////
 // Helper functions
@@ -57,5 +115,17 @@ Tcl_Obj *create_dnsservice_error(
    const char *functionName, 
    DNSServiceErrorType errorCode
 );
+const char *get_dnsserviceerror_string(
+   DNSServiceErrorType errorCode
+);
+const char *get_operation_name(
+   bonjour_op_type op
+);
+Tcl_WideInt bonjour_time_now(void);
+int bonjour_get_interface(
+   Tcl_Interp *interp,
+   Tcl_Obj *obj,
+   uint32_t *interfaceIndex
+);
 
 #endif
@@ -26,11 +26,21 @@ DAMAGE.
 */
 
 #include <string.h>
+#include <poll.h>
+#include <arpa/inet.h>
 
 #include <tcl.h>
 #include <dns_sd.h>
 
 #include "bonjour.h"
+#include "dispatch.h"
+#include "hub.h"
+#include "probes.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include "txt_record.h"
 
 ////////////////////////////////////////////////////
 // Support structures
@@ -38,17 +48,139 @@ DAMAGE.
 
 // information on a browse operation currently in
 // progress
-typedef struct {
+typedef struct active_browse {
    DNSServiceRef sdRef; // the service discovery reference
    char *regtype;       // the regtype being discovered
    Tcl_Obj *callback;   // the callback script
    Tcl_Interp *interp;  // interpreter in which to execute the
                         // callback
+   Tcl_WideInt startTime; // when the browse was started, reset
+                          // to zero after the first reply
+   hub_subscriber *subscriber; // subscription to the hub for
+                               // shared browses, otherwise NULL
+   Tcl_Obj *staleList;  // list of the form {name domain ...} of
+                        // services reported from the snapshot,
+                        // or NULL
+   Tcl_HashTable *stale; // those not yet confirmed by a live
+                         // reply, hashed on "name\ndomain", or NULL
+   Tcl_TimerToken staleTimer; // reports or expires stale services
+   int stopped;         // set once the browse has been stopped
+   struct browse_log *log; // change log, or NULL if the reply
+                           // is being replayed
+   struct browse_queue *queue; // queue of replies waiting for the
+                               // callback, or NULL if they are
+                               // delivered as they are read
+   uint32_t interfaceIndex; // interface browsed, or 0 for all
+   Tcl_HashTable *interfaces; // with -dedupe, the set of interface
+                              // indexes each service is present
+                              // on, hashed on "name\ndomain",
+                              // otherwise NULL
+   txt_predicate *match; // with -match, the tests a service's TXT
+                         // record must pass for it to be
+                         // reported, otherwise NULL
+   Tcl_HashTable *matches; // with -match, the browse_match of
+                           // each service being resolved or
+                           // reported, hashed on "name\ndomain"
+   struct active_browse *group; // for one of the regtypes of a
+                                // browse of several, the browse
+                                // owning the connection, otherwise
+                                // NULL
+   struct active_browse **members; // for a browse of several
+                                   // regtypes, the browse of each,
+                                   // otherwise NULL
+   int numMembers;
 } active_browse;
 
-// stores active_browse structures hashed on the regtype being
-// browsed
-static Tcl_HashTable browseRegistrations;
+// a service found by a browse with -match, which is
+// resolved to test its TXT record
+typedef struct {
+   active_browse *activeBrowse;
+   DNSServiceRef sdRef; // the resolve, or NULL once the service
+                        // has matched and been reported
+   Tcl_HashEntry *hashEntry; // entry in activeBrowse->matches
+   char *domain;        // points into the same allocation
+   char serviceName[1];
+} browse_match;
+
+// number of changes kept in a browse's change log
+#define BROWSE_LOG_SIZE 1024
+
+// the changes reported by a browse, numbered from 1, and
+// the services currently present
+typedef struct browse_log {
+   Tcl_WideInt seq;     // sequence number of the latest change
+   Tcl_Obj *changes[BROWSE_LOG_SIZE]; // ring of the latest changes,
+                                      // each {seq action name domain}
+   int first;           // index of the oldest change
+   int count;           // number of changes in the ring
+   Tcl_HashTable services; // count of adds less removes for each
+                           // service, hashed on "name\ndomain"
+} browse_log;
+
+// what to do with a reply which arrives when the queue is full
+enum {
+   QUEUE_COALESCE,      // cancel out an add and remove of the same
+                        // service, otherwise drop the oldest reply
+   QUEUE_DROP_OLDEST,   // drop the oldest reply
+   QUEUE_PAUSE,         // stop reading until the queue drains
+   QUEUE_GROW           // cancel out an add and remove of the same
+                        // service, otherwise let the queue grow.
+                        // Not a -policy, used where reading can't
+                        // be paused
+};
+
+static const char *queuePolicies[] = {
+   "coalesce", "drop-oldest", "pause", NULL
+};
+
+// a reply waiting in a browse's queue
+typedef struct browse_event {
+   struct browse_event *prev, *next;
+   Tcl_HashEntry *hashEntry; // entry in the queue's pending table
+                             // while the latest reply for its
+                             // service, otherwise NULL
+   int add;             // non-zero for an add, zero for a remove
+   char *domain;        // points into the same allocation
+   char serviceName[1];
+} browse_event;
+
+// limit of the queue given to a browse without one when
+// there is a browse budget
+#define BROWSE_BUDGET_QUEUE 1024
+
+// replies decoded by the browse callback, waiting to be
+// delivered to the callback script from a timer handler
+typedef struct browse_queue {
+   int limit;           // the high-water mark
+   int policy;          // one of the QUEUE_ values
+   browse_event *head, *tail;
+   int length;          // number of replies queued
+   Tcl_HashTable pending; // the latest reply queued for each
+                          // service, hashed on "name\ndomain",
+                          // when coalescing
+   Tcl_TimerToken timer; // delivers the queued replies
+   int paused;          // set while reading is paused
+} browse_queue;
+
+// states of a stale service
+enum {
+   STALE_PENDING,       // not reported yet
+   STALE_REPORTED       // reported to the callback
+};
+
+// each interpreter stores its active_browse structures, hashed
+// on the regtype being browsed or, for a browse of several
+// regtypes, its handle, in a hash table kept as assoc data
+// under this key
+#define BONJOUR_BROWSE_ASSOC "bonjour::browse"
+
+// handles of browses of several regtypes are numbered per
+// thread, which makes them unique within each interpreter
+typedef struct {
+   unsigned long nextHandle;
+} browse_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
 
 ////////////////////////////////////////////////////
 // Private function prototypes
@@ -64,8 +196,38 @@ static int bonjour_browse_start(
    Tcl_Interp *interp,
    const char *const regtype,
    Tcl_Obj *const callbackScript,
+   int shared,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   txt_predicate *match,
+   int logged,
+   Tcl_HashTable *browseRegistrations
+);
+static int bonjour_browse_start_group(
+   Tcl_Interp *interp,
+   int numTypes,
+   Tcl_Obj *const regtypes[],
+   Tcl_Obj *const callbackScript,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   Tcl_Obj *const matchObj,
    Tcl_HashTable *browseRegistrations
 );
+static active_browse *bonjour_browse_new(
+   Tcl_Interp *interp,
+   const char *const regtype,
+   Tcl_Obj *const callbackScript,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   txt_predicate *match,
+   int logged
+);
 static int bonjour_browse_stop(
    Tcl_Interp *interp,
    const char *const regtype,
@@ -81,9 +243,118 @@ static void bonjour_browse_callback(
    const char *const replyDomain,
    void *context
 );
-static int bonjour_browse_cleanup(
+static void bonjour_browse_free(
+   active_browse *activeBrowse
+);
+static void bonjour_browse_release(
+   char *blockPtr
+);
+static int bonjour_browse_report(
+   active_browse *activeBrowse,
+   DNSServiceRef sdRef,
+   int add,
+   const char *serviceName,
+   const char *domain
+);
+static int bonjour_browse_eval(
+   active_browse *activeBrowse,
+   const char *action,
+   const char *serviceName,
+   const char *domain
+);
+static int bonjour_browse_match(
+   active_browse *activeBrowse,
+   DNSServiceRef sdRef,
+   int add,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+);
+static void bonjour_browse_match_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord,
+   void *context
+);
+static void bonjour_browse_match_stop(
+   browse_match *browseMatch,
+   int forget
+);
+static void bonjour_browse_stale_start(
+   active_browse *activeBrowse
+);
+static void bonjour_browse_stale_report(
+   ClientData clientData
+);
+static void bonjour_browse_stale_expire(
+   ClientData clientData
+);
+static int bonjour_browse_stale_confirm(
+   active_browse *activeBrowse,
+   int add,
+   const char *serviceName,
+   const char *domain
+);
+static void bonjour_browse_stale_key(
+   Tcl_DString *key,
+   const char *serviceName,
+   const char *domain
+);
+static int bonjour_browse_dedupe(
+   active_browse *activeBrowse,
+   int add,
+   uint32_t interfaceIndex,
+   const char *serviceName,
+   const char *domain
+);
+static void bonjour_browse_dedupe_free(
+   Tcl_HashTable *interfaces
+);
+static int bonjour_browse_changes(
+   Tcl_Interp *interp,
+   const char *const regtype,
+   Tcl_WideInt since,
+   Tcl_HashTable *browseRegistrations
+);
+static void bonjour_browse_log(
+   browse_log *log,
+   const char *action,
+   const char *serviceName,
+   const char *domain
+);
+static void bonjour_browse_enqueue(
+   active_browse *activeBrowse,
+   int add,
+   const char *serviceName,
+   const char *domain
+);
+static void bonjour_browse_dequeue(
+   browse_queue *queue,
+   browse_event *event
+);
+static void bonjour_browse_drain(
    ClientData clientData
 );
+static void bonjour_browse_read(
+   active_browse *activeBrowse
+);
+static browse_queue *bonjour_browse_queue_new(
+   int limit,
+   int policy
+);
+static void bonjour_browse_cleanup(
+   ClientData clientData
+);
+static void bonjour_browse_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+);
 
 ////////////////////////////////////////////////////
 // Function to initialize browse related stuff
@@ -91,20 +362,30 @@ static int bonjour_browse_cleanup(
 int Browse_Init(
    Tcl_Interp *interp
 ) {
+   Tcl_HashTable *browseRegistrations;
 
-   // initialize the has table
-   Tcl_InitHashTable(&browseRegistrations, TCL_STRING_KEYS);
+   // the package may already be loaded in this interpreter
+   if(Tcl_GetAssocData(interp, BONJOUR_BROWSE_ASSOC, NULL) != NULL) {
+      return TCL_OK;
+   }
+
+   // initialize the hash table, which is deleted along
+   // with the interpreter
+   browseRegistrations = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(browseRegistrations, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, BONJOUR_BROWSE_ASSOC,
+                    bonjour_browse_delete, browseRegistrations);
 
    // register commands
    Tcl_CreateObjCommand(
       interp, "::bonjour::browse", bonjour_browse,
-      &browseRegistrations, NULL
+      browseRegistrations, NULL
    );
 
    // create an exit handler for cleanup
-   Tcl_CreateExitHandler(
-      (Tcl_ExitProc *)bonjour_browse_cleanup,
-      &browseRegistrations
+   Tcl_CreateThreadExitHandler(
+      bonjour_browse_cleanup,
+      browseRegistrations
    );
 
    return TCL_OK;
@@ -120,11 +401,23 @@ static int bonjour_browse(
    Tcl_Obj *const objv[]
 ) {
    static char *subcommands[] = {
-      "start", "stop", NULL
+      "start", "stop", "changes", NULL
+   };
+   static const char *options[] = {
+      "-shared", "-queue", "-policy", "-interface", "-dedupe", "-match",
+      "-log", NULL
    };
    const char *regtype = NULL;
    int result = TCL_OK;
-   int cmdIndex;
+   int cmdIndex, optIndex, i;
+   int shared = 0, queueLimit = 0, queuePolicy = QUEUE_COALESCE;
+   int dedupe = 0, logged = 0, length;
+   uint32_t interfaceIndex = 0;
+   Tcl_Obj *matchObj = NULL;
+   txt_predicate *match = NULL;
+   Tcl_Obj **regtypes;
+   int numTypes;
+   Tcl_WideInt since;
    Tcl_HashTable *browseRegistrations;
 
    browseRegistrations = (Tcl_HashTable *)clientData;
@@ -143,22 +436,159 @@ static int bonjour_browse(
 
    switch(cmdIndex) {
    case 0: // start
-      if(objc != 4) {
-         Tcl_WrongNumArgs(interp, 2, objv, "<regtype> <callback>");
+      if(objc < 4) {
+         Tcl_WrongNumArgs(interp, 2, objv, "?options? <regtype> <callback>");
          return(TCL_ERROR);
       }
 
-      regtype = Tcl_GetString(objv[2]);
+      for(i = 2; i < objc - 2; i++) {
+         if(Tcl_GetIndexFromObj(
+               interp, objv[i], options, "option", 0, &optIndex
+            ) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+
+         switch(optIndex) {
+         case 0: // -shared
+            shared = 1;
+            break;
+         case 1: // -queue
+            if(++i >= objc - 2) {
+               Tcl_WrongNumArgs(interp, 2, objv, "?options? <regtype> <callback>");
+               return(TCL_ERROR);
+            }
+            if(Tcl_GetIntFromObj(interp, objv[i], &queueLimit) != TCL_OK) {
+               return(TCL_ERROR);
+            }
+            if(queueLimit < 0) {
+               Tcl_SetResult(interp, "queue limit must not be negative", TCL_STATIC);
+               return(TCL_ERROR);
+            }
+            break;
+         case 2: // -policy
+            if(++i >= objc - 2) {
+               Tcl_WrongNumArgs(interp, 2, objv, "?options? <regtype> <callback>");
+               return(TCL_ERROR);
+            }
+            if(Tcl_GetIndexFromObj(
+                  interp, objv[i], queuePolicies, "policy", 0, &queuePolicy
+               ) != TCL_OK) {
+               return(TCL_ERROR);
+            }
+            break;
+         case 3: // -interface
+            if(++i >= objc - 2) {
+               Tcl_WrongNumArgs(interp, 2, objv, "?options? <regtype> <callback>");
+               return(TCL_ERROR);
+            }
+            if(bonjour_get_interface(interp, objv[i], &interfaceIndex) != TCL_OK) {
+               return(TCL_ERROR);
+            }
+            break;
+         case 4: // -dedupe
+            dedupe = 1;
+            break;
+         case 5: // -match
+            if(++i >= objc - 2) {
+               Tcl_WrongNumArgs(interp, 2, objv, "?options? <regtype> <callback>");
+               return(TCL_ERROR);
+            }
+            matchObj = objv[i];
+            break;
+         case 6: // -log
+            logged = 1;
+            break;
+         }
+      }
+
+      // a browse without a callback is only useful for
+      // its change log
+      if(Tcl_ListObjLength(interp, objv[objc - 1], &length) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+      if(length == 0) {
+         logged = 1;
+      }
+
+      // a shared browse is read by the hub on behalf
+      // of all its subscribers
+      if(shared && queueLimit > 0 && queuePolicy == QUEUE_PAUSE) {
+         Tcl_SetResult(interp,
+            "the pause policy can't be used with a shared browse", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+
+      // the hub browses all interfaces
+      if(shared && interfaceIndex != 0) {
+         Tcl_SetResult(interp,
+            "-interface can't be used with a shared browse", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+
+      // several regtypes are browsed over one connection
+      if(Tcl_ListObjGetElements(
+            interp, objv[objc - 2], &numTypes, &regtypes) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+      if(numTypes > 1) {
+         if(shared) {
+            Tcl_SetResult(interp,
+               "-shared can't be used to browse several regtypes", TCL_STATIC);
+            return(TCL_ERROR);
+         }
+
+         // the changes of several regtypes aren't logged,
+         // so they must be followed by the callback
+         if(logged) {
+            Tcl_SetResult(interp,
+               "a change log can't be kept for several regtypes",
+               TCL_STATIC);
+            return(TCL_ERROR);
+         }
+
+         // the regtypes share a socket, so reading can't
+         // be paused for one of them
+         if(queueLimit > 0 && queuePolicy == QUEUE_PAUSE) {
+            Tcl_SetResult(interp,
+               "the pause policy can't be used to browse several regtypes",
+               TCL_STATIC);
+            return(TCL_ERROR);
+         }
+
+         return(bonjour_browse_start_group(
+            interp, numTypes, regtypes, objv[objc - 1],
+            queueLimit, queuePolicy, interfaceIndex, dedupe, matchObj,
+            browseRegistrations));
+      }
+
+      // the daemon filters on a single subtype, given
+      // as _http._tcp,_api
+      regtype = Tcl_GetString(objv[objc - 2]);
+      if(strchr(regtype, ',') != strrchr(regtype, ',')) {
+         Tcl_SetResult(interp,
+            "only one subtype can be browsed at a time", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+
+      if(matchObj != NULL) {
+         match = txt_predicate_compile(interp, matchObj);
+         if(match == NULL) {
+            return(TCL_ERROR);
+         }
+      }
+
       result = 
          bonjour_browse_start(
-            interp, regtype, objv[3], browseRegistrations
+            interp, regtype, objv[objc - 1], shared,
+            queueLimit, queuePolicy, interfaceIndex, dedupe, match, logged,
+            browseRegistrations
          );
          
       return(result);
       break;
    case 1: // stop
       if(objc != 3) {
-         Tcl_WrongNumArgs(interp, 2, objv, "<regtype>");
+         Tcl_WrongNumArgs(interp, 2, objv, "<regtype-or-handle>");
          return(TCL_ERROR);
       }
 
@@ -166,6 +596,20 @@ static int bonjour_browse(
       result = 
          bonjour_browse_stop(interp, regtype, browseRegistrations);
       break;
+   case 2: // changes
+      if(objc != 4) {
+         Tcl_WrongNumArgs(interp, 2, objv, "<regtype> <since-seq>");
+         return(TCL_ERROR);
+      }
+
+      if(Tcl_GetWideIntFromObj(interp, objv[3], &since) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+
+      regtype = Tcl_GetString(objv[2]);
+      result =
+         bonjour_browse_changes(interp, regtype, since, browseRegistrations);
+      break;
    default:
       Tcl_SetResult(interp, "Unknown option", TCL_STATIC);
       result = TCL_ERROR;
@@ -181,10 +625,18 @@ static int bonjour_browse_start(
    Tcl_Interp *interp,
    const char *const regtype,
    Tcl_Obj *const callbackScript,
+   int shared,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   txt_predicate *match,
+   int logged,
    Tcl_HashTable *browseRegistrations
 ) {
    active_browse *activeBrowse = NULL;
    Tcl_HashEntry *hashEntry = NULL;
+   DNSServiceErrorType error;
    int newFlag;
 
    // attempt to create an entry in the hash table
@@ -197,51 +649,267 @@ static int bonjour_browse_start(
       Tcl_AppendStringsToObj(
          errorMsg, "regtype ", regtype, " is already being browsed", NULL);
       Tcl_SetObjResult(interp, errorMsg);
+      if(match != NULL) {
+         txt_predicate_free(match);
+      }
       return(TCL_ERROR);
    }
 
    // allocate the active_browse structure for this
    // regtype
-   activeBrowse = (active_browse *)ckalloc(sizeof(active_browse));
-   activeBrowse->regtype = (char *)ckalloc(strlen(regtype) + 1);
-   strcpy(activeBrowse->regtype, regtype);
-   activeBrowse->callback = callbackScript;
-   Tcl_IncrRefCount(activeBrowse->callback);
-   activeBrowse->interp = interp;
+   activeBrowse = bonjour_browse_new(
+      interp, regtype, callbackScript, queueLimit, queuePolicy,
+      interfaceIndex, dedupe, match, logged);
 
    // store the active_browse structure in the hash entry
    Tcl_SetHashValue(hashEntry, activeBrowse);
 
+   // shared browses subscribe to the hub, which keeps
+   // the statistics for the browse itself
+   if(shared) {
+      activeBrowse->sdRef = NULL;
+      activeBrowse->subscriber =
+         bonjour_hub_subscribe(
+            regtype,
+            bonjour_browse_callback,
+            activeBrowse,
+            &error);
+      if(activeBrowse->subscriber == NULL) {
+         bonjour_browse_release((char *)activeBrowse);
+         Tcl_DeleteHashEntry(hashEntry);
+
+         bonjour_stats_error(error);
+         Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceBrowse", error));
+         return TCL_ERROR;
+      }
+
+      if(match == NULL) {
+         bonjour_browse_stale_start(activeBrowse);
+      }
+
+      // the regtype is the handle used to stop the browse
+      Tcl_SetObjResult(interp, Tcl_NewStringObj(regtype, -1));
+      return(TCL_OK);
+   }
+
    // call DNSServiceBrowse
-   DNSServiceErrorType error =
+   BONJOUR_PROBE3(operation__start, BONJOUR_OP_BROWSE, activeBrowse, regtype);
+   error =
       DNSServiceBrowse(
          &activeBrowse->sdRef,
-         0, 0, regtype, NULL,
+         0, interfaceIndex, regtype, NULL,
          bonjour_browse_callback,
          activeBrowse);
+   BONJOUR_TRACE(BONJOUR_TRACE_START, BONJOUR_OP_BROWSE,
+                 (error == kDNSServiceErr_NoError) ? activeBrowse->sdRef : NULL,
+                 0, 0, error, strlen(regtype), 0);
    if(error != kDNSServiceErr_NoError)
    {
-      ckfree(activeBrowse->regtype);
-      ckfree((void *)activeBrowse);
-      Tcl_DecrRefCount(activeBrowse->callback);
+      BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+      BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, activeBrowse, error);
+
+      bonjour_browse_release((char *)activeBrowse);
       Tcl_DeleteHashEntry(hashEntry);
 
+      bonjour_stats_error(error);
       Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceBrowse", error));
       return TCL_ERROR;
    }
 
+   BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+   BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+
    // retrieve the socket being used for the browse operation
    // and register a file handler so that we know when
    // there is data to be read
-   Tcl_CreateFileHandler(
-      DNSServiceRefSockFD(activeBrowse->sdRef),
-      TCL_READABLE,
-      bonjour_tcl_callback,
-      activeBrowse->sdRef);
+   bonjour_create_file_handler(activeBrowse->sdRef, BONJOUR_OP_BROWSE);
+
+   // report any services known from the snapshot, which
+   // doesn't record the interface they were seen on or
+   // whether they match
+   if(interfaceIndex == 0 && match == NULL) {
+      bonjour_browse_stale_start(activeBrowse);
+   }
+
+   // the regtype is the handle used to stop the browse
+   Tcl_SetObjResult(interp, Tcl_NewStringObj(regtype, -1));
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// start browsing for several service types over a
+// single connection to the daemon, returning a
+// handle for the browse
+////////////////////////////////////////////////////
+static int bonjour_browse_start_group(
+   Tcl_Interp *interp,
+   int numTypes,
+   Tcl_Obj *const regtypes[],
+   Tcl_Obj *const callbackScript,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   Tcl_Obj *const matchObj,
+   Tcl_HashTable *browseRegistrations
+) {
+   active_browse *group = NULL;
+   active_browse *member = NULL;
+   browse_thread_data *tsdPtr;
+   Tcl_HashEntry *hashEntry;
+   DNSServiceErrorType error;
+   char handle[32];
+   int newFlag, i;
+
+   tsdPtr = (browse_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(browse_thread_data));
+   sprintf(handle, "browse%lu", ++tsdPtr->nextHandle);
+
+   // the group only owns the connection, each regtype
+   // keeping its own queue and statistics
+   group = bonjour_browse_new(
+      interp, handle, callbackScript, 0, QUEUE_COALESCE, 0, 0, NULL, 0);
+   group->members =
+      (active_browse **)ckalloc(numTypes * sizeof(active_browse *));
+
+   error = DNSServiceCreateConnection(&group->sdRef);
+   if(error != kDNSServiceErr_NoError) {
+      group->sdRef = NULL;
+      bonjour_browse_release((char *)group);
+
+      bonjour_stats_error(error);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceCreateConnection", error));
+      return(TCL_ERROR);
+   }
+   bonjour_create_file_handler(group->sdRef, BONJOUR_OP_BROWSE);
+
+   for(i = 0; i < numTypes; i++) {
+      const char *regtype = Tcl_GetString(regtypes[i]);
+      txt_predicate *match = NULL;
+
+      if(strchr(regtype, ',') != strrchr(regtype, ',')) {
+         Tcl_SetResult(interp,
+            "only one subtype can be browsed at a time", TCL_STATIC);
+         bonjour_browse_free(group);
+         return(TCL_ERROR);
+      }
+
+      if(matchObj != NULL) {
+         match = txt_predicate_compile(interp, matchObj);
+         if(match == NULL) {
+            bonjour_browse_free(group);
+            return(TCL_ERROR);
+         }
+      }
+
+      member = bonjour_browse_new(
+         interp, regtype, callbackScript, queueLimit, queuePolicy,
+         interfaceIndex, dedupe, match, 0);
+      member->group = group;
+
+      // the browse shares the group's connection
+      BONJOUR_PROBE3(operation__start, BONJOUR_OP_BROWSE, member, regtype);
+      member->sdRef = group->sdRef;
+      error =
+         DNSServiceBrowse(
+            &member->sdRef,
+            kDNSServiceFlagsShareConnection, interfaceIndex, regtype, NULL,
+            bonjour_browse_callback,
+            member);
+      BONJOUR_TRACE(BONJOUR_TRACE_START, BONJOUR_OP_BROWSE,
+                    (error == kDNSServiceErr_NoError) ? member->sdRef : NULL,
+                    0, 0, error, strlen(regtype), 0);
+      if(error != kDNSServiceErr_NoError) {
+         BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+         BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, member, error);
+
+         bonjour_browse_release((char *)member);
+         bonjour_browse_free(group);
+
+         bonjour_stats_error(error);
+         Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceBrowse", error));
+         return(TCL_ERROR);
+      }
+
+      BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+      group->members[group->numMembers++] = member;
+
+      if(interfaceIndex == 0 && match == NULL) {
+         bonjour_browse_stale_start(member);
+      }
+   }
+
+   hashEntry = Tcl_CreateHashEntry(browseRegistrations, handle, &newFlag);
+   Tcl_SetHashValue(hashEntry, group);
+   Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
 
    return(TCL_OK);
 }
 
+////////////////////////////////////////////////////
+// allocates the active_browse structure for a
+// browse.  The browse keeps a change log if logged
+// is non-zero.
+////////////////////////////////////////////////////
+static active_browse *bonjour_browse_new(
+   Tcl_Interp *interp,
+   const char *const regtype,
+   Tcl_Obj *const callbackScript,
+   int queueLimit,
+   int queuePolicy,
+   uint32_t interfaceIndex,
+   int dedupe,
+   txt_predicate *match,
+   int logged
+) {
+   active_browse *activeBrowse;
+
+   activeBrowse = (active_browse *)ckalloc(sizeof(active_browse));
+   activeBrowse->regtype = (char *)ckalloc(strlen(regtype) + 1);
+   strcpy(activeBrowse->regtype, regtype);
+   activeBrowse->callback = callbackScript;
+   Tcl_IncrRefCount(activeBrowse->callback);
+   activeBrowse->interp = interp;
+   activeBrowse->startTime = bonjour_time_now();
+   activeBrowse->subscriber = NULL;
+   activeBrowse->staleList = NULL;
+   activeBrowse->stale = NULL;
+   activeBrowse->staleTimer = NULL;
+   activeBrowse->stopped = 0;
+   activeBrowse->log = NULL;
+   if(logged) {
+      activeBrowse->log = (browse_log *)ckalloc(sizeof(browse_log));
+      activeBrowse->log->seq = 0;
+      activeBrowse->log->first = 0;
+      activeBrowse->log->count = 0;
+      Tcl_InitHashTable(&activeBrowse->log->services, TCL_STRING_KEYS);
+   }
+   activeBrowse->queue = NULL;
+   if(queueLimit > 0) {
+      activeBrowse->queue = bonjour_browse_queue_new(queueLimit, queuePolicy);
+   }
+   activeBrowse->interfaceIndex = interfaceIndex;
+   activeBrowse->interfaces = NULL;
+   if(dedupe) {
+      activeBrowse->interfaces = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+      Tcl_InitHashTable(activeBrowse->interfaces, TCL_STRING_KEYS);
+   }
+   activeBrowse->match = match;
+   activeBrowse->matches = NULL;
+   if(match != NULL) {
+      activeBrowse->matches = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+      Tcl_InitHashTable(activeBrowse->matches, TCL_STRING_KEYS);
+   }
+   activeBrowse->group = NULL;
+   activeBrowse->members = NULL;
+   activeBrowse->numMembers = 0;
+
+   return(activeBrowse);
+}
+
 ////////////////////////////////////////////////////
 // stop browsing for a service type
 ////////////////////////////////////////////////////
@@ -260,26 +928,140 @@ static int bonjour_browse_stop(
    // if a valid hash entry was found, clean it up
    if(hashEntry) {
       activeBrowse = (active_browse *)Tcl_GetHashValue(hashEntry);
+      bonjour_browse_free(activeBrowse);
+
+      // deallocate the hash entry
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// stops a browse operation and frees the structure
+// describing it once it is no longer in use
+////////////////////////////////////////////////////
+static void bonjour_browse_free(
+   active_browse *activeBrowse
+) {
+   if(activeBrowse->members != NULL) {
+      int i;
 
-      // remove the file handler
-      Tcl_DeleteFileHandler(DNSServiceRefSockFD(activeBrowse->sdRef));
+      // the browses sharing the connection are stopped
+      // before it is closed
+      for(i = 0; i < activeBrowse->numMembers; i++) {
+         bonjour_browse_free(activeBrowse->members[i]);
+      }
+      bonjour_delete_file_handler(activeBrowse->sdRef);
+      DNSServiceRefDeallocate(activeBrowse->sdRef);
+   }
+   else if(activeBrowse->subscriber != NULL) {
+      // the hub stops the browse with its last subscriber
+      bonjour_hub_unsubscribe(activeBrowse->subscriber);
+   }
+   else {
+      // remove the file handler, unless reading is paused
+      // or the browse shares its group's connection
+      if(activeBrowse->group == NULL &&
+         (activeBrowse->queue == NULL || !activeBrowse->queue->paused)) {
+         bonjour_delete_file_handler(activeBrowse->sdRef);
+      }
 
       // deallocate the browse service reference
       DNSServiceRefDeallocate(activeBrowse->sdRef);
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+      BONJOUR_TRACE(BONJOUR_TRACE_STOP, BONJOUR_OP_BROWSE, activeBrowse->sdRef,
+                    0, 0, 0, 0, 0);
+      BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, activeBrowse, 0);
+   }
+
+   if(activeBrowse->staleTimer != NULL) {
+      Tcl_DeleteTimerHandler(activeBrowse->staleTimer);
+      activeBrowse->staleTimer = NULL;
+   }
+   if(activeBrowse->matches != NULL) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_HashSearch searchToken;
+
+      // stop the resolves of services not yet matched
+      for(hashEntry = Tcl_FirstHashEntry(activeBrowse->matches, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         bonjour_browse_match_stop(
+            (browse_match *)Tcl_GetHashValue(hashEntry), 1);
+      }
+   }
+   if(activeBrowse->queue != NULL && activeBrowse->queue->timer != NULL) {
+      Tcl_DeleteTimerHandler(activeBrowse->queue->timer);
+      activeBrowse->queue->timer = NULL;
+   }
 
-      // clean up the memory used by activeBrowse
-      ckfree(activeBrowse->regtype);
-      ckfree((void *)activeBrowse);
+   // the stale service timers may still be using
+   // activeBrowse
+   activeBrowse->stopped = 1;
+   Tcl_EventuallyFree(activeBrowse, bonjour_browse_release);
+}
 
-      // let Tcl know the callback object is no longer
-      // in use
-      Tcl_DecrRefCount(activeBrowse->callback);
+////////////////////////////////////////////////////
+// frees an active_browse structure
+////////////////////////////////////////////////////
+static void bonjour_browse_release(
+   char *blockPtr
+) {
+   active_browse *activeBrowse = (active_browse *)blockPtr;
 
-      // deallocate the hash entry
-      Tcl_DeleteHashEntry(hashEntry);
+   // let Tcl know the callback object is no longer
+   // in use
+   Tcl_DecrRefCount(activeBrowse->callback);
+
+   if(activeBrowse->staleList != NULL) {
+      Tcl_DecrRefCount(activeBrowse->staleList);
+   }
+   if(activeBrowse->stale != NULL) {
+      Tcl_DeleteHashTable(activeBrowse->stale);
+      ckfree((void *)activeBrowse->stale);
+   }
+   if(activeBrowse->interfaces != NULL) {
+      bonjour_browse_dedupe_free(activeBrowse->interfaces);
+   }
+   if(activeBrowse->matches != NULL) {
+      Tcl_DeleteHashTable(activeBrowse->matches);
+      ckfree((void *)activeBrowse->matches);
+   }
+   if(activeBrowse->match != NULL) {
+      txt_predicate_free(activeBrowse->match);
+   }
+   if(activeBrowse->members != NULL) {
+      ckfree((void *)activeBrowse->members);
    }
 
-   return(TCL_OK);
+   if(activeBrowse->log != NULL) {
+      browse_log *log = activeBrowse->log;
+      int i;
+
+      for(i = 0; i < log->count; i++) {
+         Tcl_DecrRefCount(log->changes[(log->first + i) % BROWSE_LOG_SIZE]);
+      }
+      Tcl_DeleteHashTable(&log->services);
+      ckfree((void *)log);
+   }
+
+   if(activeBrowse->queue != NULL) {
+      browse_queue *queue = activeBrowse->queue;
+
+      while(queue->head != NULL) {
+         browse_event *event = queue->head;
+
+         bonjour_browse_dequeue(queue, event);
+         ckfree((void *)event);
+      }
+      Tcl_DeleteHashTable(&queue->pending);
+      ckfree((void *)queue);
+   }
+
+   // clean up the memory used by activeBrowse
+   ckfree(activeBrowse->regtype);
+   ckfree((void *)activeBrowse);
 }
 
 ////////////////////////////////////////////////////
@@ -298,96 +1080,1129 @@ static void bonjour_browse_callback(
    void *context
 ) {
    active_browse *activeBrowse = NULL;
-   Tcl_Obj *callback;
-   int result;
+   Tcl_Interp *interp;
+   int result, replayed;
 
    activeBrowse = (active_browse *)context;
 
-   // begin creating the callback as a list
-   callback = Tcl_NewListObj(0, NULL);
-   Tcl_ListObjAppendList(NULL, callback, activeBrowse->callback);
+   // the callback may delete the interpreter, which stops
+   // the browse, so keep the interpreter around until
+   // we're done with it
+   interp = activeBrowse->interp;
+   Tcl_Preserve(interp);
+
+   // replayed replies and those from the hub arrive without
+   // a service reference.  the hub records its own replies.
+   if(bonjourRecording && sdRef != NULL) {
+      bonjour_record_browse(flags, interfaceIndex, errorCode,
+                            serviceName, replyType, replyDomain);
+   }
+
+   // replies forwarded by the hub are counted once
+   // there, however many subscribe to them
+   replayed = BONJOUR_REPLAYED(sdRef);
+   if(sdRef != NULL) {
+      BONJOUR_STATS_INCR(replies[BONJOUR_OP_BROWSE]);
+   }
+   BONJOUR_TRACE(BONJOUR_TRACE_REPLY, BONJOUR_OP_BROWSE, sdRef,
+                 flags, interfaceIndex, errorCode,
+                 (serviceName == NULL) ? 0 : strlen(serviceName),
+                 (replyDomain == NULL) ? 0 : strlen(replyDomain));
+   if(activeBrowse->startTime != 0) {
+      bonjour_histogram_record(
+         &bonjourStats.latency[BONJOUR_OP_BROWSE],
+         bonjour_time_now() - activeBrowse->startTime);
+      activeBrowse->startTime = 0;
+   }
 
    if(errorCode == kDNSServiceErr_NoError) {
-      // determine whether a service is being
-      // added or removed
-      if(flags & kDNSServiceFlagsAdd) {
-         Tcl_ListObjAppendElement(
-            activeBrowse->interp,
-            callback,
-            Tcl_NewStringObj("add", 3));
+      int add = (flags & kDNSServiceFlagsAdd) != 0;
+
+      // with -dedupe, a service seen on several interfaces
+      // is only added by its first add and removed by its
+      // last remove
+      int report = activeBrowse->interfaces == NULL ||
+         bonjour_browse_dedupe(activeBrowse, add, interfaceIndex,
+                               serviceName, replyDomain);
+
+      // keep the snapshot up to date with live replies
+      if(report && bonjourSnapshotEnabled &&
+         (sdRef != NULL || activeBrowse->subscriber != NULL)) {
+         bonjour_snapshot_browse(activeBrowse->regtype, flags,
+                                 serviceName, replyDomain);
+      }
+
+      // a reply may be a duplicate from another interface,
+      // and a browse with -match only reports a service
+      // once its TXT record has been resolved and tested
+      if(!report) {
+         result = TCL_OK;
+      }
+      else if(activeBrowse->match != NULL) {
+         result = bonjour_browse_match(activeBrowse, sdRef, add,
+                                       serviceName, replyType, replyDomain);
       }
       else {
-         Tcl_ListObjAppendElement(
-            activeBrowse->interp,
-            callback,
-            Tcl_NewStringObj("remove", 6));
-      }
-
-      // append the service name and domain
-      Tcl_ListObjAppendElement(
-         activeBrowse->interp,
-         callback,
-         Tcl_NewStringObj(serviceName, -1));
-      Tcl_ListObjAppendElement(
-         activeBrowse->interp,
-         callback,
-         Tcl_NewStringObj(replyDomain, -1));
-
-      // evaluate the callback
-      result = Tcl_GlobalEvalObj(activeBrowse->interp, callback);
+         result = bonjour_browse_report(activeBrowse, sdRef, add,
+                                        serviceName, replyDomain);
+      }
    } // end if no error
    else {
+      // errors from the hub are counted by the hub, and
+      // replayed ones not at all
+      if(sdRef != NULL) {
+         bonjour_stats_error(errorCode);
+      }
+
       // store an appropriate error message in the interpreter
-      Tcl_SetObjResult(activeBrowse->interp, 
-         create_dnsservice_error(activeBrowse->interp, "DNSServiceBrowseReply", errorCode));
+      Tcl_SetObjResult(interp, 
+         create_dnsservice_error(interp, "DNSServiceBrowseReply", errorCode));
       result = TCL_ERROR;
    }
 
    if(result == TCL_ERROR) {
-      Tcl_BackgroundError(activeBrowse->interp);
+      if(!replayed) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+      }
+      Tcl_BackgroundError(interp);
    }
+
+   Tcl_Release(interp);
 }
 
 ////////////////////////////////////////////////////
-// cleanup any leftover browsing
+// reports a service being added or removed by a
+// browse, queueing the change or evaluating the
+// callback script.  sdRef is the browse's service
+// reference, or NULL for shared or replayed replies.
+// activeBrowse may be freed by the callback.
 ////////////////////////////////////////////////////
-static int bonjour_browse_cleanup(
-   ClientData clientData
+static int bonjour_browse_report(
+   active_browse *activeBrowse,
+   DNSServiceRef sdRef,
+   int add,
+   const char *serviceName,
+   const char *domain
 ) {
-   Tcl_HashTable *browseRegistrations = NULL;
-   Tcl_HashEntry *hashEntry = NULL;
-   Tcl_HashSearch searchToken;
-   active_browse *activeBrowse = NULL;
+   int result;
 
-   browseRegistrations = (Tcl_HashTable *)clientData;
+   // a reply may only confirm what was reported from
+   // the snapshot
+   if(activeBrowse->stale != NULL &&
+      bonjour_browse_stale_confirm(activeBrowse, add,
+                                   serviceName, domain)) {
+      result = TCL_OK;
+   }
+   else if(activeBrowse->queue != NULL ||
+           (!BONJOUR_REPLAYED(sdRef) && bonjour_dispatch_budgeted())) {
+      // with a browse budget, replies are queued so that
+      // they can be held back.  Reading is paused if they
+      // pile up, since nothing is lost that way.  Shared
+      // replies and those of one regtype of several can't
+      // be paused, so their queue grows instead.
+      if(activeBrowse->queue == NULL) {
+         activeBrowse->queue = bonjour_browse_queue_new(
+            BROWSE_BUDGET_QUEUE,
+            (sdRef != NULL && activeBrowse->group == NULL) ?
+               QUEUE_PAUSE : QUEUE_GROW);
+      }
 
-   // run through the remaining entries in the hash table
-   for(hashEntry = Tcl_FirstHashEntry(browseRegistrations,
-                                      &searchToken);
+      // the callback script is evaluated later
+      bonjour_browse_enqueue(activeBrowse, add, serviceName, domain);
+      result = TCL_OK;
+   }
+   else {
+      result = bonjour_browse_eval(activeBrowse,
+         add ? "add" : "remove", serviceName, domain);
+   }
+
+   return(result);
+}
+
+////////////////////////////////////////////////////
+// records a service being added or removed in the
+// change log and evaluates the callback script of
+// the browse, if it isn't empty.  For a browse of
+// several regtypes the regtype is appended too.
+// activeBrowse may be freed by the callback.
+////////////////////////////////////////////////////
+static int bonjour_browse_eval(
+   active_browse *activeBrowse,
+   const char *action,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_Obj *callback;
+   int length;
+
+   if(activeBrowse->log != NULL) {
+      bonjour_browse_log(activeBrowse->log, action, serviceName, domain);
+   }
+
+   // consumers which only poll the change log give
+   // an empty callback
+   if(Tcl_ListObjLength(NULL, activeBrowse->callback, &length) == TCL_OK &&
+      length == 0) {
+      return(TCL_OK);
+   }
+
+   // create the callback as a list
+   callback = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendList(NULL, callback, activeBrowse->callback);
+
+   // append the action, service name and domain
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(action, -1));
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(serviceName, -1));
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(domain, -1));
+   if(activeBrowse->group != NULL) {
+      Tcl_ListObjAppendElement(NULL, callback,
+         Tcl_NewStringObj(activeBrowse->regtype, -1));
+   }
+
+   // evaluate the callback
+   return(bonjour_eval_callback(
+      activeBrowse->interp, callback, BONJOUR_OP_BROWSE,
+      activeBrowse->sdRef));
+}
+
+////////////////////////////////////////////////////
+// starts reporting the services of the regtype
+// found in the snapshot, if any
+////////////////////////////////////////////////////
+static void bonjour_browse_stale_start(
+   active_browse *activeBrowse
+) {
+   Tcl_Obj *services, **elements;
+   int numElements, i;
+
+   if(!bonjourSnapshotEnabled) {
+      return;
+   }
+
+   services = bonjour_snapshot_stale(activeBrowse->regtype);
+   if(services == NULL) {
+      return;
+   }
+
+   activeBrowse->staleList = services;
+   Tcl_IncrRefCount(services);
+   activeBrowse->stale = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(activeBrowse->stale, TCL_STRING_KEYS);
+
+   Tcl_ListObjGetElements(NULL, services, &numElements, &elements);
+   for(i = 0; i + 1 < numElements; i += 2) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_DString key;
+      int newFlag;
+
+      bonjour_browse_stale_key(&key, Tcl_GetString(elements[i]),
+                               Tcl_GetString(elements[i + 1]));
+      hashEntry = Tcl_CreateHashEntry(activeBrowse->stale,
+                                      Tcl_DStringValue(&key), &newFlag);
+      Tcl_SetHashValue(hashEntry, (ClientData)STALE_PENDING);
+      Tcl_DStringFree(&key);
+   }
+
+   // the services are reported from the event loop, like
+   // live replies
+   activeBrowse->staleTimer =
+      Tcl_CreateTimerHandler(0, bonjour_browse_stale_report, activeBrowse);
+}
+
+////////////////////////////////////////////////////
+// timer handler reporting the stale services which
+// haven't been confirmed yet as added
+////////////////////////////////////////////////////
+static void bonjour_browse_stale_report(
+   ClientData clientData
+) {
+   active_browse *activeBrowse = (active_browse *)clientData;
+   Tcl_Interp *interp = activeBrowse->interp;
+   Tcl_Obj *services = activeBrowse->staleList;
+   Tcl_Obj **elements;
+   int numElements, i;
+
+   // live replies have until the end of the revalidation
+   // period to confirm them
+   activeBrowse->staleTimer =
+      Tcl_CreateTimerHandler(bonjour_snapshot_revalidate(),
+                             bonjour_browse_stale_expire, activeBrowse);
+
+   // the callbacks may stop the browse or enter the
+   // event loop
+   Tcl_Preserve(activeBrowse);
+   Tcl_Preserve(interp);
+   Tcl_IncrRefCount(services);
+
+   Tcl_ListObjGetElements(NULL, services, &numElements, &elements);
+   for(i = 0; i + 1 < numElements; i += 2) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_DString key;
+
+      if(activeBrowse->stopped || activeBrowse->stale == NULL) {
+         break;
+      }
+
+      bonjour_browse_stale_key(&key, Tcl_GetString(elements[i]),
+                               Tcl_GetString(elements[i + 1]));
+      hashEntry = Tcl_FindHashEntry(activeBrowse->stale,
+                                    Tcl_DStringValue(&key));
+      Tcl_DStringFree(&key);
+
+      if(hashEntry == NULL ||
+         (int)(size_t)Tcl_GetHashValue(hashEntry) != STALE_PENDING) {
+         continue;
+      }
+      Tcl_SetHashValue(hashEntry, (ClientData)STALE_REPORTED);
+
+      if(bonjour_browse_eval(activeBrowse, "add",
+            Tcl_GetString(elements[i]),
+            Tcl_GetString(elements[i + 1])) == TCL_ERROR) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+         Tcl_BackgroundError(interp);
+      }
+   }
+
+   Tcl_DecrRefCount(services);
+   Tcl_Release(interp);
+   Tcl_Release(activeBrowse);
+}
+
+////////////////////////////////////////////////////
+// timer handler for the end of the revalidation
+// period.  stale services which weren't confirmed
+// are removed from the snapshot and reported as
+// removed.
+////////////////////////////////////////////////////
+static void bonjour_browse_stale_expire(
+   ClientData clientData
+) {
+   active_browse *activeBrowse = (active_browse *)clientData;
+   Tcl_Interp *interp = activeBrowse->interp;
+   Tcl_Obj *services = activeBrowse->staleList;
+   Tcl_HashTable *stale = activeBrowse->stale;
+   Tcl_Obj **elements;
+   int numElements, i;
+
+   // from here on replies are reported as usual
+   activeBrowse->staleTimer = NULL;
+   activeBrowse->staleList = NULL;
+   activeBrowse->stale = NULL;
+
+   Tcl_Preserve(activeBrowse);
+   Tcl_Preserve(interp);
+
+   Tcl_ListObjGetElements(NULL, services, &numElements, &elements);
+   for(i = 0; i + 1 < numElements; i += 2) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_DString key;
+      int state;
+
+      bonjour_browse_stale_key(&key, Tcl_GetString(elements[i]),
+                               Tcl_GetString(elements[i + 1]));
+      hashEntry = Tcl_FindHashEntry(stale, Tcl_DStringValue(&key));
+      Tcl_DStringFree(&key);
+
+      if(hashEntry == NULL) {
+         continue;
+      }
+      state = (int)(size_t)Tcl_GetHashValue(hashEntry);
+      Tcl_DeleteHashEntry(hashEntry);
+
+      bonjour_snapshot_expire(activeBrowse->regtype,
+                              Tcl_GetString(elements[i]),
+                              Tcl_GetString(elements[i + 1]));
+
+      if(state == STALE_REPORTED && !activeBrowse->stopped &&
+         bonjour_browse_eval(activeBrowse, "remove",
+            Tcl_GetString(elements[i]),
+            Tcl_GetString(elements[i + 1])) == TCL_ERROR) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+         Tcl_BackgroundError(interp);
+      }
+   }
+
+   Tcl_DeleteHashTable(stale);
+   ckfree((void *)stale);
+   Tcl_DecrRefCount(services);
+
+   Tcl_Release(interp);
+   Tcl_Release(activeBrowse);
+}
+
+////////////////////////////////////////////////////
+// marks a stale service as confirmed by a live
+// reply.  Returns non-zero if the reply should not
+// be reported, because it agrees with what the
+// callback has already been told.
+////////////////////////////////////////////////////
+static int bonjour_browse_stale_confirm(
+   active_browse *activeBrowse,
+   int add,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_DString key;
+   int state;
+
+   bonjour_browse_stale_key(&key, serviceName, domain);
+   hashEntry = Tcl_FindHashEntry(activeBrowse->stale, Tcl_DStringValue(&key));
+   Tcl_DStringFree(&key);
+
+   if(hashEntry == NULL) {
+      return(0);
+   }
+
+   state = (int)(size_t)Tcl_GetHashValue(hashEntry);
+   Tcl_DeleteHashEntry(hashEntry);
+
+   return(add ? (state == STALE_REPORTED) : (state == STALE_PENDING));
+}
+
+////////////////////////////////////////////////////
+// builds the key of a stale service
+////////////////////////////////////////////////////
+static void bonjour_browse_stale_key(
+   Tcl_DString *key,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_DStringInit(key);
+   Tcl_DStringAppend(key, serviceName, -1);
+   Tcl_DStringAppend(key, "\n", 1);
+   Tcl_DStringAppend(key, domain, -1);
+}
+
+////////////////////////////////////////////////////
+// handles a service being added or removed by a
+// browse with -match.  An added service is resolved
+// and only reported if its TXT record passes the
+// tests, and a removed one is only reported if it
+// was.
+////////////////////////////////////////////////////
+static int bonjour_browse_match(
+   active_browse *activeBrowse,
+   DNSServiceRef sdRef,
+   int add,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+) {
+   Tcl_DString key;
+   Tcl_HashEntry *hashEntry;
+   browse_match *browseMatch;
+   DNSServiceErrorType error;
+   int newFlag, result = TCL_OK;
+
+   bonjour_browse_stale_key(&key, serviceName, domain);
+   if(add) {
+      hashEntry = Tcl_CreateHashEntry(activeBrowse->matches,
+                                      Tcl_DStringValue(&key), &newFlag);
+      Tcl_DStringFree(&key);
+      if(!newFlag) {
+         return(TCL_OK);
+      }
+
+      browseMatch = (browse_match *)ckalloc(
+         sizeof(browse_match) + strlen(serviceName) + strlen(domain) + 1);
+      browseMatch->activeBrowse = activeBrowse;
+      browseMatch->hashEntry = hashEntry;
+      strcpy(browseMatch->serviceName, serviceName);
+      browseMatch->domain =
+         browseMatch->serviceName + strlen(serviceName) + 1;
+      strcpy(browseMatch->domain, domain);
+      Tcl_SetHashValue(hashEntry, browseMatch);
+
+      BONJOUR_PROBE3(operation__start, BONJOUR_OP_RESOLVE,
+                     browseMatch, serviceName);
+      error =
+         DNSServiceResolve(
+            &browseMatch->sdRef,
+            0,
+            activeBrowse->interfaceIndex,
+            serviceName,
+            regtype,
+            domain,
+            (DNSServiceResolveReply)bonjour_browse_match_callback,
+            browseMatch);
+      BONJOUR_TRACE(BONJOUR_TRACE_START, BONJOUR_OP_RESOLVE,
+                    (error == kDNSServiceErr_NoError) ? browseMatch->sdRef : NULL,
+                    0, 0, error, strlen(serviceName), 0);
+      if(error != kDNSServiceErr_NoError) {
+         BONJOUR_STATS_INCR(failed[BONJOUR_OP_RESOLVE]);
+         BONJOUR_PROBE3(operation__stop, BONJOUR_OP_RESOLVE,
+                        browseMatch, error);
+
+         Tcl_DeleteHashEntry(hashEntry);
+         ckfree((void *)browseMatch);
+
+         bonjour_stats_error(error);
+         Tcl_SetObjResult(activeBrowse->interp, create_dnsservice_error(
+            activeBrowse->interp, "DNSServiceResolve", error));
+         return(TCL_ERROR);
+      }
+
+      BONJOUR_STATS_INCR(started[BONJOUR_OP_RESOLVE]);
+      BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_RESOLVE]);
+      bonjour_create_file_handler(browseMatch->sdRef, BONJOUR_OP_RESOLVE);
+      bonjour_dispatch_watch(browseMatch->sdRef);
+
+      return(TCL_OK);
+   }
+
+   hashEntry = Tcl_FindHashEntry(activeBrowse->matches,
+                                 Tcl_DStringValue(&key));
+   Tcl_DStringFree(&key);
+   if(hashEntry != NULL) {
+      browseMatch = (browse_match *)Tcl_GetHashValue(hashEntry);
+
+      // a service still being resolved was never reported
+      int reported = (browseMatch->sdRef == NULL);
+      bonjour_browse_match_stop(browseMatch, 1);
+      if(reported) {
+         result = bonjour_browse_report(activeBrowse, sdRef, 0,
+                                        serviceName, domain);
+      }
+   }
+
+   return(result);
+}
+
+////////////////////////////////////////////////////
+// called when the resolve of a service found by a
+// browse with -match completes.  The TXT record is
+// tested without converting it to a Tcl list.
+////////////////////////////////////////////////////
+static void bonjour_browse_match_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord,
+   void *context
+) {
+   browse_match *browseMatch = (browse_match *)context;
+   active_browse *activeBrowse = browseMatch->activeBrowse;
+   Tcl_Interp *interp = activeBrowse->interp;
+
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_RESOLVE]);
+   BONJOUR_TRACE(BONJOUR_TRACE_REPLY, BONJOUR_OP_RESOLVE, sdRef,
+                 flags, interfaceIndex, errorCode, txtLen, ntohs(port));
+
+   if(errorCode != kDNSServiceErr_NoError) {
+      // the service just isn't reported
+      bonjour_stats_error(errorCode);
+      bonjour_browse_match_stop(browseMatch, 1);
+      return;
+   }
+
+   // the resolve is as good as any other for the snapshot
+   if(bonjourSnapshotEnabled) {
+      bonjour_snapshot_resolve(fullname, hosttarget, port,
+                               txtLen, txtRecord);
+   }
+
+   if(!txt_predicate_match(activeBrowse->match, txtLen, txtRecord)) {
+      bonjour_browse_match_stop(browseMatch, 1);
+      return;
+   }
+
+   // remember the service was reported, so that its
+   // removal is too.  The callback may stop the browse,
+   // freeing browseMatch.
+   bonjour_browse_match_stop(browseMatch, 0);
+   Tcl_Preserve(activeBrowse);
+   Tcl_Preserve(interp);
+   if(bonjour_browse_report(activeBrowse, activeBrowse->sdRef, 1,
+                            browseMatch->serviceName,
+                            browseMatch->domain) == TCL_ERROR) {
+      BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+      Tcl_BackgroundError(interp);
+   }
+   Tcl_Release(interp);
+   Tcl_Release(activeBrowse);
+}
+
+////////////////////////////////////////////////////
+// stops the resolve of a service found by a browse
+// with -match, if still running, and if forget is
+// set removes the service from the browse's table
+// and frees browseMatch
+////////////////////////////////////////////////////
+static void bonjour_browse_match_stop(
+   browse_match *browseMatch,
+   int forget
+) {
+   if(browseMatch->sdRef != NULL) {
+      bonjour_delete_file_handler(browseMatch->sdRef);
+      bonjour_dispatch_unwatch(browseMatch->sdRef);
+      DNSServiceRefDeallocate(browseMatch->sdRef);
+      BONJOUR_TRACE(BONJOUR_TRACE_STOP, BONJOUR_OP_RESOLVE, browseMatch->sdRef,
+                    0, 0, 0, 0, 0);
+      browseMatch->sdRef = NULL;
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_RESOLVE]);
+      BONJOUR_PROBE3(operation__stop, BONJOUR_OP_RESOLVE, browseMatch, 0);
+   }
+
+   if(forget) {
+      Tcl_DeleteHashEntry(browseMatch->hashEntry);
+      ckfree((void *)browseMatch);
+   }
+}
+
+////////////////////////////////////////////////////
+// tracks the interfaces a service is present on for
+// a browse started with -dedupe.  Returns non-zero
+// if the reply should be reported, being the add
+// which finds the service on its first interface or
+// the remove which loses it from its last one.
+////////////////////////////////////////////////////
+static int bonjour_browse_dedupe(
+   active_browse *activeBrowse,
+   int add,
+   uint32_t interfaceIndex,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_DString key;
+   Tcl_HashEntry *hashEntry, *interfaceEntry;
+   Tcl_HashTable *interfaces = NULL;
+   int newFlag, report = 1;
+
+   bonjour_browse_stale_key(&key, serviceName, domain);
+   if(add) {
+      hashEntry = Tcl_CreateHashEntry(activeBrowse->interfaces,
+                                      Tcl_DStringValue(&key), &newFlag);
+      if(newFlag) {
+         interfaces = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+         Tcl_InitHashTable(interfaces, TCL_ONE_WORD_KEYS);
+         Tcl_SetHashValue(hashEntry, interfaces);
+      }
+      else {
+         interfaces = (Tcl_HashTable *)Tcl_GetHashValue(hashEntry);
+      }
+
+      // a repeated add on an interface already
+      // holding the service changes nothing
+      Tcl_CreateHashEntry(interfaces, (char *)(size_t)interfaceIndex,
+                          &newFlag);
+      report = (newFlag && interfaces->numEntries == 1);
+   }
+   else {
+      // a service which was never added is passed on, it
+      // may have been reported from the snapshot
+      hashEntry = Tcl_FindHashEntry(activeBrowse->interfaces,
+                                    Tcl_DStringValue(&key));
+      if(hashEntry != NULL) {
+         interfaces = (Tcl_HashTable *)Tcl_GetHashValue(hashEntry);
+         interfaceEntry = Tcl_FindHashEntry(interfaces,
+                                            (char *)(size_t)interfaceIndex);
+         if(interfaceEntry == NULL) {
+            // not present on this interface, so
+            // nothing is lost
+            report = 0;
+         }
+         else {
+            Tcl_DeleteHashEntry(interfaceEntry);
+            if(interfaces->numEntries == 0) {
+               Tcl_DeleteHashTable(interfaces);
+               ckfree((void *)interfaces);
+               Tcl_DeleteHashEntry(hashEntry);
+            }
+            else {
+               report = 0;
+            }
+         }
+      }
+   }
+   Tcl_DStringFree(&key);
+
+   return(report);
+}
+
+////////////////////////////////////////////////////
+// frees the -dedupe interface sets of a browse
+////////////////////////////////////////////////////
+static void bonjour_browse_dedupe_free(
+   Tcl_HashTable *interfaces
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+   Tcl_HashTable *serviceInterfaces;
+
+   for(hashEntry = Tcl_FirstHashEntry(interfaces, &searchToken);
        hashEntry != NULL;
        hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      serviceInterfaces = (Tcl_HashTable *)Tcl_GetHashValue(hashEntry);
+      Tcl_DeleteHashTable(serviceInterfaces);
+      ckfree((void *)serviceInterfaces);
+   }
+   Tcl_DeleteHashTable(interfaces);
+   ckfree((void *)interfaces);
+}
 
-      activeBrowse = (active_browse *)Tcl_GetHashValue(hashEntry);
+////////////////////////////////////////////////////
+// appends a change to a browse's change log,
+// discarding the oldest change if the log is full
+////////////////////////////////////////////////////
+static void bonjour_browse_log(
+   browse_log *log,
+   const char *action,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_DString key;
+   Tcl_Obj *change;
+   int newFlag, present;
 
-      // remove the file handler
-      Tcl_DeleteFileHandler(DNSServiceRefSockFD(activeBrowse->sdRef));
+   // keep track of the services currently present
+   bonjour_browse_stale_key(&key, serviceName, domain);
+   if(action[0] == 'a') {
+      hashEntry = Tcl_CreateHashEntry(&log->services,
+                                      Tcl_DStringValue(&key), &newFlag);
+      present = newFlag ? 0 : (int)(size_t)Tcl_GetHashValue(hashEntry);
+      Tcl_SetHashValue(hashEntry, (ClientData)(size_t)(present + 1));
+   }
+   else {
+      hashEntry = Tcl_FindHashEntry(&log->services, Tcl_DStringValue(&key));
+      if(hashEntry != NULL) {
+         present = (int)(size_t)Tcl_GetHashValue(hashEntry);
+         if(present <= 1) {
+            Tcl_DeleteHashEntry(hashEntry);
+         }
+         else {
+            Tcl_SetHashValue(hashEntry, (ClientData)(size_t)(present - 1));
+         }
+      }
+   }
+   Tcl_DStringFree(&key);
 
-      // deallocate the browse service reference
-      DNSServiceRefDeallocate(activeBrowse->sdRef);
+   log->seq++;
+   change = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(NULL, change, Tcl_NewWideIntObj(log->seq));
+   Tcl_ListObjAppendElement(NULL, change, Tcl_NewStringObj(action, -1));
+   Tcl_ListObjAppendElement(NULL, change, Tcl_NewStringObj(serviceName, -1));
+   Tcl_ListObjAppendElement(NULL, change, Tcl_NewStringObj(domain, -1));
+   Tcl_IncrRefCount(change);
+
+   if(log->count == BROWSE_LOG_SIZE) {
+      Tcl_DecrRefCount(log->changes[log->first]);
+      log->changes[log->first] = change;
+      log->first = (log->first + 1) % BROWSE_LOG_SIZE;
+   }
+   else {
+      log->changes[(log->first + log->count) % BROWSE_LOG_SIZE] = change;
+      log->count++;
+   }
+}
+
+////////////////////////////////////////////////////
+// returns the changes reported by a browse after
+// the given sequence number.  If some of them have
+// already been discarded from the log, every
+// service currently present is returned as added.
+////////////////////////////////////////////////////
+static int bonjour_browse_changes(
+   Tcl_Interp *interp,
+   const char *const regtype,
+   Tcl_WideInt since,
+   Tcl_HashTable *browseRegistrations
+) {
+   Tcl_HashEntry *hashEntry;
+   active_browse *activeBrowse;
+   browse_log *log;
+   Tcl_Obj *result, *changes;
+   int full, i;
+
+   hashEntry = Tcl_FindHashEntry(browseRegistrations, regtype);
+   if(hashEntry == NULL) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "regtype ", regtype, " is not being browsed", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+   activeBrowse = (active_browse *)Tcl_GetHashValue(hashEntry);
+   log = activeBrowse->log;
+
+   // the log is only kept when asked for, and never
+   // for several regtypes
+   if(log == NULL) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "browse ", regtype,
+         (activeBrowse->members != NULL) ?
+            " covers several regtypes and keeps no change log" :
+            " keeps no change log, start it with -log", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+
+   if(since > log->seq) {
+      since = log->seq;
+   }
+
+   changes = Tcl_NewListObj(0, NULL);
+   full = (since < log->seq - log->count);
+   if(full) {
+      Tcl_HashSearch searchToken;
+
+      for(hashEntry = Tcl_FirstHashEntry(&log->services, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         const char *key = Tcl_GetHashKey(&log->services, hashEntry);
+         const char *separator = strchr(key, '\n');
+         Tcl_Obj *change = Tcl_NewListObj(0, NULL);
+
+         Tcl_ListObjAppendElement(NULL, change, Tcl_NewWideIntObj(log->seq));
+         Tcl_ListObjAppendElement(NULL, change, Tcl_NewStringObj("add", -1));
+         Tcl_ListObjAppendElement(NULL, change,
+            Tcl_NewStringObj(key, separator - key));
+         Tcl_ListObjAppendElement(NULL, change,
+            Tcl_NewStringObj(separator + 1, -1));
+         Tcl_ListObjAppendElement(NULL, changes, change);
+      }
+   }
+   else {
+      // the changes after since are at the end of the ring
+      for(i = log->count - (int)(log->seq - since); i < log->count; i++) {
+         if(i >= 0) {
+            Tcl_ListObjAppendElement(NULL, changes,
+               log->changes[(log->first + i) % BROWSE_LOG_SIZE]);
+         }
+      }
+   }
 
-      // clean up the memory used by activeBrowse
-      ckfree(activeBrowse->regtype);
-      ckfree((void *)activeBrowse);
+   result = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("seq", -1));
+   Tcl_ListObjAppendElement(NULL, result, Tcl_NewWideIntObj(log->seq));
+   Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("full", -1));
+   Tcl_ListObjAppendElement(NULL, result, Tcl_NewBooleanObj(full));
+   Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj("changes", -1));
+   Tcl_ListObjAppendElement(NULL, result, changes);
+   Tcl_SetObjResult(interp, result);
 
-      // let Tcl know the callback object is no longer
-      // in use
-      Tcl_DecrRefCount(activeBrowse->callback);
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// allocates an empty reply queue
+////////////////////////////////////////////////////
+static browse_queue *bonjour_browse_queue_new(
+   int limit,
+   int policy
+) {
+   browse_queue *queue = (browse_queue *)ckalloc(sizeof(browse_queue));
+
+   queue->limit = limit;
+   queue->policy = policy;
+   queue->head = NULL;
+   queue->tail = NULL;
+   queue->length = 0;
+   Tcl_InitHashTable(&queue->pending, TCL_STRING_KEYS);
+   queue->timer = NULL;
+   queue->paused = 0;
+
+   return(queue);
+}
+
+////////////////////////////////////////////////////
+// adds a reply to a browse's queue, applying the
+// queue's policy if it is full
+////////////////////////////////////////////////////
+static void bonjour_browse_enqueue(
+   active_browse *activeBrowse,
+   int add,
+   const char *serviceName,
+   const char *domain
+) {
+   browse_queue *queue = activeBrowse->queue;
+   browse_event *event;
+   Tcl_HashEntry *hashEntry = NULL;
+   size_t nameLength = strlen(serviceName);
+   int newFlag;
+
+   if(queue->policy == QUEUE_COALESCE || queue->policy == QUEUE_GROW) {
+      Tcl_DString key;
+
+      // a reply undoing one still in the queue cancels it
+      bonjour_browse_stale_key(&key, serviceName, domain);
+      hashEntry = Tcl_CreateHashEntry(&queue->pending,
+                                      Tcl_DStringValue(&key), &newFlag);
+      Tcl_DStringFree(&key);
+      if(!newFlag) {
+         event = (browse_event *)Tcl_GetHashValue(hashEntry);
+         if(event->add != add) {
+            BONJOUR_STATS_INCR(coalesced[BONJOUR_OP_BROWSE]);
+            bonjour_browse_dequeue(queue, event);
+            ckfree((void *)event);
+            return;
+         }
+
+         // the new reply takes over the entry, which may
+         // be deleted while the old one is still queued
+         event->hashEntry = NULL;
+      }
+   }
+
+   if(queue->length >= queue->limit &&
+      (queue->policy == QUEUE_COALESCE ||
+       queue->policy == QUEUE_DROP_OLDEST)) {
+      event = queue->head;
+      BONJOUR_STATS_INCR(dropped[BONJOUR_OP_BROWSE]);
+      bonjour_browse_dequeue(queue, event);
+      ckfree((void *)event);
+   }
+
+   // the name and domain are stored after the structure
+   event = (browse_event *)ckalloc(
+      sizeof(browse_event) + nameLength + strlen(domain) + 1);
+   strcpy(event->serviceName, serviceName);
+   event->domain = event->serviceName + nameLength + 1;
+   strcpy(event->domain, domain);
+   event->add = add;
+   event->hashEntry = hashEntry;
+   if(hashEntry != NULL) {
+      Tcl_SetHashValue(hashEntry, event);
+   }
+
+   event->next = NULL;
+   event->prev = queue->tail;
+   if(queue->tail != NULL) {
+      queue->tail->next = event;
+   }
+   else {
+      queue->head = event;
+   }
+   queue->tail = event;
+   queue->length++;
+
+   // stop reading until the callback catches up
+   if(queue->policy == QUEUE_PAUSE && !queue->paused &&
+      queue->length >= queue->limit && activeBrowse->sdRef != NULL) {
+      BONJOUR_STATS_INCR(pauses[BONJOUR_OP_BROWSE]);
+      bonjour_delete_file_handler(activeBrowse->sdRef);
+      queue->paused = 1;
+   }
+
+   if(queue->timer == NULL) {
+      queue->timer =
+         Tcl_CreateTimerHandler(0, bonjour_browse_drain, activeBrowse);
+   }
+}
+
+////////////////////////////////////////////////////
+// unlinks a reply from a browse's queue without
+// freeing it
+////////////////////////////////////////////////////
+static void bonjour_browse_dequeue(
+   browse_queue *queue,
+   browse_event *event
+) {
+   if(event->prev != NULL) {
+      event->prev->next = event->next;
+   }
+   else {
+      queue->head = event->next;
+   }
+   if(event->next != NULL) {
+      event->next->prev = event->prev;
+   }
+   else {
+      queue->tail = event->prev;
+   }
+   queue->length--;
+
+   if(event->hashEntry != NULL) {
+      Tcl_DeleteHashEntry(event->hashEntry);
+   }
+}
+
+////////////////////////////////////////////////////
+// timer handler delivering the replies in a
+// browse's queue.  Only those queued when it
+// starts are delivered, so that reading can
+// carry on in between.
+////////////////////////////////////////////////////
+static void bonjour_browse_drain(
+   ClientData clientData
+) {
+   active_browse *activeBrowse = (active_browse *)clientData;
+   browse_queue *queue = activeBrowse->queue;
+   Tcl_Interp *interp = activeBrowse->interp;
+   int count;
+
+   queue->timer = NULL;
+
+   // take everything the daemon has sent so far off
+   // the socket before running the callbacks
+   bonjour_browse_read(activeBrowse);
+   count = queue->length;
+
+   // the callbacks may stop the browse or enter the
+   // event loop
+   Tcl_Preserve(activeBrowse);
+   Tcl_Preserve(interp);
+
+   while(count-- > 0 && !activeBrowse->stopped && queue->head != NULL) {
+      browse_event *event;
+
+      // give way to resolves, and leave the rest for
+      // a later pass once the budget is used up
+      if(!bonjour_dispatch_browse()) {
+         break;
+      }
+      if(activeBrowse->stopped || queue->head == NULL) {
+         break;
+      }
+      event = queue->head;
+
+      bonjour_browse_dequeue(queue, event);
+
+      // resume reading once the queue is half empty
+      if(queue->paused && queue->length <= queue->limit / 2) {
+         bonjour_create_file_handler(activeBrowse->sdRef, BONJOUR_OP_BROWSE);
+         queue->paused = 0;
+      }
+
+      if(bonjour_browse_eval(activeBrowse,
+            event->add ? "add" : "remove",
+            event->serviceName, event->domain) == TCL_ERROR) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+         Tcl_BackgroundError(interp);
+      }
+      ckfree((void *)event);
+   }
+
+   if(!activeBrowse->stopped && queue->head != NULL && queue->timer == NULL) {
+      queue->timer =
+         Tcl_CreateTimerHandler(0, bonjour_browse_drain, activeBrowse);
+   }
+
+   Tcl_Release(interp);
+   Tcl_Release(activeBrowse);
+}
+
+////////////////////////////////////////////////////
+// processes the replies waiting on a queued
+// browse's socket, up to the queue's limit.  This
+// is safe because replies to a queued browse are
+// only added to the queue.  A shared connection
+// also carries replies for other regtypes, so it
+// is left to its file handler.
+////////////////////////////////////////////////////
+static void bonjour_browse_read(
+   active_browse *activeBrowse
+) {
+   browse_queue *queue = activeBrowse->queue;
+   struct pollfd pollFd;
+   int count;
+
+   if(activeBrowse->sdRef == NULL || activeBrowse->group != NULL) {
+      return;
+   }
+
+   pollFd.fd = DNSServiceRefSockFD(activeBrowse->sdRef);
+   pollFd.events = POLLIN;
+   for(count = 0; count < queue->limit && !queue->paused; count++) {
+      if(poll(&pollFd, 1, 0) <= 0 || !(pollFd.revents & POLLIN)) {
+         break;
+      }
+      bonjour_tcl_callback((ClientData)activeBrowse->sdRef, TCL_READABLE);
+   }
+}
+
+////////////////////////////////////////////////////
+// delivers a recorded browse reply to a callback
+// script, used by ::bonjour::replay
+////////////////////////////////////////////////////
+void bonjour_browse_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+) {
+   active_browse activeBrowse;
+
+   activeBrowse.sdRef = NULL;
+   activeBrowse.regtype = (char *)regtype;
+   activeBrowse.callback = callback;
+   activeBrowse.interp = interp;
+   activeBrowse.startTime = 0;
+   activeBrowse.subscriber = NULL;
+   activeBrowse.staleList = NULL;
+   activeBrowse.stale = NULL;
+   activeBrowse.staleTimer = NULL;
+   activeBrowse.stopped = 0;
+   activeBrowse.log = NULL;
+   activeBrowse.queue = NULL;
+   activeBrowse.interfaceIndex = 0;
+   activeBrowse.interfaces = NULL;
+   activeBrowse.match = NULL;
+   activeBrowse.matches = NULL;
+   activeBrowse.group = NULL;
+   activeBrowse.members = NULL;
+   activeBrowse.numMembers = 0;
+
+   Tcl_IncrRefCount(callback);
+   bonjour_browse_callback(NULL, flags, interfaceIndex, errorCode,
+                           serviceName, regtype, domain, &activeBrowse);
+   Tcl_DecrRefCount(callback);
+}
+
+////////////////////////////////////////////////////
+// cleanup any leftover browsing
+////////////////////////////////////////////////////
+static void bonjour_browse_cleanup(
+   ClientData clientData
+) {
+   Tcl_HashTable *browseRegistrations = NULL;
+   Tcl_HashEntry *hashEntry = NULL;
+   Tcl_HashSearch searchToken;
+   active_browse *activeBrowse = NULL;
+
+   browseRegistrations = (Tcl_HashTable *)clientData;
+
+   // run through the remaining entries in the hash table
+   for(hashEntry = Tcl_FirstHashEntry(browseRegistrations,
+                                      &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+
+      activeBrowse = (active_browse *)Tcl_GetHashValue(hashEntry);
+      bonjour_browse_free(activeBrowse);
 
       // deallocate the hash entry
       Tcl_DeleteHashEntry(hashEntry);
    } // end loop over hash entries
+}
 
-   Tcl_DeleteHashTable(browseRegistrations);
+////////////////////////////////////////////////////
+// called when the interpreter is deleted to stop
+// its browse operations and free the hash table
+////////////////////////////////////////////////////
+static void bonjour_browse_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *browseRegistrations = (Tcl_HashTable *)clientData;
 
-   return TCL_OK;
+   Tcl_DeleteThreadExitHandler(bonjour_browse_cleanup, browseRegistrations);
+   bonjour_browse_cleanup(browseRegistrations);
+
+   Tcl_DeleteHashTable(browseRegistrations);
+   ckfree((void *)browseRegistrations);
 }
@@ -0,0 +1,298 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <poll.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "dispatch.h"
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// per-thread dispatch state
+typedef struct {
+   int initialized;     // non-zero once the state exists
+   int budget;          // browse callbacks allowed per pass of
+                        // the notifier, or zero for no limit
+   int used;            // browse callbacks run in this pass
+   Tcl_HashTable priority; // service references of resolves in
+                           // progress
+} dispatch_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_dispatch_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static dispatch_thread_data *bonjour_dispatch_data(void);
+static void bonjour_dispatch_setup(
+   ClientData clientData,
+   int flags
+);
+static void bonjour_dispatch_priority(
+   dispatch_thread_data *tsdPtr
+);
+static void bonjour_dispatch_cleanup(
+   ClientData clientData
+);
+
+////////////////////////////////////////////////////
+// Function to initialize dispatch related stuff
+////////////////////////////////////////////////////
+int Dispatch_Init(
+   Tcl_Interp *interp
+) {
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::dispatch", bonjour_dispatch_cmd,
+      NULL, NULL
+   );
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::dispatch command
+////////////////////////////////////////////////////
+static int bonjour_dispatch_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *options[] = { "-browsebudget", NULL };
+   dispatch_thread_data *tsdPtr = bonjour_dispatch_data();
+   Tcl_Obj *result;
+   int i, index, budget;
+
+   if(objc % 2 != 1) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-browsebudget <count>?");
+      return(TCL_ERROR);
+   }
+
+   for(i = 1; i < objc; i += 2) {
+      if(Tcl_GetIndexFromObj(
+            interp, objv[i], options, "option", 0, &index
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+
+      if(Tcl_GetIntFromObj(interp, objv[i + 1], &budget) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+      if(budget < 0) {
+         Tcl_SetResult(interp, "-browsebudget must not be negative", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+      tsdPtr->budget = budget;
+   }
+
+   result = Tcl_NewDictObj();
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("browsebudget", -1),
+      Tcl_NewIntObj(tsdPtr->budget));
+   Tcl_SetObjResult(interp, result);
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// returns the calling thread's dispatch state,
+// creating it if need be
+////////////////////////////////////////////////////
+static dispatch_thread_data *bonjour_dispatch_data(void) {
+   dispatch_thread_data *tsdPtr;
+
+   tsdPtr = (dispatch_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(dispatch_thread_data));
+   if(!tsdPtr->initialized) {
+      Tcl_InitHashTable(&tsdPtr->priority, TCL_ONE_WORD_KEYS);
+      Tcl_CreateEventSource(bonjour_dispatch_setup, NULL, tsdPtr);
+      Tcl_CreateThreadExitHandler(bonjour_dispatch_cleanup, tsdPtr);
+      tsdPtr->initialized = 1;
+   }
+
+   return(tsdPtr);
+}
+
+////////////////////////////////////////////////////
+// registers a resolve's service reference for
+// priority processing
+////////////////////////////////////////////////////
+void bonjour_dispatch_watch(
+   DNSServiceRef sdRef
+) {
+   dispatch_thread_data *tsdPtr = bonjour_dispatch_data();
+   int newFlag;
+
+   Tcl_CreateHashEntry(&tsdPtr->priority, (char *)sdRef, &newFlag);
+}
+
+////////////////////////////////////////////////////
+// removes a service reference registered with
+// bonjour_dispatch_watch
+////////////////////////////////////////////////////
+void bonjour_dispatch_unwatch(
+   DNSServiceRef sdRef
+) {
+   dispatch_thread_data *tsdPtr;
+   Tcl_HashEntry *hashEntry;
+
+   // resolves may be stopped after the state has been
+   // deleted at thread exit
+   tsdPtr = (dispatch_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(dispatch_thread_data));
+   if(!tsdPtr->initialized) {
+      return;
+   }
+
+   hashEntry = Tcl_FindHashEntry(&tsdPtr->priority, (char *)sdRef);
+   if(hashEntry != NULL) {
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+}
+
+////////////////////////////////////////////////////
+// returns non-zero if the thread has a browse budget
+////////////////////////////////////////////////////
+int bonjour_dispatch_budgeted(void) {
+   return(bonjour_dispatch_data()->budget > 0);
+}
+
+////////////////////////////////////////////////////
+// called before running a browse callback from the
+// event loop.  Processes any replies waiting for
+// resolves, then takes one callback from the budget.
+////////////////////////////////////////////////////
+int bonjour_dispatch_browse(void) {
+   dispatch_thread_data *tsdPtr = bonjour_dispatch_data();
+
+   if(tsdPtr->budget == 0) {
+      return(1);
+   }
+
+   bonjour_dispatch_priority(tsdPtr);
+
+   if(tsdPtr->used >= tsdPtr->budget) {
+      return(0);
+   }
+   tsdPtr->used++;
+
+   return(1);
+}
+
+////////////////////////////////////////////////////
+// event source setup procedure, called before the
+// notifier waits.  Starts a new budget.
+////////////////////////////////////////////////////
+static void bonjour_dispatch_setup(
+   ClientData clientData,
+   int flags
+) {
+   dispatch_thread_data *tsdPtr = (dispatch_thread_data *)clientData;
+
+   tsdPtr->used = 0;
+}
+
+////////////////////////////////////////////////////
+// processes the replies waiting for resolves
+////////////////////////////////////////////////////
+static void bonjour_dispatch_priority(
+   dispatch_thread_data *tsdPtr
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+   struct pollfd *pollFds;
+   DNSServiceRef *refs;
+   int numRefs = 0, i;
+
+   if(tsdPtr->priority.numEntries == 0) {
+      return;
+   }
+
+   // the callbacks may start and stop resolves, so work
+   // from a copy of the table
+   refs = (DNSServiceRef *)ckalloc(
+      tsdPtr->priority.numEntries * sizeof(DNSServiceRef));
+   pollFds = (struct pollfd *)ckalloc(
+      tsdPtr->priority.numEntries * sizeof(struct pollfd));
+   for(hashEntry = Tcl_FirstHashEntry(&tsdPtr->priority, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      refs[numRefs] = (DNSServiceRef)
+         Tcl_GetHashKey(&tsdPtr->priority, hashEntry);
+      pollFds[numRefs].fd = DNSServiceRefSockFD(refs[numRefs]);
+      pollFds[numRefs].events = POLLIN;
+      numRefs++;
+   }
+
+   if(poll(pollFds, numRefs, 0) > 0) {
+      for(i = 0; i < numRefs; i++) {
+         if(!(pollFds[i].revents & POLLIN)) {
+            continue;
+         }
+
+         // an earlier callback may have stopped this resolve
+         // and another may since have been given the same
+         // reference, so check it is still ready
+         if(Tcl_FindHashEntry(&tsdPtr->priority, (char *)refs[i]) == NULL ||
+            poll(&pollFds[i], 1, 0) <= 0 ||
+            !(pollFds[i].revents & POLLIN)) {
+            continue;
+         }
+
+         bonjour_tcl_callback((ClientData)refs[i], TCL_READABLE);
+      }
+   }
+
+   ckfree((void *)pollFds);
+   ckfree((void *)refs);
+}
+
+////////////////////////////////////////////////////
+// deletes the dispatch state when the thread exits
+////////////////////////////////////////////////////
+static void bonjour_dispatch_cleanup(
+   ClientData clientData
+) {
+   dispatch_thread_data *tsdPtr = (dispatch_thread_data *)clientData;
+
+   Tcl_DeleteEventSource(bonjour_dispatch_setup, NULL, tsdPtr);
+   Tcl_DeleteHashTable(&tsdPtr->priority);
+   tsdPtr->initialized = 0;
+}
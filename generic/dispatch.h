@@ -0,0 +1,62 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __DISPATCH_H
+#define __DISPATCH_H
+
+////////////////////////////////////////////////////
+// Prioritized dispatch.  Each thread may set a
+// budget on the number of browse callbacks run per
+// pass of the notifier.  While a budget is set,
+// browse replies are queued and delivered from a
+// timer handler, and before each one the replies
+// waiting for resolves are processed, so that a
+// flood of browse replies can't hold up resolves.
+////////////////////////////////////////////////////
+
+// registers a resolve's service reference for
+// priority processing
+void bonjour_dispatch_watch(
+   DNSServiceRef sdRef
+);
+
+// removes a service reference registered with
+// bonjour_dispatch_watch
+void bonjour_dispatch_unwatch(
+   DNSServiceRef sdRef
+);
+
+// returns non-zero if the thread has a browse budget
+int bonjour_dispatch_budgeted(void);
+
+// called before running a browse callback from the
+// event loop.  Processes any replies waiting for
+// resolves, then takes one callback from the budget,
+// returning zero if it has been used up.
+int bonjour_dispatch_browse(void);
+
+#endif
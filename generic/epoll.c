@@ -0,0 +1,267 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifdef BONJOUR_ENABLE_EPOLL
+
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "epoll.h"
+
+// maximum number of ready sockets collected per check
+#define BONJOUR_EPOLL_BATCH 64
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// a service reference registered in the epoll set
+typedef struct {
+   DNSServiceRef sdRef; // the service discovery reference
+   int fd;              // its socket
+   int queued;          // non-zero while an event is queued
+} epoll_ref;
+
+// the event queued for a ready service reference
+typedef struct {
+   Tcl_Event header;
+   epoll_ref *ref;
+} epoll_ref_event;
+
+// per-thread epoll state
+typedef struct {
+   int active;          // non-zero while the epoll set exists
+   int epollFd;         // the epoll set
+   Tcl_HashTable refs;  // epoll_ref structures hashed on the
+                        // service reference
+} epoll_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static void bonjour_epoll_wakeup(
+   ClientData clientData,
+   int mask
+);
+static void bonjour_epoll_check(
+   ClientData clientData,
+   int flags
+);
+static int bonjour_epoll_dispatch(
+   Tcl_Event *evPtr,
+   int flags
+);
+static int bonjour_epoll_match(
+   Tcl_Event *evPtr,
+   ClientData clientData
+);
+
+////////////////////////////////////////////////////
+// starts watching the socket of a service reference
+////////////////////////////////////////////////////
+int bonjour_epoll_watch(
+   DNSServiceRef sdRef
+) {
+   epoll_thread_data *tsdPtr;
+   struct epoll_event event;
+   Tcl_HashEntry *hashEntry;
+   epoll_ref *ref;
+   int newFlag;
+
+   tsdPtr = (epoll_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(epoll_thread_data));
+
+   // create the epoll set when the first reference
+   // is watched.  the epoll descriptor itself is
+   // registered with the notifier so that it wakes
+   // up when any reference is ready
+   if(!tsdPtr->active) {
+      tsdPtr->epollFd = epoll_create(BONJOUR_EPOLL_BATCH);
+      if(tsdPtr->epollFd < 0) {
+         return(0);
+      }
+
+      Tcl_InitHashTable(&tsdPtr->refs, TCL_ONE_WORD_KEYS);
+      Tcl_CreateEventSource(NULL, bonjour_epoll_check, tsdPtr);
+      Tcl_CreateFileHandler(tsdPtr->epollFd, TCL_READABLE,
+                            bonjour_epoll_wakeup, NULL);
+      tsdPtr->active = 1;
+   }
+
+   hashEntry = Tcl_CreateHashEntry(&tsdPtr->refs, (char *)sdRef, &newFlag);
+   if(!newFlag) {
+      return(1);
+   }
+
+   ref = (epoll_ref *)ckalloc(sizeof(epoll_ref));
+   ref->sdRef = sdRef;
+   ref->fd = DNSServiceRefSockFD(sdRef);
+   ref->queued = 0;
+
+   event.events = EPOLLIN;
+   event.data.ptr = ref;
+   if(epoll_ctl(tsdPtr->epollFd, EPOLL_CTL_ADD, ref->fd, &event) != 0) {
+      ckfree((void *)ref);
+      Tcl_DeleteHashEntry(hashEntry);
+      return(0);
+   }
+
+   Tcl_SetHashValue(hashEntry, ref);
+
+   return(1);
+}
+
+////////////////////////////////////////////////////
+// stops watching the socket of a service reference,
+// discarding any event already queued for it
+////////////////////////////////////////////////////
+int bonjour_epoll_unwatch(
+   DNSServiceRef sdRef
+) {
+   epoll_thread_data *tsdPtr;
+   Tcl_HashEntry *hashEntry;
+   epoll_ref *ref;
+
+   tsdPtr = (epoll_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(epoll_thread_data));
+   if(!tsdPtr->active) {
+      return(0);
+   }
+
+   hashEntry = Tcl_FindHashEntry(&tsdPtr->refs, (char *)sdRef);
+   if(hashEntry == NULL) {
+      return(0);
+   }
+
+   ref = (epoll_ref *)Tcl_GetHashValue(hashEntry);
+   epoll_ctl(tsdPtr->epollFd, EPOLL_CTL_DEL, ref->fd, NULL);
+   if(ref->queued) {
+      Tcl_DeleteEvents(bonjour_epoll_match, ref);
+   }
+   ckfree((void *)ref);
+   Tcl_DeleteHashEntry(hashEntry);
+
+   // tear down the epoll set once the last reference
+   // is gone
+   if(tsdPtr->refs.numEntries == 0) {
+      Tcl_DeleteFileHandler(tsdPtr->epollFd);
+      Tcl_DeleteEventSource(NULL, bonjour_epoll_check, tsdPtr);
+      close(tsdPtr->epollFd);
+      Tcl_DeleteHashTable(&tsdPtr->refs);
+      tsdPtr->active = 0;
+   }
+
+   return(1);
+}
+
+////////////////////////////////////////////////////
+// file handler for the epoll descriptor.  the work
+// is done by bonjour_epoll_check, this only exists
+// to wake the notifier
+////////////////////////////////////////////////////
+static void bonjour_epoll_wakeup(
+   ClientData clientData,
+   int mask
+) {
+}
+
+////////////////////////////////////////////////////
+// event source check procedure.  queues an event for
+// each service reference that is ready and does not
+// already have one queued
+////////////////////////////////////////////////////
+static void bonjour_epoll_check(
+   ClientData clientData,
+   int flags
+) {
+   epoll_thread_data *tsdPtr = (epoll_thread_data *)clientData;
+   struct epoll_event events[BONJOUR_EPOLL_BATCH];
+   int numEvents, i;
+
+   if(!(flags & TCL_FILE_EVENTS) || !tsdPtr->active) {
+      return;
+   }
+
+   numEvents = epoll_wait(tsdPtr->epollFd, events, BONJOUR_EPOLL_BATCH, 0);
+   for(i = 0; i < numEvents; i++) {
+      epoll_ref *ref = (epoll_ref *)events[i].data.ptr;
+      epoll_ref_event *refEvent;
+
+      if(ref->queued) {
+         continue;
+      }
+
+      refEvent = (epoll_ref_event *)ckalloc(sizeof(epoll_ref_event));
+      refEvent->header.proc = bonjour_epoll_dispatch;
+      refEvent->ref = ref;
+      ref->queued = 1;
+      Tcl_QueueEvent(&refEvent->header, TCL_QUEUE_TAIL);
+   }
+}
+
+////////////////////////////////////////////////////
+// processes the result waiting on a service
+// reference
+////////////////////////////////////////////////////
+static int bonjour_epoll_dispatch(
+   Tcl_Event *evPtr,
+   int flags
+) {
+   epoll_ref *ref = ((epoll_ref_event *)evPtr)->ref;
+
+   if(!(flags & TCL_FILE_EVENTS)) {
+      return(0);
+   }
+
+   // the callback may stop the operation and free the
+   // reference, so it must not be touched afterwards
+   ref->queued = 0;
+   bonjour_tcl_callback((ClientData)ref->sdRef, TCL_READABLE);
+
+   return(1);
+}
+
+////////////////////////////////////////////////////
+// matches the event queued for a reference, used
+// with Tcl_DeleteEvents
+////////////////////////////////////////////////////
+static int bonjour_epoll_match(
+   Tcl_Event *evPtr,
+   ClientData clientData
+) {
+   return(evPtr->proc == bonjour_epoll_dispatch &&
+          ((epoll_ref_event *)evPtr)->ref == (epoll_ref *)clientData);
+}
+
+#endif
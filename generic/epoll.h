@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __EPOLL_H
+#define __EPOLL_H
+
+////////////////////////////////////////////////////
+// epoll based dispatch.  When configured with
+// --enable-epoll, the sockets of all service
+// references are registered in a single epoll set
+// per thread.  A Tcl event source queues an event
+// only for the references that are ready, so the
+// cost of dispatch depends on the number of active
+// sockets rather than the total, and the sockets
+// are not subject to the notifier's FD_SETSIZE
+// limit.
+////////////////////////////////////////////////////
+
+#ifdef BONJOUR_ENABLE_EPOLL
+
+// starts watching the socket of a service reference,
+// returning zero if epoll could not be used
+int bonjour_epoll_watch(
+   DNSServiceRef sdRef
+);
+
+// stops watching the socket of a service reference,
+// returning zero if it was not being watched
+int bonjour_epoll_unwatch(
+   DNSServiceRef sdRef
+);
+
+#endif
+
+#endif
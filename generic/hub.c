@@ -0,0 +1,721 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "hub.h"
+#include "probes.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifdef TCL_THREADS
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+typedef struct hub_browse hub_browse;
+
+// a thread subscribed to a shared browse
+struct hub_subscriber {
+   hub_browse *browse;      // the browse subscribed to
+   Tcl_ThreadId threadId;   // the subscribing thread
+   DNSServiceBrowseReply reply; // called for each reply
+   void *context;           // passed to reply
+   hub_subscriber *next;    // next subscriber to the browse
+};
+
+// a browse shared by one or more subscribers
+struct hub_browse {
+   DNSServiceRef sdRef;     // the service discovery reference,
+                            // NULL once the browse has stopped
+   char *regtype;           // the regtype being browsed
+   Tcl_HashEntry *hashEntry; // entry in hub.browses, NULL once
+                             // new subscribers can't attach
+   hub_subscriber *subscribers; // list of subscribers
+   Tcl_HashTable instances; // hub_instance structures for the
+                            // services currently found
+   hub_browse *nextDead;    // next browse waiting to be freed
+                            // by the hub thread
+};
+
+// a service currently found by a shared browse
+typedef struct {
+   uint32_t interfaceIndex;
+   char *serviceName;
+   char *domain;
+} hub_instance;
+
+// a reply queued for a subscriber.  The strings are
+// stored following the structure.
+typedef struct {
+   Tcl_Event header;
+   hub_subscriber *subscriber;
+   DNSServiceFlags flags;
+   uint32_t interfaceIndex;
+   DNSServiceErrorType errorCode;
+   char *serviceName;
+   char *regtype;
+   char *domain;
+} hub_event;
+
+// the hub, protected by hubMutex
+static struct {
+   int initialized;         // non-zero once browses is initialized
+   int running;             // non-zero while the hub thread runs
+   int shutdown;            // asks the hub thread to exit
+   Tcl_ThreadId threadId;   // the hub thread
+   int wakeup[2];           // pipe used to wake the hub thread
+   Tcl_HashTable browses;   // hub_browse structures hashed on
+                            // the regtype
+   hub_browse *dead;        // browses waiting to be freed
+} hub;
+
+TCL_DECLARE_MUTEX(hubMutex)
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static Tcl_ThreadCreateType bonjour_hub_thread(
+   ClientData clientData
+);
+static void bonjour_hub_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain,
+   void *context
+);
+static void bonjour_hub_queue(
+   hub_subscriber *subscriber,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+);
+static int bonjour_hub_dispatch(
+   Tcl_Event *evPtr,
+   int flags
+);
+static int bonjour_hub_match(
+   Tcl_Event *evPtr,
+   ClientData clientData
+);
+static void bonjour_hub_wake(void);
+static void bonjour_hub_stop_browse(
+   hub_browse *browse,
+   DNSServiceErrorType errorCode
+);
+static void bonjour_hub_free_browse(
+   hub_browse *browse
+);
+static void bonjour_hub_shutdown(
+   ClientData clientData
+);
+
+////////////////////////////////////////////////////
+// subscribes to the shared browse of a regtype
+////////////////////////////////////////////////////
+hub_subscriber *bonjour_hub_subscribe(
+   const char *regtype,
+   DNSServiceBrowseReply reply,
+   void *context,
+   DNSServiceErrorType *errorCode
+) {
+   hub_browse *browse;
+   hub_subscriber *subscriber;
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+   int newFlag;
+
+   Tcl_MutexLock(&hubMutex);
+
+   if(!hub.initialized) {
+      Tcl_InitHashTable(&hub.browses, TCL_STRING_KEYS);
+      Tcl_CreateExitHandler(bonjour_hub_shutdown, NULL);
+      hub.initialized = 1;
+   }
+
+   // start the hub thread with the first subscriber
+   if(!hub.running) {
+      if(pipe(hub.wakeup) != 0) {
+         Tcl_MutexUnlock(&hubMutex);
+         *errorCode = kDNSServiceErr_NoMemory;
+         return(NULL);
+      }
+      fcntl(hub.wakeup[0], F_SETFL, O_NONBLOCK);
+      fcntl(hub.wakeup[1], F_SETFL, O_NONBLOCK);
+      if(Tcl_CreateThread(&hub.threadId, bonjour_hub_thread, NULL,
+            TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+         close(hub.wakeup[0]);
+         close(hub.wakeup[1]);
+         Tcl_MutexUnlock(&hubMutex);
+         *errorCode = kDNSServiceErr_NoMemory;
+         return(NULL);
+      }
+      hub.running = 1;
+   }
+
+   // find the browse for this regtype, starting it if
+   // this is the first subscriber
+   hashEntry = Tcl_CreateHashEntry(&hub.browses, regtype, &newFlag);
+   if(newFlag) {
+      browse = (hub_browse *)ckalloc(sizeof(hub_browse));
+      browse->regtype = (char *)ckalloc(strlen(regtype) + 1);
+      strcpy(browse->regtype, regtype);
+      browse->hashEntry = hashEntry;
+      browse->subscribers = NULL;
+      browse->nextDead = NULL;
+      Tcl_InitHashTable(&browse->instances, TCL_STRING_KEYS);
+
+      BONJOUR_PROBE3(operation__start, BONJOUR_OP_BROWSE, browse, regtype);
+      *errorCode =
+         DNSServiceBrowse(
+            &browse->sdRef,
+            0, 0, regtype, NULL,
+            bonjour_hub_callback,
+            browse);
+      BONJOUR_TRACE(BONJOUR_TRACE_START, BONJOUR_OP_BROWSE,
+                    (*errorCode == kDNSServiceErr_NoError) ? browse->sdRef : NULL,
+                    0, 0, *errorCode, strlen(regtype), 0);
+      if(*errorCode != kDNSServiceErr_NoError) {
+         BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+         BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, browse, *errorCode);
+
+         browse->sdRef = NULL;
+         Tcl_DeleteHashEntry(hashEntry);
+         bonjour_hub_free_browse(browse);
+         Tcl_MutexUnlock(&hubMutex);
+         return(NULL);
+      }
+
+      BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_INCR(openFds);
+
+      Tcl_SetHashValue(hashEntry, browse);
+
+      // have the hub thread start watching the new socket
+      bonjour_hub_wake();
+   }
+   else {
+      browse = (hub_browse *)Tcl_GetHashValue(hashEntry);
+   }
+
+   subscriber = (hub_subscriber *)ckalloc(sizeof(hub_subscriber));
+   subscriber->browse = browse;
+   subscriber->threadId = Tcl_GetCurrentThread();
+   subscriber->reply = reply;
+   subscriber->context = context;
+   subscriber->next = browse->subscribers;
+   browse->subscribers = subscriber;
+
+   // bring the new subscriber up to date with the services
+   // already found
+   for(hashEntry = Tcl_FirstHashEntry(&browse->instances, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      hub_instance *instance = (hub_instance *)Tcl_GetHashValue(hashEntry);
+
+      bonjour_hub_queue(subscriber, kDNSServiceFlagsAdd,
+                        instance->interfaceIndex, kDNSServiceErr_NoError,
+                        instance->serviceName, browse->regtype,
+                        instance->domain);
+   }
+
+   Tcl_MutexUnlock(&hubMutex);
+
+   *errorCode = kDNSServiceErr_NoError;
+   return(subscriber);
+}
+
+////////////////////////////////////////////////////
+// unsubscribes from a shared browse, stopping the
+// browse if this was the last subscriber
+////////////////////////////////////////////////////
+void bonjour_hub_unsubscribe(
+   hub_subscriber *subscriber
+) {
+   hub_browse *browse;
+   hub_subscriber **link;
+
+   Tcl_MutexLock(&hubMutex);
+
+   browse = subscriber->browse;
+   for(link = &browse->subscribers; *link != NULL; link = &(*link)->next) {
+      if(*link == subscriber) {
+         *link = subscriber->next;
+         break;
+      }
+   }
+
+   if(browse->subscribers == NULL) {
+      if(browse->hashEntry != NULL) {
+         Tcl_DeleteHashEntry(browse->hashEntry);
+         browse->hashEntry = NULL;
+      }
+
+      // the hub thread may be polling the socket, so
+      // leave it to free the browse
+      if(browse->sdRef != NULL && hub.running) {
+         browse->nextDead = hub.dead;
+         hub.dead = browse;
+         bonjour_hub_wake();
+      }
+      else {
+         bonjour_hub_free_browse(browse);
+      }
+   }
+
+   Tcl_MutexUnlock(&hubMutex);
+
+   // no more replies can be queued for the subscriber,
+   // discard those already waiting
+   Tcl_DeleteEvents(bonjour_hub_match, subscriber);
+   ckfree((void *)subscriber);
+}
+
+////////////////////////////////////////////////////
+// the hub thread.  polls the sockets of all shared
+// browses and processes their replies.
+////////////////////////////////////////////////////
+static Tcl_ThreadCreateType bonjour_hub_thread(
+   ClientData clientData
+) {
+   struct pollfd *fds = NULL;
+   hub_browse **polled = NULL;
+   int size = 0;
+
+   for(;;) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_HashSearch searchToken;
+      int numFds = 1, i;
+
+      Tcl_MutexLock(&hubMutex);
+
+      // free the browses which no longer have subscribers
+      while(hub.dead != NULL) {
+         hub_browse *browse = hub.dead;
+         hub.dead = browse->nextDead;
+         bonjour_hub_free_browse(browse);
+      }
+
+      if(hub.shutdown) {
+         Tcl_MutexUnlock(&hubMutex);
+         break;
+      }
+
+      // build the set of sockets to poll
+      if(size < hub.browses.numEntries + 1) {
+         size = 2 * (hub.browses.numEntries + 1);
+         fds = (struct pollfd *)ckrealloc((char *)fds,
+            size * sizeof(struct pollfd));
+         polled = (hub_browse **)ckrealloc((char *)polled,
+            size * sizeof(hub_browse *));
+      }
+
+      fds[0].fd = hub.wakeup[0];
+      fds[0].events = POLLIN;
+      polled[0] = NULL;
+      for(hashEntry = Tcl_FirstHashEntry(&hub.browses, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         hub_browse *browse = (hub_browse *)Tcl_GetHashValue(hashEntry);
+
+         fds[numFds].fd = DNSServiceRefSockFD(browse->sdRef);
+         fds[numFds].events = POLLIN;
+         polled[numFds] = browse;
+         numFds++;
+      }
+
+      Tcl_MutexUnlock(&hubMutex);
+
+      if(poll(fds, numFds, -1) < 0) {
+         continue;
+      }
+
+      if(fds[0].revents) {
+         char buffer[64];
+         while(read(hub.wakeup[0], buffer, sizeof(buffer)) > 0)
+            ;
+      }
+
+      // process the replies.  browses polled above are
+      // only freed by this thread, but may have been
+      // stopped in the meantime
+      Tcl_MutexLock(&hubMutex);
+      for(i = 1; i < numFds; i++) {
+         hub_browse *browse = polled[i];
+         DNSServiceErrorType error;
+
+         if(!fds[i].revents || browse->sdRef == NULL ||
+            browse->subscribers == NULL) {
+            continue;
+         }
+
+         BONJOUR_STATS_INCR(events);
+         BONJOUR_PROBE1(process__start, browse->sdRef);
+         error = DNSServiceProcessResult(browse->sdRef);
+         BONJOUR_PROBE2(process__done, browse->sdRef, error);
+         BONJOUR_TRACE(BONJOUR_TRACE_PROCESS, BONJOUR_OP_BROWSE, browse->sdRef,
+                       0, 0, error, 0, 0);
+         if(error != kDNSServiceErr_NoError) {
+            bonjour_stats_error(error);
+            bonjour_hub_stop_browse(browse, error);
+         }
+      }
+      Tcl_MutexUnlock(&hubMutex);
+   }
+
+   ckfree((char *)fds);
+   ckfree((char *)polled);
+
+   TCL_THREAD_CREATE_RETURN;
+}
+
+////////////////////////////////////////////////////
+// called by DNSServiceProcessResult in the hub
+// thread, with hubMutex held.  keeps track of the
+// services found and copies the reply to every
+// subscriber.
+////////////////////////////////////////////////////
+static void bonjour_hub_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain,
+   void *context
+) {
+   hub_browse *browse = (hub_browse *)context;
+   hub_subscriber *subscriber;
+
+   if(bonjourRecording) {
+      bonjour_record_browse(flags, interfaceIndex, errorCode,
+                            serviceName, regtype, domain);
+   }
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_BROWSE]);
+
+   if(errorCode == kDNSServiceErr_NoError) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_DString key;
+      char index[16];
+      int newFlag;
+
+      // services are identified by name, domain and interface
+      sprintf(index, "%u", (unsigned int)interfaceIndex);
+      Tcl_DStringInit(&key);
+      Tcl_DStringAppend(&key, serviceName, -1);
+      Tcl_DStringAppend(&key, "\n", 1);
+      Tcl_DStringAppend(&key, domain, -1);
+      Tcl_DStringAppend(&key, "\n", 1);
+      Tcl_DStringAppend(&key, index, -1);
+
+      if(flags & kDNSServiceFlagsAdd) {
+         hashEntry = Tcl_CreateHashEntry(&browse->instances,
+            Tcl_DStringValue(&key), &newFlag);
+         if(newFlag) {
+            hub_instance *instance =
+               (hub_instance *)ckalloc(sizeof(hub_instance));
+            instance->interfaceIndex = interfaceIndex;
+            instance->serviceName = (char *)ckalloc(strlen(serviceName) + 1);
+            strcpy(instance->serviceName, serviceName);
+            instance->domain = (char *)ckalloc(strlen(domain) + 1);
+            strcpy(instance->domain, domain);
+            Tcl_SetHashValue(hashEntry, instance);
+         }
+      }
+      else {
+         hashEntry = Tcl_FindHashEntry(&browse->instances,
+            Tcl_DStringValue(&key));
+         if(hashEntry != NULL) {
+            hub_instance *instance = (hub_instance *)Tcl_GetHashValue(hashEntry);
+            ckfree(instance->serviceName);
+            ckfree(instance->domain);
+            ckfree((void *)instance);
+            Tcl_DeleteHashEntry(hashEntry);
+         }
+      }
+
+      Tcl_DStringFree(&key);
+   }
+   else {
+      // counted once here rather than by each subscriber
+      bonjour_stats_error(errorCode);
+   }
+
+   for(subscriber = browse->subscribers;
+       subscriber != NULL;
+       subscriber = subscriber->next) {
+      bonjour_hub_queue(subscriber, flags, interfaceIndex, errorCode,
+                        serviceName, regtype, domain);
+   }
+}
+
+////////////////////////////////////////////////////
+// queues a reply for a subscriber and wakes its
+// thread
+////////////////////////////////////////////////////
+static void bonjour_hub_queue(
+   hub_subscriber *subscriber,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+) {
+   size_t nameLen, regtypeLen, domainLen;
+   hub_event *event;
+
+   if(serviceName == NULL) serviceName = "";
+   if(regtype == NULL) regtype = "";
+   if(domain == NULL) domain = "";
+   nameLen = strlen(serviceName) + 1;
+   regtypeLen = strlen(regtype) + 1;
+   domainLen = strlen(domain) + 1;
+
+   event = (hub_event *)ckalloc(
+      sizeof(hub_event) + nameLen + regtypeLen + domainLen);
+   event->header.proc = bonjour_hub_dispatch;
+   event->subscriber = subscriber;
+   event->flags = flags;
+   event->interfaceIndex = interfaceIndex;
+   event->errorCode = errorCode;
+   event->serviceName = (char *)(event + 1);
+   memcpy(event->serviceName, serviceName, nameLen);
+   event->regtype = event->serviceName + nameLen;
+   memcpy(event->regtype, regtype, regtypeLen);
+   event->domain = event->regtype + regtypeLen;
+   memcpy(event->domain, domain, domainLen);
+
+   Tcl_ThreadQueueEvent(subscriber->threadId, &event->header, TCL_QUEUE_TAIL);
+   Tcl_ThreadAlert(subscriber->threadId);
+}
+
+////////////////////////////////////////////////////
+// delivers a reply in the subscribing thread
+////////////////////////////////////////////////////
+static int bonjour_hub_dispatch(
+   Tcl_Event *evPtr,
+   int flags
+) {
+   hub_event *event = (hub_event *)evPtr;
+   hub_subscriber *subscriber = event->subscriber;
+
+   if(!(flags & TCL_FILE_EVENTS)) {
+      return(0);
+   }
+
+   // the reply may unsubscribe, so the subscriber must
+   // not be touched afterwards
+   subscriber->reply(NULL, event->flags, event->interfaceIndex,
+                     event->errorCode, event->serviceName,
+                     event->regtype, event->domain,
+                     subscriber->context);
+
+   return(1);
+}
+
+////////////////////////////////////////////////////
+// matches the replies queued for a subscriber, used
+// with Tcl_DeleteEvents
+////////////////////////////////////////////////////
+static int bonjour_hub_match(
+   Tcl_Event *evPtr,
+   ClientData clientData
+) {
+   return(evPtr->proc == bonjour_hub_dispatch &&
+          ((hub_event *)evPtr)->subscriber == (hub_subscriber *)clientData);
+}
+
+////////////////////////////////////////////////////
+// wakes the hub thread so that it rebuilds its set
+// of sockets.  Called with hubMutex held.
+////////////////////////////////////////////////////
+static void bonjour_hub_wake(void) {
+   char byte = 0;
+
+   while(write(hub.wakeup[1], &byte, 1) < 0 && errno == EINTR)
+      ;
+}
+
+////////////////////////////////////////////////////
+// stops a browse which has failed, letting its
+// subscribers know.  New subscribers will start a
+// fresh browse.  Called with hubMutex held.
+////////////////////////////////////////////////////
+static void bonjour_hub_stop_browse(
+   hub_browse *browse,
+   DNSServiceErrorType errorCode
+) {
+   hub_subscriber *subscriber;
+
+   for(subscriber = browse->subscribers;
+       subscriber != NULL;
+       subscriber = subscriber->next) {
+      bonjour_hub_queue(subscriber, 0, 0, errorCode,
+                        NULL, browse->regtype, NULL);
+   }
+
+   if(browse->hashEntry != NULL) {
+      Tcl_DeleteHashEntry(browse->hashEntry);
+      browse->hashEntry = NULL;
+   }
+
+   DNSServiceRefDeallocate(browse->sdRef);
+   BONJOUR_TRACE(BONJOUR_TRACE_STOP, BONJOUR_OP_BROWSE, browse->sdRef,
+                 0, 0, errorCode, 0, 0);
+   browse->sdRef = NULL;
+   BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+   BONJOUR_STATS_DECR(openFds);
+   BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, browse, errorCode);
+}
+
+////////////////////////////////////////////////////
+// stops a browse, if still running, and frees the
+// structure describing it.  Called with hubMutex
+// held.
+////////////////////////////////////////////////////
+static void bonjour_hub_free_browse(
+   hub_browse *browse
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   if(browse->sdRef != NULL) {
+      DNSServiceRefDeallocate(browse->sdRef);
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_DECR(openFds);
+      BONJOUR_TRACE(BONJOUR_TRACE_STOP, BONJOUR_OP_BROWSE, browse->sdRef,
+                    0, 0, 0, 0, 0);
+      BONJOUR_PROBE3(operation__stop, BONJOUR_OP_BROWSE, browse, 0);
+   }
+
+   for(hashEntry = Tcl_FirstHashEntry(&browse->instances, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      hub_instance *instance = (hub_instance *)Tcl_GetHashValue(hashEntry);
+      ckfree(instance->serviceName);
+      ckfree(instance->domain);
+      ckfree((void *)instance);
+   }
+   Tcl_DeleteHashTable(&browse->instances);
+
+   ckfree(browse->regtype);
+   ckfree((void *)browse);
+}
+
+////////////////////////////////////////////////////
+// stops the hub thread and all shared browses when
+// the process exits.  Subscribers keep their
+// browse structures until they unsubscribe.
+////////////////////////////////////////////////////
+static void bonjour_hub_shutdown(
+   ClientData clientData
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+   int result;
+
+   Tcl_MutexLock(&hubMutex);
+   if(!hub.running) {
+      Tcl_MutexUnlock(&hubMutex);
+      return;
+   }
+   hub.shutdown = 1;
+   bonjour_hub_wake();
+   Tcl_MutexUnlock(&hubMutex);
+
+   Tcl_JoinThread(hub.threadId, &result);
+
+   Tcl_MutexLock(&hubMutex);
+   for(hashEntry = Tcl_FirstHashEntry(&hub.browses, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      hub_browse *browse = (hub_browse *)Tcl_GetHashValue(hashEntry);
+
+      DNSServiceRefDeallocate(browse->sdRef);
+      browse->sdRef = NULL;
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_DECR(openFds);
+
+      browse->hashEntry = NULL;
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+   while(hub.dead != NULL) {
+      hub_browse *browse = hub.dead;
+      hub.dead = browse->nextDead;
+      bonjour_hub_free_browse(browse);
+   }
+
+   close(hub.wakeup[0]);
+   close(hub.wakeup[1]);
+   hub.running = 0;
+   hub.shutdown = 0;
+   Tcl_MutexUnlock(&hubMutex);
+}
+
+#else
+
+////////////////////////////////////////////////////
+// Without thread support there is no hub and shared
+// browses are not available
+////////////////////////////////////////////////////
+hub_subscriber *bonjour_hub_subscribe(
+   const char *regtype,
+   DNSServiceBrowseReply reply,
+   void *context,
+   DNSServiceErrorType *errorCode
+) {
+   *errorCode = kDNSServiceErr_Unsupported;
+   return(NULL);
+}
+
+void bonjour_hub_unsubscribe(
+   hub_subscriber *subscriber
+) {
+}
+
+#endif
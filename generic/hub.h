@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __HUB_H
+#define __HUB_H
+
+////////////////////////////////////////////////////
+// Process-wide browse hub.  Shared browses of the
+// same regtype, from any thread or interpreter, are
+// served by a single DNSServiceBrowse owned by a
+// hub thread.  Each reply is copied to every
+// subscriber through its thread's event queue, and
+// the browse is stopped when its last subscriber
+// unsubscribes.  Requires a threaded Tcl.
+////////////////////////////////////////////////////
+
+typedef struct hub_subscriber hub_subscriber;
+
+// subscribes to the shared browse of a regtype,
+// starting it if necessary.  reply is called with a
+// NULL service reference in the subscribing thread
+// for each reply, beginning with an add for every
+// service the browse has already found.  Returns NULL
+// and sets errorCode on failure.
+hub_subscriber *bonjour_hub_subscribe(
+   const char *regtype,
+   DNSServiceBrowseReply reply,
+   void *context,
+   DNSServiceErrorType *errorCode
+);
+
+// unsubscribes, discarding any replies still queued
+// for the subscriber.  Must be called from the
+// subscribing thread.
+void bonjour_hub_unsubscribe(
+   hub_subscriber *subscriber
+);
+
+#endif
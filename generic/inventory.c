@@ -0,0 +1,913 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <string.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "stats.h"
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// the regtype browsed for service types, which the
+// daemon answers with one "service" per regtype
+#define INVENTORY_META_REGTYPE "_services._dns-sd._udp"
+
+// number of regtypes browsed at once by default
+#define INVENTORY_DEFAULT_LIMIT 8
+
+// ms a regtype is browsed for by default before making way
+// for a waiting one.  Without it, a regtype beyond the limit
+// would wait for as long as the first ones exist.
+#define INVENTORY_DEFAULT_DWELL 1000
+
+// states of a regtype found by an inventory
+enum {
+   TYPE_WAITING,        // waiting for a browse to finish
+   TYPE_BROWSING,       // being browsed
+   TYPE_DONE            // not browsed, as its browse failed
+};
+
+// a regtype found by an inventory
+typedef struct inventory_type {
+   struct active_inventory *inventory;
+   Tcl_HashEntry *hashEntry; // entry in the inventory's types,
+                             // whose key is the regtype
+   int count;           // adds less removes of the regtype,
+                        // which is found on each interface
+   int state;           // one of the TYPE_ values
+   DNSServiceRef sdRef; // the browse, while browsing
+   Tcl_TimerToken dwellTimer; // ends the browse after the dwell
+                              // time, or NULL
+   struct inventory_type *prev, *next; // the waiting list
+   Tcl_HashTable services; // adds less removes of each service
+                           // found, hashed on "name\ndomain",
+                           // or 0 until the current browse
+                           // finds it again
+} inventory_type;
+
+// information on an inventory currently in progress
+typedef struct active_inventory {
+   DNSServiceRef sdRef; // the connection shared by every browse
+   DNSServiceRef metaRef; // the browse for regtypes
+   Tcl_Obj *callback;   // the callback script
+   Tcl_Interp *interp;  // interpreter in which to execute the
+                        // callback
+   int limit;           // most regtypes browsed at once
+   int dwell;           // ms each regtype is browsed for while
+                        // others wait, or 0 to browse it for as
+                        // long as it exists
+   int browsing;        // number of regtypes being browsed
+   Tcl_HashTable types; // inventory_type hashed on regtype
+   inventory_type *waitHead, *waitTail; // regtypes waiting
+                                        // to be browsed
+   int stopped;         // set once the inventory has been stopped
+} active_inventory;
+
+// each interpreter stores its active_inventory structures,
+// hashed on their handles, in a hash table kept as assoc
+// data under this key
+#define BONJOUR_INVENTORY_ASSOC "bonjour::inventory"
+
+// handles are numbered per thread, which makes them unique
+// within each interpreter
+typedef struct {
+   unsigned long nextHandle;
+} inventory_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_inventory(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_inventory_start(
+   Tcl_Interp *interp,
+   Tcl_Obj *const callbackScript,
+   int limit,
+   int dwell,
+   Tcl_HashTable *inventories
+);
+static void bonjour_inventory_free(
+   active_inventory *inventory
+);
+static void bonjour_inventory_release(
+   char *blockPtr
+);
+static void bonjour_inventory_meta_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+);
+static void bonjour_inventory_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+);
+static void bonjour_inventory_schedule(
+   active_inventory *inventory
+);
+static void bonjour_inventory_wait(
+   inventory_type *type
+);
+static void bonjour_inventory_end(
+   inventory_type *type
+);
+static void bonjour_inventory_dwell(
+   ClientData clientData
+);
+static Tcl_Obj *bonjour_inventory_drop(
+   inventory_type *type,
+   int all
+);
+static Tcl_Obj *bonjour_inventory_forget(
+   inventory_type *type
+);
+static void bonjour_inventory_report(
+   active_inventory *inventory,
+   const char *regtype,
+   Tcl_Obj *removed
+);
+static int bonjour_inventory_eval(
+   active_inventory *inventory,
+   const char *action,
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+);
+static void bonjour_inventory_cleanup(
+   ClientData clientData
+);
+static void bonjour_inventory_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+);
+
+////////////////////////////////////////////////////
+// Function to initialize inventory related stuff
+////////////////////////////////////////////////////
+int Inventory_Init(
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *inventories;
+
+   // the package may already be loaded in this interpreter
+   if(Tcl_GetAssocData(interp, BONJOUR_INVENTORY_ASSOC, NULL) != NULL) {
+      return TCL_OK;
+   }
+
+   // initialize the hash table, which is deleted along
+   // with the interpreter
+   inventories = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(inventories, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, BONJOUR_INVENTORY_ASSOC,
+                    bonjour_inventory_delete, inventories);
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::inventory", bonjour_inventory,
+      inventories, NULL
+   );
+
+   // create an exit handler for cleanup
+   Tcl_CreateThreadExitHandler(
+      bonjour_inventory_cleanup,
+      inventories
+   );
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::inventory command
+////////////////////////////////////////////////////
+static int bonjour_inventory(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *subcommands[] = {
+      "start", "stop", NULL
+   };
+   static const char *options[] = {
+      "-limit", "-dwell", NULL
+   };
+   Tcl_HashTable *inventories = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
+   int limit = INVENTORY_DEFAULT_LIMIT, dwell = INVENTORY_DEFAULT_DWELL;
+   int cmdIndex, optIndex, value, i;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<sub-command> <args>");
+      return(TCL_ERROR);
+   }
+
+   if(Tcl_GetIndexFromObj(
+         interp, objv[1], subcommands, "subcommand", 0, &cmdIndex
+      ) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   switch(cmdIndex) {
+   case 0: // start
+      if(objc % 2 != 1) {
+         Tcl_WrongNumArgs(interp, 2, objv,
+            "?-limit <count>? ?-dwell <ms>? <callback>");
+         return(TCL_ERROR);
+      }
+
+      for(i = 2; i < objc - 1; i += 2) {
+         if(Tcl_GetIndexFromObj(
+               interp, objv[i], options, "option", 0, &optIndex
+            ) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+         if(Tcl_GetIntFromObj(interp, objv[i + 1], &value) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+
+         switch(optIndex) {
+         case 0: // -limit
+            if(value < 1) {
+               Tcl_SetResult(interp, "-limit must be positive", TCL_STATIC);
+               return(TCL_ERROR);
+            }
+            limit = value;
+            break;
+         case 1: // -dwell
+            if(value < 0) {
+               Tcl_SetResult(interp, "-dwell must not be negative", TCL_STATIC);
+               return(TCL_ERROR);
+            }
+            dwell = value;
+            break;
+         }
+      }
+
+      return(bonjour_inventory_start(
+         interp, objv[objc - 1], limit, dwell, inventories));
+   case 1: // stop
+      if(objc != 3) {
+         Tcl_WrongNumArgs(interp, 2, objv, "<handle>");
+         return(TCL_ERROR);
+      }
+
+      hashEntry = Tcl_FindHashEntry(inventories, Tcl_GetString(objv[2]));
+      if(hashEntry != NULL) {
+         bonjour_inventory_free(
+            (active_inventory *)Tcl_GetHashValue(hashEntry));
+         Tcl_DeleteHashEntry(hashEntry);
+      }
+      break;
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// starts an inventory, returning its handle.  The
+// browse for regtypes and the browses of the
+// regtypes it finds share one connection.
+////////////////////////////////////////////////////
+static int bonjour_inventory_start(
+   Tcl_Interp *interp,
+   Tcl_Obj *const callbackScript,
+   int limit,
+   int dwell,
+   Tcl_HashTable *inventories
+) {
+   active_inventory *inventory;
+   inventory_thread_data *tsdPtr;
+   Tcl_HashEntry *hashEntry;
+   DNSServiceErrorType error;
+   char handle[32];
+   int newFlag;
+
+   inventory = (active_inventory *)ckalloc(sizeof(active_inventory));
+   inventory->callback = callbackScript;
+   Tcl_IncrRefCount(inventory->callback);
+   inventory->interp = interp;
+   inventory->limit = limit;
+   inventory->dwell = dwell;
+   inventory->browsing = 0;
+   Tcl_InitHashTable(&inventory->types, TCL_STRING_KEYS);
+   inventory->waitHead = NULL;
+   inventory->waitTail = NULL;
+   inventory->stopped = 0;
+
+   error = DNSServiceCreateConnection(&inventory->sdRef);
+   if(error != kDNSServiceErr_NoError) {
+      bonjour_inventory_release((char *)inventory);
+      bonjour_stats_error(error);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceCreateConnection", error));
+      return(TCL_ERROR);
+   }
+
+   inventory->metaRef = inventory->sdRef;
+   error =
+      DNSServiceBrowse(
+         &inventory->metaRef,
+         kDNSServiceFlagsShareConnection, 0, INVENTORY_META_REGTYPE, NULL,
+         bonjour_inventory_meta_callback,
+         inventory);
+   if(error != kDNSServiceErr_NoError) {
+      BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+      DNSServiceRefDeallocate(inventory->sdRef);
+      bonjour_inventory_release((char *)inventory);
+      bonjour_stats_error(error);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceBrowse", error));
+      return(TCL_ERROR);
+   }
+   BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+   BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+
+   bonjour_create_file_handler(inventory->sdRef, BONJOUR_OP_BROWSE);
+
+   tsdPtr = (inventory_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(inventory_thread_data));
+   sprintf(handle, "inventory%lu", ++tsdPtr->nextHandle);
+
+   hashEntry = Tcl_CreateHashEntry(inventories, handle, &newFlag);
+   Tcl_SetHashValue(hashEntry, inventory);
+   Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// stops an inventory and frees the structure
+// describing it once it is no longer in use
+////////////////////////////////////////////////////
+static void bonjour_inventory_free(
+   active_inventory *inventory
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   // the browses sharing the connection are stopped
+   // before it is closed
+   for(hashEntry = Tcl_FirstHashEntry(&inventory->types, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      inventory_type *type = (inventory_type *)Tcl_GetHashValue(hashEntry);
+
+      bonjour_inventory_end(type);
+      Tcl_DeleteHashTable(&type->services);
+      ckfree((void *)type);
+   }
+   Tcl_DeleteHashTable(&inventory->types);
+   inventory->waitHead = inventory->waitTail = NULL;
+
+   DNSServiceRefDeallocate(inventory->metaRef);
+   BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+   bonjour_delete_file_handler(inventory->sdRef);
+   DNSServiceRefDeallocate(inventory->sdRef);
+
+   // a callback may still be using inventory
+   inventory->stopped = 1;
+   Tcl_EventuallyFree(inventory, bonjour_inventory_release);
+}
+
+////////////////////////////////////////////////////
+// frees an active_inventory structure
+////////////////////////////////////////////////////
+static void bonjour_inventory_release(
+   char *blockPtr
+) {
+   active_inventory *inventory = (active_inventory *)blockPtr;
+
+   if(!inventory->stopped) {
+      Tcl_DeleteHashTable(&inventory->types);
+   }
+   Tcl_DecrRefCount(inventory->callback);
+   ckfree((void *)inventory);
+}
+
+////////////////////////////////////////////////////
+// called when a regtype is found or lost by the
+// browse for regtypes.  A regtype which is found
+// waits its turn to be browsed.  One which is lost
+// stops being browsed, and the services found for
+// it are reported removed.
+////////////////////////////////////////////////////
+static void bonjour_inventory_meta_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+) {
+   active_inventory *inventory = (active_inventory *)context;
+   Tcl_Interp *interp = inventory->interp;
+   inventory_type *type;
+   Tcl_HashEntry *hashEntry;
+   Tcl_DString regtype;
+   Tcl_Obj *removed;
+   int newFlag;
+   const char *dot;
+
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_BROWSE]);
+
+   if(errorCode != kDNSServiceErr_NoError) {
+      bonjour_stats_error(errorCode);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceBrowseReply", errorCode));
+      BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+      Tcl_BackgroundError(interp);
+      return;
+   }
+
+   // a regtype is reported as the service name "_http"
+   // of type "_tcp.local."
+   dot = strchr(replyType, '.');
+   Tcl_DStringInit(&regtype);
+   Tcl_DStringAppend(&regtype, serviceName, -1);
+   Tcl_DStringAppend(&regtype, ".", 1);
+   Tcl_DStringAppend(&regtype, replyType,
+      (dot == NULL) ? -1 : (int)(dot - replyType));
+
+   if(flags & kDNSServiceFlagsAdd) {
+      hashEntry = Tcl_CreateHashEntry(
+         &inventory->types, Tcl_DStringValue(&regtype), &newFlag);
+      Tcl_DStringFree(&regtype);
+      if(newFlag) {
+         type = (inventory_type *)ckalloc(sizeof(inventory_type));
+         type->inventory = inventory;
+         type->hashEntry = hashEntry;
+         type->count = 0;
+         type->state = TYPE_WAITING;
+         type->sdRef = NULL;
+         type->dwellTimer = NULL;
+         Tcl_InitHashTable(&type->services, TCL_STRING_KEYS);
+         Tcl_SetHashValue(hashEntry, type);
+         bonjour_inventory_wait(type);
+      }
+      type = (inventory_type *)Tcl_GetHashValue(hashEntry);
+      type->count++;
+
+      bonjour_inventory_schedule(inventory);
+      return;
+   }
+
+   hashEntry = Tcl_FindHashEntry(&inventory->types, Tcl_DStringValue(&regtype));
+   if(hashEntry == NULL) {
+      Tcl_DStringFree(&regtype);
+      return;
+   }
+   type = (inventory_type *)Tcl_GetHashValue(hashEntry);
+   if(--type->count > 0) {
+      Tcl_DStringFree(&regtype);
+      return;
+   }
+
+   // the regtype is gone from every interface, so its
+   // browse makes way for another before the removals
+   // are reported
+   removed = bonjour_inventory_forget(type);
+   Tcl_IncrRefCount(removed);
+   bonjour_inventory_schedule(inventory);
+   bonjour_inventory_report(inventory, Tcl_DStringValue(&regtype), removed);
+   Tcl_DecrRefCount(removed);
+   Tcl_DStringFree(&regtype);
+}
+
+////////////////////////////////////////////////////
+// called when a service is found or lost by the
+// browse of a regtype.  Each is reported once,
+// however many interfaces it is found on.
+////////////////////////////////////////////////////
+static void bonjour_inventory_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+) {
+   inventory_type *type = (inventory_type *)context;
+   active_inventory *inventory = type->inventory;
+   Tcl_Interp *interp = inventory->interp;
+   Tcl_HashEntry *hashEntry;
+   Tcl_DString key;
+   const char *action = NULL;
+   int newFlag, result = TCL_OK;
+   size_t count;
+
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_BROWSE]);
+
+   if(errorCode != kDNSServiceErr_NoError) {
+      bonjour_stats_error(errorCode);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceBrowseReply", errorCode));
+      BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+      Tcl_BackgroundError(interp);
+      return;
+   }
+
+   Tcl_DStringInit(&key);
+   Tcl_DStringAppend(&key, serviceName, -1);
+   Tcl_DStringAppend(&key, "\n", 1);
+   Tcl_DStringAppend(&key, replyDomain, -1);
+
+   if(flags & kDNSServiceFlagsAdd) {
+      hashEntry = Tcl_CreateHashEntry(
+         &type->services, Tcl_DStringValue(&key), &newFlag);
+      count = newFlag ? 0 : (size_t)Tcl_GetHashValue(hashEntry);
+      Tcl_SetHashValue(hashEntry, (ClientData)(count + 1));
+      if(newFlag) {
+         action = "add";
+      }
+   }
+   else {
+      hashEntry = Tcl_FindHashEntry(&type->services, Tcl_DStringValue(&key));
+
+      // a service not found again by this browse is left
+      // for the end of its dwell time
+      if(hashEntry != NULL && (size_t)Tcl_GetHashValue(hashEntry) > 0) {
+         count = (size_t)Tcl_GetHashValue(hashEntry) - 1;
+         if(count > 0) {
+            Tcl_SetHashValue(hashEntry, (ClientData)count);
+         }
+         else {
+            Tcl_DeleteHashEntry(hashEntry);
+            action = "remove";
+         }
+      }
+   }
+   Tcl_DStringFree(&key);
+
+   // the callback may stop the inventory, which frees type
+   if(action != NULL) {
+      Tcl_Preserve(interp);
+      result = bonjour_inventory_eval(inventory, action,
+         Tcl_GetHashKey(&inventory->types, type->hashEntry),
+         serviceName, replyDomain);
+      if(result == TCL_ERROR) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+         Tcl_BackgroundError(interp);
+      }
+      Tcl_Release(interp);
+   }
+}
+
+////////////////////////////////////////////////////
+// starts browsing the waiting regtypes, as many
+// as the inventory's limit allows
+////////////////////////////////////////////////////
+static void bonjour_inventory_schedule(
+   active_inventory *inventory
+) {
+   while(inventory->browsing < inventory->limit &&
+         inventory->waitHead != NULL) {
+      inventory_type *type = inventory->waitHead;
+      const char *regtype =
+         Tcl_GetHashKey(&inventory->types, type->hashEntry);
+      Tcl_HashEntry *hashEntry;
+      Tcl_HashSearch searchToken;
+      DNSServiceErrorType error;
+
+      // leave the waiting list
+      inventory->waitHead = type->next;
+      if(inventory->waitHead != NULL) {
+         inventory->waitHead->prev = NULL;
+      }
+      else {
+         inventory->waitTail = NULL;
+      }
+      type->prev = type->next = NULL;
+
+      type->sdRef = inventory->sdRef;
+      error =
+         DNSServiceBrowse(
+            &type->sdRef,
+            kDNSServiceFlagsShareConnection, 0, regtype, NULL,
+            bonjour_inventory_callback,
+            type);
+      if(error != kDNSServiceErr_NoError) {
+         // a regtype which can't be browsed is skipped
+         BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+         type->sdRef = NULL;
+         type->state = TYPE_DONE;
+         continue;
+      }
+      BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+      BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+
+      // the services found by an earlier browse must be
+      // found again
+      for(hashEntry = Tcl_FirstHashEntry(&type->services, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         Tcl_SetHashValue(hashEntry, (ClientData)(size_t)0);
+      }
+
+      type->state = TYPE_BROWSING;
+      inventory->browsing++;
+      if(inventory->dwell > 0) {
+         type->dwellTimer = Tcl_CreateTimerHandler(
+            inventory->dwell, bonjour_inventory_dwell, type);
+      }
+   }
+}
+
+////////////////////////////////////////////////////
+// puts a regtype at the end of the waiting list
+////////////////////////////////////////////////////
+static void bonjour_inventory_wait(
+   inventory_type *type
+) {
+   active_inventory *inventory = type->inventory;
+
+   type->state = TYPE_WAITING;
+   type->next = NULL;
+   type->prev = inventory->waitTail;
+   if(inventory->waitTail != NULL) {
+      inventory->waitTail->next = type;
+   }
+   else {
+      inventory->waitHead = type;
+   }
+   inventory->waitTail = type;
+}
+
+////////////////////////////////////////////////////
+// stops browsing a regtype, or takes it off the
+// waiting list.  The services found are kept.
+////////////////////////////////////////////////////
+static void bonjour_inventory_end(
+   inventory_type *type
+) {
+   active_inventory *inventory = type->inventory;
+
+   if(type->state == TYPE_WAITING) {
+      if(type->prev != NULL) {
+         type->prev->next = type->next;
+      }
+      else {
+         inventory->waitHead = type->next;
+      }
+      if(type->next != NULL) {
+         type->next->prev = type->prev;
+      }
+      else {
+         inventory->waitTail = type->prev;
+      }
+      type->prev = type->next = NULL;
+   }
+   else if(type->state == TYPE_BROWSING) {
+      if(type->dwellTimer != NULL) {
+         Tcl_DeleteTimerHandler(type->dwellTimer);
+         type->dwellTimer = NULL;
+      }
+      DNSServiceRefDeallocate(type->sdRef);
+      type->sdRef = NULL;
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+      inventory->browsing--;
+   }
+
+   type->state = TYPE_DONE;
+}
+
+////////////////////////////////////////////////////
+// timer handler ending the browse of a regtype
+// once it has run for the dwell time, making way
+// for a waiting one.  The regtype waits to be
+// browsed again, and the services an earlier
+// browse found but this one didn't are reported
+// removed.  With none waiting, it keeps being
+// browsed for another dwell time.
+////////////////////////////////////////////////////
+static void bonjour_inventory_dwell(
+   ClientData clientData
+) {
+   inventory_type *type = (inventory_type *)clientData;
+   active_inventory *inventory = type->inventory;
+   Tcl_DString regtype;
+   Tcl_Obj *removed;
+
+   if(inventory->waitHead == NULL) {
+      type->dwellTimer = Tcl_CreateTimerHandler(
+         inventory->dwell, bonjour_inventory_dwell, type);
+      return;
+   }
+
+   type->dwellTimer = NULL;
+   bonjour_inventory_end(type);
+   removed = bonjour_inventory_drop(type, 0);
+   Tcl_IncrRefCount(removed);
+
+   // the callback may stop the inventory, which frees type
+   Tcl_DStringInit(&regtype);
+   Tcl_DStringAppend(&regtype,
+      Tcl_GetHashKey(&inventory->types, type->hashEntry), -1);
+
+   bonjour_inventory_wait(type);
+   bonjour_inventory_schedule(inventory);
+   bonjour_inventory_report(inventory, Tcl_DStringValue(&regtype), removed);
+
+   Tcl_DecrRefCount(removed);
+   Tcl_DStringFree(&regtype);
+}
+
+////////////////////////////////////////////////////
+// forgets the services of a regtype, all of them
+// or only those the current browse hasn't found,
+// returning a list of the form {name domain ...}
+////////////////////////////////////////////////////
+static Tcl_Obj *bonjour_inventory_drop(
+   inventory_type *type,
+   int all
+) {
+   Tcl_Obj *removed = Tcl_NewListObj(0, NULL);
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   for(hashEntry = Tcl_FirstHashEntry(&type->services, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      const char *key = Tcl_GetHashKey(&type->services, hashEntry);
+      const char *separator = strchr(key, '\n');
+
+      if(!all && (size_t)Tcl_GetHashValue(hashEntry) > 0) {
+         continue;
+      }
+
+      Tcl_ListObjAppendElement(NULL, removed,
+         Tcl_NewStringObj(key, separator - key));
+      Tcl_ListObjAppendElement(NULL, removed,
+         Tcl_NewStringObj(separator + 1, -1));
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+
+   return(removed);
+}
+
+////////////////////////////////////////////////////
+// reports the services of a regtype removed, given
+// as a list of the form {name domain ...}.
+// inventory may be stopped by the callback.
+////////////////////////////////////////////////////
+static void bonjour_inventory_report(
+   active_inventory *inventory,
+   const char *regtype,
+   Tcl_Obj *removed
+) {
+   Tcl_Interp *interp = inventory->interp;
+   Tcl_Obj **services;
+   int numServices, i;
+
+   Tcl_Preserve(inventory);
+   Tcl_Preserve(interp);
+   Tcl_ListObjGetElements(NULL, removed, &numServices, &services);
+   for(i = 0; i + 1 < numServices && !inventory->stopped; i += 2) {
+      if(bonjour_inventory_eval(inventory, "remove", regtype,
+            Tcl_GetString(services[i]),
+            Tcl_GetString(services[i + 1])) == TCL_ERROR) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_BROWSE]);
+         Tcl_BackgroundError(interp);
+      }
+   }
+   Tcl_Release(interp);
+   Tcl_Release(inventory);
+}
+
+////////////////////////////////////////////////////
+// stops browsing a regtype which has been lost and
+// frees it, returning a list of the form
+// {name domain ...} of the services found for it
+////////////////////////////////////////////////////
+static Tcl_Obj *bonjour_inventory_forget(
+   inventory_type *type
+) {
+   Tcl_Obj *removed;
+
+   bonjour_inventory_end(type);
+   removed = bonjour_inventory_drop(type, 1);
+
+   Tcl_DeleteHashTable(&type->services);
+   Tcl_DeleteHashEntry(type->hashEntry);
+   ckfree((void *)type);
+
+   return(removed);
+}
+
+////////////////////////////////////////////////////
+// evaluates the callback script of an inventory
+// for a service being added or removed.
+// inventory may be stopped by the callback.
+////////////////////////////////////////////////////
+static int bonjour_inventory_eval(
+   active_inventory *inventory,
+   const char *action,
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_Obj *callback;
+
+   // create the callback as a list
+   callback = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendList(NULL, callback, inventory->callback);
+
+   // append the action, regtype, service name and domain
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(action, -1));
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(regtype, -1));
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(serviceName, -1));
+   Tcl_ListObjAppendElement(NULL, callback,
+      Tcl_NewStringObj(domain, -1));
+
+   // evaluate the callback
+   return(bonjour_eval_callback(
+      inventory->interp, callback, BONJOUR_OP_BROWSE, inventory->sdRef));
+}
+
+////////////////////////////////////////////////////
+// cleanup any leftover inventories
+////////////////////////////////////////////////////
+static void bonjour_inventory_cleanup(
+   ClientData clientData
+) {
+   Tcl_HashTable *inventories = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   for(hashEntry = Tcl_FirstHashEntry(inventories, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      bonjour_inventory_free(
+         (active_inventory *)Tcl_GetHashValue(hashEntry));
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+}
+
+////////////////////////////////////////////////////
+// called when the interpreter is deleted to stop
+// its inventories and free the hash table
+////////////////////////////////////////////////////
+static void bonjour_inventory_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *inventories = (Tcl_HashTable *)clientData;
+
+   Tcl_DeleteThreadExitHandler(bonjour_inventory_cleanup, inventories);
+   bonjour_inventory_cleanup(inventories);
+
+   Tcl_DeleteHashTable(inventories);
+   ckfree((void *)inventories);
+}
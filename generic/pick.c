@@ -0,0 +1,912 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "snapshot.h"
+#include "stats.h"
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+// TXT keys read for the weight and priority of an
+// instance by default
+#define PICK_WEIGHT_KEY "weight"
+#define PICK_PRIORITY_KEY "priority"
+
+// ms before a failed resolve is tried again
+#define PICK_RETRY_INTERVAL 1000
+
+// ways of picking an instance
+enum {
+   PICK_WEIGHTED,       // at random, in proportion to weight
+   PICK_ROUND_ROBIN,    // each in turn
+   PICK_RANDOM          // at random
+};
+
+static const char *pickModes[] = {
+   "weighted", "round-robin", "random", NULL
+};
+
+// an instance of a regtype being tracked
+typedef struct pick_instance {
+   struct pick_pool *pool;
+   Tcl_HashEntry *hashEntry; // entry in the pool's instances,
+                             // hashed on "name\ndomain"
+   int count;           // adds less removes of the instance,
+                        // which is found on each interface
+   uint32_t interfaceIndex; // interface it was first found on
+   DNSServiceRef sdRef; // the resolve, which keeps running to
+                        // follow changes, or NULL
+   Tcl_TimerToken retryTimer; // restarts a failed resolve, or NULL
+   int index;           // position in the pool's ready
+                        // instances, or -1
+   Tcl_Obj *endpoint;   // {host port}, once resolved
+   int weight;
+   int priority;
+} pick_instance;
+
+// the instances of a regtype, resolved ahead of time
+// so that one can be picked without waiting
+typedef struct pick_pool {
+   DNSServiceRef sdRef; // the connection shared by the browse
+                        // and the resolves
+   DNSServiceRef browseRef; // the browse of the regtype
+   char *regtype;       // the regtype, without any subtype, to
+                        // resolve its instances
+   char *weightKey;     // TXT key holding the weight
+   char *priorityKey;   // TXT key holding the priority
+   Tcl_HashTable instances; // pick_instance hashed on
+                            // "name\ndomain"
+   pick_instance **ready; // the resolved instances
+   int numReady;
+   int sizeReady;
+   pick_instance **group; // the resolved instances with the
+                          // best (lowest) priority
+   int numGroup;
+   double *prob;        // alias table of the group for
+   int *alias;          // weighted picks
+   int dirty;           // set when the group must be rebuilt
+                        // before the next pick
+   unsigned long next;  // the next round-robin pick
+   Tcl_WideInt seed;    // state of the random number generator
+} pick_pool;
+
+// each interpreter stores its pick_pool structures, hashed
+// on the regtype, in a hash table kept as assoc data under
+// this key
+#define BONJOUR_PICK_ASSOC "bonjour::pick"
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_pick(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_pick_start(
+   Tcl_Interp *interp,
+   const char *regtype,
+   const char *weightKey,
+   const char *priorityKey,
+   Tcl_HashTable *pools
+);
+static void bonjour_pick_free(
+   pick_pool *pool
+);
+static void bonjour_pick_browse_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+);
+static void bonjour_pick_resolve_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord,
+   void *context
+);
+static void bonjour_pick_forget(
+   pick_instance *instance
+);
+static void bonjour_pick_resolve_start(
+   pick_instance *instance
+);
+static void bonjour_pick_retry(
+   ClientData clientData
+);
+static void bonjour_pick_unready(
+   pick_instance *instance
+);
+static void bonjour_pick_resolve_stop(
+   pick_instance *instance
+);
+static void bonjour_pick_rebuild(
+   pick_pool *pool
+);
+static double bonjour_pick_random(
+   pick_pool *pool
+);
+static int bonjour_pick_txt_int(
+   uint16_t txtLen,
+   const char *txtRecord,
+   const char *key,
+   int defaultValue
+);
+static void bonjour_pick_cleanup(
+   ClientData clientData
+);
+static void bonjour_pick_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+);
+
+////////////////////////////////////////////////////
+// Function to initialize pick related stuff
+////////////////////////////////////////////////////
+int Pick_Init(
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *pools;
+
+   // the package may already be loaded in this interpreter
+   if(Tcl_GetAssocData(interp, BONJOUR_PICK_ASSOC, NULL) != NULL) {
+      return TCL_OK;
+   }
+
+   // initialize the hash table, which is deleted along
+   // with the interpreter
+   pools = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(pools, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, BONJOUR_PICK_ASSOC, bonjour_pick_delete, pools);
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::pick", bonjour_pick,
+      pools, NULL
+   );
+
+   // create an exit handler for cleanup
+   Tcl_CreateThreadExitHandler(bonjour_pick_cleanup, pools);
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::pick command
+////////////////////////////////////////////////////
+static int bonjour_pick(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *options[] = {
+      "-weight", "-priority", NULL
+   };
+   static const char *pickOptions[] = {
+      "-mode", NULL
+   };
+   Tcl_HashTable *pools = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
+   const char *weightKey = PICK_WEIGHT_KEY;
+   const char *priorityKey = PICK_PRIORITY_KEY;
+   const char *regtype;
+   pick_pool *pool;
+   pick_instance *instance;
+   int mode = PICK_WEIGHTED;
+   int optIndex, i;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-mode <mode>? <regtype>");
+      return(TCL_ERROR);
+   }
+
+   // regtypes begin with an underscore, so can't be
+   // mistaken for the sub-commands
+   if(strcmp(Tcl_GetString(objv[1]), "start") == 0) {
+      if(objc < 3 || objc % 2 != 1) {
+         Tcl_WrongNumArgs(interp, 2, objv,
+            "?-weight <key>? ?-priority <key>? <regtype>");
+         return(TCL_ERROR);
+      }
+
+      for(i = 2; i < objc - 1; i += 2) {
+         if(Tcl_GetIndexFromObj(
+               interp, objv[i], options, "option", 0, &optIndex
+            ) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+
+         switch(optIndex) {
+         case 0: // -weight
+            weightKey = Tcl_GetString(objv[i + 1]);
+            break;
+         case 1: // -priority
+            priorityKey = Tcl_GetString(objv[i + 1]);
+            break;
+         }
+      }
+
+      return(bonjour_pick_start(interp, Tcl_GetString(objv[objc - 1]),
+                                weightKey, priorityKey, pools));
+   }
+
+   if(strcmp(Tcl_GetString(objv[1]), "stop") == 0) {
+      if(objc != 3) {
+         Tcl_WrongNumArgs(interp, 2, objv, "<regtype>");
+         return(TCL_ERROR);
+      }
+
+      hashEntry = Tcl_FindHashEntry(pools, Tcl_GetString(objv[2]));
+      if(hashEntry != NULL) {
+         bonjour_pick_free((pick_pool *)Tcl_GetHashValue(hashEntry));
+         Tcl_DeleteHashEntry(hashEntry);
+      }
+      return(TCL_OK);
+   }
+
+   if(objc == 4) {
+      if(Tcl_GetIndexFromObj(
+            interp, objv[1], pickOptions, "option", 0, &optIndex
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+      if(Tcl_GetIndexFromObj(
+            interp, objv[2], pickModes, "mode", 0, &mode
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+   }
+   else if(objc != 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-mode <mode>? <regtype>");
+      return(TCL_ERROR);
+   }
+
+   regtype = Tcl_GetString(objv[objc - 1]);
+   hashEntry = Tcl_FindHashEntry(pools, regtype);
+   if(hashEntry == NULL) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "regtype ", regtype, " is not being tracked", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+   pool = (pick_pool *)Tcl_GetHashValue(hashEntry);
+
+   if(pool->dirty) {
+      bonjour_pick_rebuild(pool);
+   }
+   if(pool->numGroup == 0) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "no instance of ", regtype, " is available", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+
+   switch(mode) {
+   case PICK_ROUND_ROBIN:
+      instance = pool->group[pool->next++ % pool->numGroup];
+      break;
+   case PICK_RANDOM:
+      instance = pool->group[
+         (int)(bonjour_pick_random(pool) * pool->numGroup)];
+      break;
+   default:
+      // an entry of the alias table is chosen at random,
+      // then either it or its alias
+      i = (int)(bonjour_pick_random(pool) * pool->numGroup);
+      if(bonjour_pick_random(pool) >= pool->prob[i]) {
+         i = pool->alias[i];
+      }
+      instance = pool->group[i];
+      break;
+   }
+
+   Tcl_SetObjResult(interp, instance->endpoint);
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// starts tracking the instances of a regtype
+////////////////////////////////////////////////////
+static int bonjour_pick_start(
+   Tcl_Interp *interp,
+   const char *regtype,
+   const char *weightKey,
+   const char *priorityKey,
+   Tcl_HashTable *pools
+) {
+   Tcl_HashEntry *hashEntry;
+   DNSServiceErrorType error;
+   pick_pool *pool;
+   int newFlag;
+
+   hashEntry = Tcl_CreateHashEntry(pools, regtype, &newFlag);
+   if(!newFlag) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "regtype ", regtype, " is already being tracked", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+
+   pool = (pick_pool *)ckalloc(sizeof(pick_pool));
+   pool->regtype = (char *)ckalloc(strlen(regtype) + 1);
+   strcpy(pool->regtype, regtype);
+   if(strchr(pool->regtype, ',') != NULL) {
+      *strchr(pool->regtype, ',') = '\0';
+   }
+   pool->weightKey = (char *)ckalloc(strlen(weightKey) + 1);
+   strcpy(pool->weightKey, weightKey);
+   pool->priorityKey = (char *)ckalloc(strlen(priorityKey) + 1);
+   strcpy(pool->priorityKey, priorityKey);
+   Tcl_InitHashTable(&pool->instances, TCL_STRING_KEYS);
+   pool->ready = NULL;
+   pool->numReady = 0;
+   pool->sizeReady = 0;
+   pool->group = NULL;
+   pool->numGroup = 0;
+   pool->prob = NULL;
+   pool->alias = NULL;
+   pool->dirty = 0;
+   pool->next = 0;
+   pool->seed = bonjour_time_now() ^ (Tcl_WideInt)(size_t)pool;
+   Tcl_SetHashValue(hashEntry, pool);
+
+   error = DNSServiceCreateConnection(&pool->sdRef);
+   if(error == kDNSServiceErr_NoError) {
+      pool->browseRef = pool->sdRef;
+      error =
+         DNSServiceBrowse(
+            &pool->browseRef,
+            kDNSServiceFlagsShareConnection, 0, regtype, NULL,
+            bonjour_pick_browse_callback,
+            pool);
+      if(error != kDNSServiceErr_NoError) {
+         BONJOUR_STATS_INCR(failed[BONJOUR_OP_BROWSE]);
+         DNSServiceRefDeallocate(pool->sdRef);
+      }
+   }
+   if(error != kDNSServiceErr_NoError) {
+      Tcl_DeleteHashTable(&pool->instances);
+      ckfree(pool->regtype);
+      ckfree(pool->weightKey);
+      ckfree(pool->priorityKey);
+      ckfree((void *)pool);
+      Tcl_DeleteHashEntry(hashEntry);
+
+      bonjour_stats_error(error);
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "DNSServiceBrowse", error));
+      return(TCL_ERROR);
+   }
+   BONJOUR_STATS_INCR(started[BONJOUR_OP_BROWSE]);
+   BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_BROWSE]);
+
+   bonjour_create_file_handler(pool->sdRef, BONJOUR_OP_BROWSE);
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// stops tracking a regtype and frees its pool.
+// No script is evaluated by the pool's callbacks,
+// so it can be freed at once.
+////////////////////////////////////////////////////
+static void bonjour_pick_free(
+   pick_pool *pool
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   // the operations sharing the connection are stopped
+   // before it is closed
+   for(hashEntry = Tcl_FirstHashEntry(&pool->instances, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      pick_instance *instance = (pick_instance *)Tcl_GetHashValue(hashEntry);
+
+      bonjour_pick_resolve_stop(instance);
+      if(instance->endpoint != NULL) {
+         Tcl_DecrRefCount(instance->endpoint);
+      }
+      ckfree((void *)instance);
+   }
+   Tcl_DeleteHashTable(&pool->instances);
+
+   DNSServiceRefDeallocate(pool->browseRef);
+   BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_BROWSE]);
+   bonjour_delete_file_handler(pool->sdRef);
+   DNSServiceRefDeallocate(pool->sdRef);
+
+   if(pool->ready != NULL) {
+      ckfree((void *)pool->ready);
+   }
+   if(pool->group != NULL) {
+      ckfree((void *)pool->group);
+      ckfree((void *)pool->prob);
+      ckfree((void *)pool->alias);
+   }
+   ckfree(pool->regtype);
+   ckfree(pool->weightKey);
+   ckfree(pool->priorityKey);
+   ckfree((void *)pool);
+}
+
+////////////////////////////////////////////////////
+// called when an instance of a tracked regtype is
+// found or lost.  A new instance is resolved, and
+// one which is lost can no longer be picked.
+////////////////////////////////////////////////////
+static void bonjour_pick_browse_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *const serviceName,
+   const char *const replyType,
+   const char *const replyDomain,
+   void *context
+) {
+   pick_pool *pool = (pick_pool *)context;
+   pick_instance *instance;
+   Tcl_HashEntry *hashEntry;
+   Tcl_DString key;
+   int newFlag;
+
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_BROWSE]);
+
+   if(errorCode != kDNSServiceErr_NoError) {
+      bonjour_stats_error(errorCode);
+      return;
+   }
+
+   Tcl_DStringInit(&key);
+   Tcl_DStringAppend(&key, serviceName, -1);
+   Tcl_DStringAppend(&key, "\n", 1);
+   Tcl_DStringAppend(&key, replyDomain, -1);
+
+   if(!(flags & kDNSServiceFlagsAdd)) {
+      hashEntry = Tcl_FindHashEntry(&pool->instances, Tcl_DStringValue(&key));
+      Tcl_DStringFree(&key);
+      if(hashEntry != NULL) {
+         instance = (pick_instance *)Tcl_GetHashValue(hashEntry);
+         if(--instance->count == 0) {
+            bonjour_pick_forget(instance);
+         }
+      }
+      return;
+   }
+
+   hashEntry = Tcl_CreateHashEntry(
+      &pool->instances, Tcl_DStringValue(&key), &newFlag);
+   Tcl_DStringFree(&key);
+   if(!newFlag) {
+      instance = (pick_instance *)Tcl_GetHashValue(hashEntry);
+      instance->count++;
+      return;
+   }
+
+   instance = (pick_instance *)ckalloc(sizeof(pick_instance));
+   instance->pool = pool;
+   instance->hashEntry = hashEntry;
+   instance->count = 1;
+   instance->interfaceIndex = interfaceIndex;
+   instance->sdRef = NULL;
+   instance->retryTimer = NULL;
+   instance->index = -1;
+   instance->endpoint = NULL;
+   instance->weight = 1;
+   instance->priority = 0;
+   Tcl_SetHashValue(hashEntry, instance);
+
+   bonjour_pick_resolve_start(instance);
+}
+
+////////////////////////////////////////////////////
+// starts resolving an instance over the pool's
+// connection, trying again later if it fails
+////////////////////////////////////////////////////
+static void bonjour_pick_resolve_start(
+   pick_instance *instance
+) {
+   pick_pool *pool = instance->pool;
+   const char *key = Tcl_GetHashKey(&pool->instances, instance->hashEntry);
+   const char *separator = strchr(key, '\n');
+   Tcl_DString serviceName;
+   DNSServiceErrorType error;
+
+   Tcl_DStringInit(&serviceName);
+   Tcl_DStringAppend(&serviceName, key, separator - key);
+
+   instance->sdRef = pool->sdRef;
+   error =
+      DNSServiceResolve(
+         &instance->sdRef,
+         kDNSServiceFlagsShareConnection, instance->interfaceIndex,
+         Tcl_DStringValue(&serviceName), pool->regtype, separator + 1,
+         (DNSServiceResolveReply)bonjour_pick_resolve_callback,
+         instance);
+   Tcl_DStringFree(&serviceName);
+   if(error != kDNSServiceErr_NoError) {
+      BONJOUR_STATS_INCR(failed[BONJOUR_OP_RESOLVE]);
+      bonjour_stats_error(error);
+      instance->sdRef = NULL;
+      instance->retryTimer = Tcl_CreateTimerHandler(
+         PICK_RETRY_INTERVAL, bonjour_pick_retry, instance);
+      return;
+   }
+   BONJOUR_STATS_INCR(started[BONJOUR_OP_RESOLVE]);
+   BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_RESOLVE]);
+}
+
+////////////////////////////////////////////////////
+// timer handler resolving an instance again after
+// its resolve failed
+////////////////////////////////////////////////////
+static void bonjour_pick_retry(
+   ClientData clientData
+) {
+   pick_instance *instance = (pick_instance *)clientData;
+
+   instance->retryTimer = NULL;
+   bonjour_pick_resolve_start(instance);
+}
+
+////////////////////////////////////////////////////
+// called when an instance has been resolved, after
+// which it can be picked.  The resolve keeps
+// running, so that a change of the instance's
+// endpoint or TXT record is picked up at once.
+////////////////////////////////////////////////////
+static void bonjour_pick_resolve_callback(
+   DNSServiceRef sdRef,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord,
+   void *context
+) {
+   pick_instance *instance = (pick_instance *)context;
+   pick_pool *pool = instance->pool;
+   int weight, priority;
+   Tcl_Obj *endpoint;
+
+   BONJOUR_STATS_INCR(replies[BONJOUR_OP_RESOLVE]);
+
+   if(errorCode != kDNSServiceErr_NoError) {
+      // the instance can't be picked until it has
+      // been resolved again
+      bonjour_stats_error(errorCode);
+      bonjour_pick_resolve_stop(instance);
+      bonjour_pick_unready(instance);
+      instance->retryTimer = Tcl_CreateTimerHandler(
+         PICK_RETRY_INTERVAL, bonjour_pick_retry, instance);
+      return;
+   }
+
+   // the resolve is as good as any other for the snapshot
+   if(bonjourSnapshotEnabled) {
+      bonjour_snapshot_resolve(fullname, hosttarget, port,
+                               txtLen, txtRecord);
+   }
+
+   weight = bonjour_pick_txt_int(txtLen, txtRecord, pool->weightKey, 1);
+   if(weight < 0) {
+      weight = 0;
+   }
+   priority = bonjour_pick_txt_int(txtLen, txtRecord, pool->priorityKey, 0);
+   if(weight != instance->weight || priority != instance->priority) {
+      instance->weight = weight;
+      instance->priority = priority;
+      pool->dirty = 1;
+   }
+
+   // the endpoint is built once, so that picking it
+   // allocates nothing.  The group holds instances,
+   // so a new one is used by the next pick.
+   endpoint = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(NULL, endpoint,
+      Tcl_NewStringObj(hosttarget, -1));
+   Tcl_ListObjAppendElement(NULL, endpoint, Tcl_NewIntObj(ntohs(port)));
+   Tcl_IncrRefCount(endpoint);
+   if(instance->endpoint != NULL) {
+      Tcl_DecrRefCount(instance->endpoint);
+   }
+   instance->endpoint = endpoint;
+
+   // an instance resolved before can already be picked
+   if(instance->index >= 0) {
+      return;
+   }
+
+   if(pool->numReady == pool->sizeReady) {
+      pool->sizeReady = (pool->sizeReady == 0) ? 16 : pool->sizeReady * 2;
+      pool->ready = (pick_instance **)ckrealloc(
+         (char *)pool->ready, pool->sizeReady * sizeof(pick_instance *));
+   }
+   instance->index = pool->numReady;
+   pool->ready[pool->numReady++] = instance;
+   pool->dirty = 1;
+}
+
+////////////////////////////////////////////////////
+// frees an instance which has been lost
+////////////////////////////////////////////////////
+static void bonjour_pick_forget(
+   pick_instance *instance
+) {
+   bonjour_pick_resolve_stop(instance);
+   bonjour_pick_unready(instance);
+   Tcl_DeleteHashEntry(instance->hashEntry);
+   ckfree((void *)instance);
+}
+
+////////////////////////////////////////////////////
+// removes an instance from the instances which can
+// be picked, by moving the last in its place
+////////////////////////////////////////////////////
+static void bonjour_pick_unready(
+   pick_instance *instance
+) {
+   pick_pool *pool = instance->pool;
+
+   if(instance->index < 0) {
+      return;
+   }
+
+   pool->ready[instance->index] = pool->ready[--pool->numReady];
+   pool->ready[instance->index]->index = instance->index;
+   instance->index = -1;
+   pool->dirty = 1;
+
+   Tcl_DecrRefCount(instance->endpoint);
+   instance->endpoint = NULL;
+}
+
+////////////////////////////////////////////////////
+// stops resolving an instance, or trying to
+////////////////////////////////////////////////////
+static void bonjour_pick_resolve_stop(
+   pick_instance *instance
+) {
+   if(instance->retryTimer != NULL) {
+      Tcl_DeleteTimerHandler(instance->retryTimer);
+      instance->retryTimer = NULL;
+   }
+   if(instance->sdRef != NULL) {
+      DNSServiceRefDeallocate(instance->sdRef);
+      instance->sdRef = NULL;
+      BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_RESOLVE]);
+   }
+}
+
+////////////////////////////////////////////////////
+// rebuilds the group of instances with the best
+// priority and its alias table, which lets a
+// weighted pick be made in constant time
+// (Vose's alias method)
+////////////////////////////////////////////////////
+static void bonjour_pick_rebuild(
+   pick_pool *pool
+) {
+   int *small, *large;
+   double *scaled;
+   int numSmall = 0, numLarge = 0;
+   double totalWeight = 0;
+   int i, n;
+
+   pool->dirty = 0;
+   if(pool->group != NULL) {
+      ckfree((void *)pool->group);
+      ckfree((void *)pool->prob);
+      ckfree((void *)pool->alias);
+      pool->group = NULL;
+   }
+   pool->numGroup = 0;
+   if(pool->numReady == 0) {
+      return;
+   }
+
+   pool->group = (pick_instance **)ckalloc(
+      pool->numReady * sizeof(pick_instance *));
+   pool->prob = (double *)ckalloc(pool->numReady * sizeof(double));
+   pool->alias = (int *)ckalloc(pool->numReady * sizeof(int));
+
+   for(i = 0; i < pool->numReady; i++) {
+      pick_instance *instance = pool->ready[i];
+
+      if(pool->numGroup > 0 &&
+         instance->priority > pool->group[0]->priority) {
+         continue;
+      }
+      if(pool->numGroup > 0 &&
+         instance->priority < pool->group[0]->priority) {
+         pool->numGroup = 0;
+         totalWeight = 0;
+      }
+      pool->group[pool->numGroup++] = instance;
+      totalWeight += instance->weight;
+   }
+
+   // split the weights into columns of equal height,
+   // each shared by at most two instances
+   n = pool->numGroup;
+   scaled = (double *)ckalloc(n * sizeof(double));
+   small = (int *)ckalloc(n * sizeof(int));
+   large = (int *)ckalloc(n * sizeof(int));
+   for(i = 0; i < n; i++) {
+      // instances all weighing nothing are picked evenly
+      scaled[i] = (totalWeight > 0) ?
+         pool->group[i]->weight * n / totalWeight : 1.0;
+      pool->alias[i] = i;
+      if(scaled[i] < 1.0) {
+         small[numSmall++] = i;
+      }
+      else {
+         large[numLarge++] = i;
+      }
+   }
+   while(numSmall > 0 && numLarge > 0) {
+      int s = small[--numSmall];
+      int l = large[--numLarge];
+
+      pool->prob[s] = scaled[s];
+      pool->alias[s] = l;
+      scaled[l] += scaled[s] - 1.0;
+      if(scaled[l] < 1.0) {
+         small[numSmall++] = l;
+      }
+      else {
+         large[numLarge++] = l;
+      }
+   }
+   while(numLarge > 0) {
+      pool->prob[large[--numLarge]] = 1.0;
+   }
+   while(numSmall > 0) {
+      pool->prob[small[--numSmall]] = 1.0;
+   }
+
+   ckfree((void *)scaled);
+   ckfree((void *)small);
+   ckfree((void *)large);
+}
+
+////////////////////////////////////////////////////
+// returns a pseudo-random number in [0, 1), using
+// the pool's own generator (xorshift64*)
+////////////////////////////////////////////////////
+static double bonjour_pick_random(
+   pick_pool *pool
+) {
+   Tcl_WideUInt x = (Tcl_WideUInt)pool->seed;
+
+   if(x == 0) {
+      x = 1;
+   }
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   pool->seed = (Tcl_WideInt)x;
+
+   return((double)((x * 2685821657736338717ULL) >> 11) /
+          (double)(1ULL << 53));
+}
+
+////////////////////////////////////////////////////
+// returns the integer value of a key in a TXT
+// record, or defaultValue if it is missing or
+// isn't an integer
+////////////////////////////////////////////////////
+static int bonjour_pick_txt_int(
+   uint16_t txtLen,
+   const char *txtRecord,
+   const char *key,
+   int defaultValue
+) {
+   const char *value;
+   uint8_t valueLen;
+   char buffer[16];
+   char *end;
+   long result;
+
+   value = TXTRecordGetValuePtr(txtLen, txtRecord, key, &valueLen);
+   if(value == NULL || valueLen == 0 || valueLen >= sizeof(buffer)) {
+      return(defaultValue);
+   }
+   memcpy(buffer, value, valueLen);
+   buffer[valueLen] = '\0';
+
+   result = strtol(buffer, &end, 10);
+   if(*end != '\0') {
+      return(defaultValue);
+   }
+
+   return((int)result);
+}
+
+////////////////////////////////////////////////////
+// cleanup any leftover pools
+////////////////////////////////////////////////////
+static void bonjour_pick_cleanup(
+   ClientData clientData
+) {
+   Tcl_HashTable *pools = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   for(hashEntry = Tcl_FirstHashEntry(pools, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      bonjour_pick_free((pick_pool *)Tcl_GetHashValue(hashEntry));
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+}
+
+////////////////////////////////////////////////////
+// called when the interpreter is deleted to stop
+// tracking its regtypes and free the hash table
+////////////////////////////////////////////////////
+static void bonjour_pick_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *pools = (Tcl_HashTable *)clientData;
+
+   Tcl_DeleteThreadExitHandler(bonjour_pick_cleanup, pools);
+   bonjour_pick_cleanup(pools);
+
+   Tcl_DeleteHashTable(pools);
+   ckfree((void *)pools);
+}
@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+////////////////////////////////////////////////////
+// USDT static probes.  These are compiled in when
+// configured with --enable-probes and can be
+// attached to with perf, bpftrace, SystemTap or
+// DTrace, e.g.
+//
+//    bpftrace -e 'usdt:./libbonjour1.1.so:bonjour:callback__done
+//                 { @[arg0] = count(); }'
+//
+// Probes provided (provider "bonjour"):
+//    operation__start(op, id, name)
+//    operation__stop(op, id, errorCode)
+//    process__start(sdRef)
+//    process__done(sdRef, errorCode)
+//    callback__start(op, interp)
+//    callback__done(op, result)
+//
+// op is a bonjour_op_type and id is the address of
+// the structure describing the operation, so that
+// start and stop can be matched.
+////////////////////////////////////////////////////
+
+#ifdef BONJOUR_ENABLE_PROBES
+
+#include <sys/sdt.h>
+
+#define BONJOUR_PROBE1(name, a) \
+   DTRACE_PROBE1(bonjour, name, a)
+#define BONJOUR_PROBE2(name, a, b) \
+   DTRACE_PROBE2(bonjour, name, a, b)
+#define BONJOUR_PROBE3(name, a, b, c) \
+   DTRACE_PROBE3(bonjour, name, a, b, c)
+
+#else
+
+#define BONJOUR_PROBE1(name, a)
+#define BONJOUR_PROBE2(name, a, b)
+#define BONJOUR_PROBE3(name, a, b, c)
+
+#endif
+
+#endif
@@ -25,6 +25,7 @@ OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
 DAMAGE.
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <tcl.h>
 #include <arpa/inet.h>
@@ -33,6 +34,9 @@ DAMAGE.
 
 #include "txt_record.h"
 #include "bonjour.h"
+#include "probes.h"
+#include "stats.h"
+#include "trace.h"
 
 ////////////////////////////////////////////////////
 // Support structures
@@ -42,11 +46,23 @@ DAMAGE.
 typedef struct {
    DNSServiceRef sdRef; // the service discovery reference
    char *regtype;       // the regtype registered
+   uint16_t txtLen;     // the TXT record last sent
+   void *txtRecord;
+   int interval;        // least time between TXT updates, in ms
+   Tcl_HashTable *thresholds; // smallest change worth sending of
+                              // each numeric key, as a ckalloc'd
+                              // Tcl_WideInt hashed on the key,
+                              // or NULL
+   Tcl_WideInt lastUpdate; // when the TXT record was last sent
+   uint16_t pendingLen; // the latest TXT record waiting for the
+   void *pendingRecord; // interval to pass, or NULL
+   Tcl_TimerToken timer; // sends the pending TXT record
 } active_registration;
 
-// stores active_registration structures hashed on the
-// regtype being registered
-static Tcl_HashTable registerRegistrations;
+// each interpreter stores its active_registration structures,
+// hashed on the regtype being registered, in a hash table kept
+// as assoc data under this key
+#define BONJOUR_REGISTER_ASSOC "bonjour::register"
 
 ////////////////////////////////////////////////////
 // Private function prototypes
@@ -58,9 +74,49 @@ static int bonjour_register(
    int objc,
    Tcl_Obj *const objv[]
 );
-static int bonjour_register_cleanup(
+static int bonjour_unregister(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_update_txt(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static DNSServiceErrorType bonjour_register_send(
+   active_registration *activeRegister,
+   uint16_t txtLen,
+   void *txtRecord
+);
+static void bonjour_register_flush(
+   ClientData clientData
+);
+static int bonjour_register_changed(
+   active_registration *activeRegister,
+   uint16_t txtLen,
+   const void *txtRecord
+);
+static int bonjour_register_number(
+   const void *value,
+   uint8_t valueLen,
+   Tcl_WideInt *number
+);
+static void bonjour_register_thresholds_free(
+   Tcl_HashTable *thresholds
+);
+static void bonjour_register_free(
+   active_registration *activeRegister
+);
+static void bonjour_register_cleanup(
    ClientData clientData
 );
+static void bonjour_register_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+);
 
 ////////////////////////////////////////////////////
 // Function to initialize register related stuff
@@ -68,23 +124,40 @@ static int bonjour_register_cleanup(
 int Register_Init(
    Tcl_Interp *interp
 ) {
-   
-   // initialize the hash table
-   Tcl_InitHashTable(&registerRegistrations, TCL_STRING_KEYS);
+   Tcl_HashTable *registerRegistrations;
+
+   // the package may already be loaded in this interpreter
+   if(Tcl_GetAssocData(interp, BONJOUR_REGISTER_ASSOC, NULL) != NULL) {
+      return TCL_OK;
+   }
+
+   // initialize the hash table, which is deleted along
+   // with the interpreter
+   registerRegistrations = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(registerRegistrations, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, BONJOUR_REGISTER_ASSOC,
+                    bonjour_register_delete, registerRegistrations);
 
    // register our commands
    Tcl_CreateObjCommand(
       interp, "::bonjour::register", bonjour_register,
-      &registerRegistrations, NULL
+      registerRegistrations, NULL
+   );
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::unregister", bonjour_unregister,
+      registerRegistrations, NULL
+   );
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::update_txt", bonjour_update_txt,
+      registerRegistrations, NULL
    );
 
    // create an exit handler for cleanup
-   Tcl_CreateExitHandler(
-      (Tcl_ExitProc *)bonjour_register_cleanup,
-      &registerRegistrations
+   Tcl_CreateThreadExitHandler(
+      bonjour_register_cleanup,
+      registerRegistrations
    );
 
-
    return TCL_OK;
 }
 
@@ -106,9 +179,17 @@ static int bonjour_register(
    int newFlag = 0;
    uint16_t txtLen = 0;
    void *txtRecord = NULL;
-
-   static const char *options[] = { "-name", "--", NULL };
-   enum optionIndex { OPT_NAME, OPT_END };
+   Tcl_Obj *subtypes = NULL;
+   Tcl_Obj *thresholds = NULL;
+   int interval = 0;
+   Tcl_DString fullRegtype;
+
+   static const char *options[] = {
+      "-name", "-subtypes", "-interval", "-threshold", "--", NULL
+   };
+   enum optionIndex {
+      OPT_NAME, OPT_SUBTYPES, OPT_INTERVAL, OPT_THRESHOLD, OPT_END
+   };
 
    // parse options
    int objIndex;
@@ -124,8 +205,64 @@ static int bonjour_register(
 
       if(index == OPT_NAME) {
          objIndex++;
+         if(objIndex >= objc) {
+            Tcl_SetResult(interp, "-name requires a value", TCL_STATIC);
+            return TCL_ERROR;
+         }
          serviceName = Tcl_GetString(objv[objIndex]);
       }
+      else if(index == OPT_SUBTYPES) {
+         objIndex++;
+         if(objIndex >= objc) {
+            Tcl_SetResult(interp, "-subtypes requires a value", TCL_STATIC);
+            return TCL_ERROR;
+         }
+         subtypes = objv[objIndex];
+      }
+      else if(index == OPT_INTERVAL) {
+         objIndex++;
+         if(objIndex >= objc) {
+            Tcl_SetResult(interp, "-interval requires a value", TCL_STATIC);
+            return TCL_ERROR;
+         }
+         if(Tcl_GetIntFromObj(interp, objv[objIndex], &interval) != TCL_OK) {
+            return TCL_ERROR;
+         }
+         if(interval < 0) {
+            Tcl_SetResult(interp, "-interval must not be negative", TCL_STATIC);
+            return TCL_ERROR;
+         }
+      }
+      else if(index == OPT_THRESHOLD) {
+         Tcl_Obj **elements;
+         Tcl_WideInt threshold;
+         int numElements, i;
+
+         objIndex++;
+         if(objIndex >= objc) {
+            Tcl_SetResult(interp, "-threshold requires a value", TCL_STATIC);
+            return TCL_ERROR;
+         }
+         thresholds = objv[objIndex];
+
+         // a list of the form {key change ...}
+         if(Tcl_ListObjGetElements(interp, thresholds, &numElements, &elements) != TCL_OK) {
+            return TCL_ERROR;
+         }
+         if(numElements % 2 != 0) {
+            Tcl_SetResult(interp, "-threshold requires a list of keys and changes", TCL_STATIC);
+            return TCL_ERROR;
+         }
+         for(i = 1; i < numElements; i += 2) {
+            if(Tcl_GetWideIntFromObj(interp, elements[i], &threshold) != TCL_OK) {
+               return TCL_ERROR;
+            }
+            if(threshold < 0) {
+               Tcl_SetResult(interp, "thresholds must not be negative", TCL_STATIC);
+               return TCL_ERROR;
+            }
+         }
+      }
       else if(index == OPT_END) {
          objIndex++;
          break;
@@ -145,13 +282,32 @@ static int bonjour_register(
    // retrieve the port number
    if(Tcl_GetIntFromObj(interp, objv[objIndex + 1], (int *)&port) != TCL_OK)
       return TCL_ERROR;
-   
-   // retrieve the txt record list, if applicable
-   if(numArgs == 3)
-   {
-      list2txt(objv[objIndex + 2], &txtLen, &txtRecord);
-   }
 
+   // the subtypes are advertised by appending them to
+   // the regtype, i.e. _http._tcp,_api,_admin
+   Tcl_DStringInit(&fullRegtype);
+   Tcl_DStringAppend(&fullRegtype, regtype, -1);
+   if(subtypes != NULL) {
+      Tcl_Obj **elements;
+      int numElements, i;
+
+      if(Tcl_ListObjGetElements(interp, subtypes, &numElements, &elements) != TCL_OK) {
+         Tcl_DStringFree(&fullRegtype);
+         return TCL_ERROR;
+      }
+      for(i = 0; i < numElements; i++) {
+         const char *subtype = Tcl_GetString(elements[i]);
+
+         if(*subtype == '\0' || strchr(subtype, ',') != NULL) {
+            Tcl_AppendResult(interp, "invalid subtype \"", subtype, "\"", NULL);
+            Tcl_DStringFree(&fullRegtype);
+            return TCL_ERROR;
+         }
+         Tcl_DStringAppend(&fullRegtype, ",", 1);
+         Tcl_DStringAppend(&fullRegtype, subtype, -1);
+      }
+   }
+   
    // attempt to create an entry in the hash table
    // for this regtype
    hashEntry = 
@@ -162,46 +318,406 @@ static int bonjour_register(
       Tcl_AppendStringsToObj(
          errorMsg, "regtype ", regtype, " is already registered", NULL);
       Tcl_SetObjResult(interp, errorMsg);
+      Tcl_DStringFree(&fullRegtype);
       return(TCL_ERROR);
    }
 
+   // retrieve the txt record list, if applicable.  This
+   // is done after the check above so that the record
+   // isn't leaked on error.
+   if(numArgs == 3)
+   {
+      if(list2txt(interp, objv[objIndex + 2], &txtLen, &txtRecord) != TCL_OK) {
+         Tcl_DeleteHashEntry(hashEntry);
+         Tcl_DStringFree(&fullRegtype);
+         return(TCL_ERROR);
+      }
+   }
+
    // create the activeRegister structure
    activeRegister = (active_registration *)ckalloc(sizeof(active_registration));
    activeRegister->regtype = (char *)ckalloc(strlen(regtype) + 1);
    strcpy(activeRegister->regtype, regtype);
+   activeRegister->interval = interval;
+   activeRegister->thresholds = NULL;
+   activeRegister->lastUpdate = bonjour_time_now();
+   activeRegister->pendingRecord = NULL;
+   activeRegister->pendingLen = 0;
+   activeRegister->timer = NULL;
+   if(thresholds != NULL) {
+      Tcl_Obj **elements;
+      int numElements, i;
+
+      activeRegister->thresholds =
+         (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+      Tcl_InitHashTable(activeRegister->thresholds, TCL_STRING_KEYS);
+      Tcl_ListObjGetElements(NULL, thresholds, &numElements, &elements);
+      for(i = 0; i + 1 < numElements; i += 2) {
+         Tcl_HashEntry *thresholdEntry;
+         Tcl_WideInt *threshold;
+
+         // a key given twice takes its last threshold
+         thresholdEntry = Tcl_CreateHashEntry(activeRegister->thresholds,
+            Tcl_GetString(elements[i]), &newFlag);
+         if(newFlag) {
+            threshold = (Tcl_WideInt *)ckalloc(sizeof(Tcl_WideInt));
+            Tcl_SetHashValue(thresholdEntry, threshold);
+         }
+         else {
+            threshold = (Tcl_WideInt *)Tcl_GetHashValue(thresholdEntry);
+         }
+         Tcl_GetWideIntFromObj(NULL, elements[i + 1], threshold);
+      }
+   }
 
    // store the activeRegister structure
    Tcl_SetHashValue(hashEntry, activeRegister);
 
+   BONJOUR_PROBE3(operation__start, BONJOUR_OP_REGISTER, activeRegister, regtype);
    DNSServiceErrorType error =
       DNSServiceRegister(&activeRegister->sdRef,
                          0, 0,
-                         serviceName, regtype,
+                         serviceName, Tcl_DStringValue(&fullRegtype),
                          NULL, NULL,
                          htons((uint16_t)port),
                          txtLen, txtRecord, // txt record stuff
                          NULL, NULL); // callback stuff
+   BONJOUR_TRACE(BONJOUR_TRACE_START, BONJOUR_OP_REGISTER,
+                 (error == kDNSServiceErr_NoError) ? activeRegister->sdRef : NULL,
+                 0, 0, error, Tcl_DStringLength(&fullRegtype), txtLen);
 
-   // free the txt record
-   ckfree(txtRecord);
+   // the txt record is kept to compare updates with
+   activeRegister->txtLen = txtLen;
+   activeRegister->txtRecord = txtRecord;
+   Tcl_DStringFree(&fullRegtype);
 
    if(error != kDNSServiceErr_NoError)
    {
+      BONJOUR_STATS_INCR(failed[BONJOUR_OP_REGISTER]);
+      BONJOUR_PROBE3(operation__stop, BONJOUR_OP_REGISTER, activeRegister, error);
+
+      if(activeRegister->thresholds != NULL) {
+         bonjour_register_thresholds_free(activeRegister->thresholds);
+      }
+      ckfree(txtRecord);
       ckfree(activeRegister->regtype);
       ckfree((void *)activeRegister);
       Tcl_DeleteHashEntry(hashEntry);
 
+      bonjour_stats_error(error);
       Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceRegister", error));
       return TCL_ERROR;
    }
 
+   BONJOUR_STATS_INCR(started[BONJOUR_OP_REGISTER]);
+   BONJOUR_STATS_INCR(inFlight[BONJOUR_OP_REGISTER]);
+
    return TCL_OK;
 }
 
+////////////////////////////////////////////////////
+// ::bonjour::unregister command
+////////////////////////////////////////////////////
+static int bonjour_unregister(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   Tcl_HashTable *registerRegistrations = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
+
+   if(objc != 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<regtype>");
+      return(TCL_ERROR);
+   }
+
+   // unregistering a regtype which isn't registered
+   // is not an error, matching ::bonjour::browse stop
+   hashEntry = Tcl_FindHashEntry(registerRegistrations, Tcl_GetString(objv[1]));
+   if(hashEntry) {
+      bonjour_register_free(
+         (active_registration *)Tcl_GetHashValue(hashEntry));
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::update_txt command.  Updates are sent
+// at most once per interval, the latest of those
+// made in between being sent when it has passed,
+// and are skipped when they change no more than
+// the thresholds allow.  Returns "sent", "pending"
+// or "skipped".
+////////////////////////////////////////////////////
+static int bonjour_update_txt(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   Tcl_HashTable *registerRegistrations = (Tcl_HashTable *)clientData;
+   active_registration *activeRegister;
+   Tcl_HashEntry *hashEntry;
+   DNSServiceErrorType error;
+   Tcl_WideInt due;
+   uint16_t txtLen;
+   void *txtRecord;
+   const char *regtype;
+
+   if(objc != 3) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<regtype> <txt-record-list>");
+      return(TCL_ERROR);
+   }
+
+   regtype = Tcl_GetString(objv[1]);
+   hashEntry = Tcl_FindHashEntry(registerRegistrations, regtype);
+   if(hashEntry == NULL) {
+      Tcl_Obj *errorMsg = Tcl_NewStringObj(NULL, 0);
+      Tcl_AppendStringsToObj(
+         errorMsg, "regtype ", regtype, " is not registered", NULL);
+      Tcl_SetObjResult(interp, errorMsg);
+      return(TCL_ERROR);
+   }
+   activeRegister = (active_registration *)Tcl_GetHashValue(hashEntry);
+
+   if(list2txt(interp, objv[2], &txtLen, &txtRecord) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   // an update which doesn't differ enough from what was
+   // last sent also supersedes any update waiting
+   if(!bonjour_register_changed(activeRegister, txtLen, txtRecord)) {
+      ckfree(txtRecord);
+      if(activeRegister->pendingRecord != NULL) {
+         Tcl_DeleteTimerHandler(activeRegister->timer);
+         activeRegister->timer = NULL;
+         ckfree(activeRegister->pendingRecord);
+         activeRegister->pendingRecord = NULL;
+      }
+      BONJOUR_STATS_INCR(coalesced[BONJOUR_OP_REGISTER]);
+      Tcl_SetResult(interp, "skipped", TCL_STATIC);
+      return(TCL_OK);
+   }
+
+   due = activeRegister->lastUpdate + (Tcl_WideInt)activeRegister->interval * 1000;
+   if(activeRegister->pendingRecord == NULL && bonjour_time_now() >= due) {
+      error = bonjour_register_send(activeRegister, txtLen, txtRecord);
+      if(error != kDNSServiceErr_NoError) {
+         Tcl_SetObjResult(interp,
+            create_dnsservice_error(interp, "DNSServiceUpdateRecord", error));
+         return(TCL_ERROR);
+      }
+      Tcl_SetResult(interp, "sent", TCL_STATIC);
+      return(TCL_OK);
+   }
+
+   // only the latest update is sent once the interval
+   // has passed
+   if(activeRegister->pendingRecord != NULL) {
+      ckfree(activeRegister->pendingRecord);
+      BONJOUR_STATS_INCR(coalesced[BONJOUR_OP_REGISTER]);
+   }
+   else {
+      Tcl_WideInt delay = (due - bonjour_time_now() + 999) / 1000;
+
+      activeRegister->timer = Tcl_CreateTimerHandler(
+         (delay > 0) ? (int)delay : 0,
+         bonjour_register_flush, activeRegister);
+   }
+   activeRegister->pendingLen = txtLen;
+   activeRegister->pendingRecord = txtRecord;
+
+   Tcl_SetResult(interp, "pending", TCL_STATIC);
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// sends a TXT record, which the registration takes
+// ownership of
+////////////////////////////////////////////////////
+static DNSServiceErrorType bonjour_register_send(
+   active_registration *activeRegister,
+   uint16_t txtLen,
+   void *txtRecord
+) {
+   DNSServiceErrorType error;
+
+   // an empty TXT record holds a single empty string
+   error = DNSServiceUpdateRecord(activeRegister->sdRef, NULL, 0,
+      (txtLen == 0) ? 1 : txtLen, (txtLen == 0) ? "" : txtRecord, 0);
+   if(error != kDNSServiceErr_NoError) {
+      bonjour_stats_error(error);
+      ckfree(txtRecord);
+      return(error);
+   }
+
+   ckfree(activeRegister->txtRecord);
+   activeRegister->txtLen = txtLen;
+   activeRegister->txtRecord = txtRecord;
+   activeRegister->lastUpdate = bonjour_time_now();
+
+   return(kDNSServiceErr_NoError);
+}
+
+////////////////////////////////////////////////////
+// timer handler sending the TXT record waiting for
+// the interval to pass
+////////////////////////////////////////////////////
+static void bonjour_register_flush(
+   ClientData clientData
+) {
+   active_registration *activeRegister = (active_registration *)clientData;
+   void *txtRecord = activeRegister->pendingRecord;
+
+   activeRegister->timer = NULL;
+   activeRegister->pendingRecord = NULL;
+
+   // an error has been counted, and the next update
+   // is tried as usual
+   bonjour_register_send(activeRegister,
+                         activeRegister->pendingLen, txtRecord);
+}
+
+////////////////////////////////////////////////////
+// returns non-zero if a TXT record differs enough
+// from the one last sent to be worth sending.  The
+// integer values of keys with a threshold must
+// change by at least that much, and everything else
+// must be the same.
+////////////////////////////////////////////////////
+static int bonjour_register_changed(
+   active_registration *activeRegister,
+   uint16_t txtLen,
+   const void *txtRecord
+) {
+   uint16_t oldLen = activeRegister->txtLen;
+   const void *oldRecord = activeRegister->txtRecord;
+   uint16_t numKeys, i;
+
+   if(activeRegister->thresholds == NULL) {
+      return(txtLen != oldLen || memcmp(txtRecord, oldRecord, txtLen) != 0);
+   }
+
+   numKeys = TXTRecordGetCount(txtLen, txtRecord);
+   if(numKeys != TXTRecordGetCount(oldLen, oldRecord)) {
+      return(1);
+   }
+
+   for(i = 0; i < numKeys; i++) {
+      char key[256];
+      uint8_t valueLen, oldValueLen;
+      const void *value, *oldValue;
+      Tcl_HashEntry *hashEntry;
+      Tcl_WideInt number, oldNumber;
+
+      TXTRecordGetItemAtIndex(txtLen, txtRecord, i, sizeof(key), key,
+                              &valueLen, &value);
+      if(!TXTRecordContainsKey(oldLen, oldRecord, key)) {
+         return(1);
+      }
+      oldValue = TXTRecordGetValuePtr(oldLen, oldRecord, key, &oldValueLen);
+
+      hashEntry = Tcl_FindHashEntry(activeRegister->thresholds, key);
+      if(hashEntry != NULL &&
+         bonjour_register_number(value, valueLen, &number) &&
+         bonjour_register_number(oldValue, oldValueLen, &oldNumber)) {
+         Tcl_WideInt change = (number > oldNumber) ?
+            number - oldNumber : oldNumber - number;
+
+         if(change >= *(Tcl_WideInt *)Tcl_GetHashValue(hashEntry) &&
+            change > 0) {
+            return(1);
+         }
+         continue;
+      }
+
+      if((value == NULL) != (oldValue == NULL) || valueLen != oldValueLen ||
+         (valueLen > 0 && memcmp(value, oldValue, valueLen) != 0)) {
+         return(1);
+      }
+   }
+
+   return(0);
+}
+
+////////////////////////////////////////////////////
+// parses the integer value of a TXT key, returning
+// zero if it isn't one
+////////////////////////////////////////////////////
+static int bonjour_register_number(
+   const void *value,
+   uint8_t valueLen,
+   Tcl_WideInt *number
+) {
+   char buffer[32];
+   char *end;
+
+   if(value == NULL || valueLen == 0 || valueLen >= sizeof(buffer)) {
+      return(0);
+   }
+   memcpy(buffer, value, valueLen);
+   buffer[valueLen] = '\0';
+
+   *number = strtoll(buffer, &end, 10);
+   return(*end == '\0');
+}
+
+////////////////////////////////////////////////////
+// frees a registration's thresholds
+////////////////////////////////////////////////////
+static void bonjour_register_thresholds_free(
+   Tcl_HashTable *thresholds
+) {
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   for(hashEntry = Tcl_FirstHashEntry(thresholds, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      ckfree((void *)Tcl_GetHashValue(hashEntry));
+   }
+   Tcl_DeleteHashTable(thresholds);
+   ckfree((void *)thresholds);
+}
+
+////////////////////////////////////////////////////
+// withdraws a registration and frees the structure
+// describing it
+////////////////////////////////////////////////////
+static void bonjour_register_free(
+   active_registration *activeRegister
+) {
+   // deallocate the service reference
+   DNSServiceRefDeallocate(activeRegister->sdRef);
+   BONJOUR_STATS_DECR(inFlight[BONJOUR_OP_REGISTER]);
+   BONJOUR_TRACE(BONJOUR_TRACE_STOP, BONJOUR_OP_REGISTER, activeRegister->sdRef,
+                 0, 0, 0, 0, 0);
+   BONJOUR_PROBE3(operation__stop, BONJOUR_OP_REGISTER, activeRegister, 0);
+
+   // a pending update is dropped along with the service
+   if(activeRegister->timer != NULL) {
+      Tcl_DeleteTimerHandler(activeRegister->timer);
+   }
+   if(activeRegister->pendingRecord != NULL) {
+      ckfree(activeRegister->pendingRecord);
+   }
+   if(activeRegister->thresholds != NULL) {
+      bonjour_register_thresholds_free(activeRegister->thresholds);
+   }
+
+   // clean up the memory used by activeRegister
+   ckfree(activeRegister->txtRecord);
+   ckfree(activeRegister->regtype);
+   ckfree((void *)activeRegister);
+}
+
 ////////////////////////////////////////////////////
 // cleanup any leftover registration
 ////////////////////////////////////////////////////
-static int bonjour_register_cleanup(
+static void bonjour_register_cleanup(
    ClientData clientData
 ) {
    Tcl_HashTable *registerRegistrations = 
@@ -217,21 +733,26 @@ static int bonjour_register_cleanup(
        hashEntry = Tcl_NextHashEntry(&searchToken)) {
 
       activeRegister = (active_registration *)Tcl_GetHashValue(hashEntry);
-
-      // deallocate the service reference
-      DNSServiceRefDeallocate(activeRegister->sdRef);
-
-      // clean up the memory used by activeRegister
-      ckfree(activeRegister->regtype);
-      ckfree((void *)activeRegister);
+      bonjour_register_free(activeRegister);
 
       // deallocate the hash entry
       Tcl_DeleteHashEntry(hashEntry);
    }
-
-   Tcl_DeleteHashTable(registerRegistrations);
-
-   return(TCL_OK);
 }
 
+////////////////////////////////////////////////////
+// called when the interpreter is deleted to withdraw
+// its registrations and free the hash table
+////////////////////////////////////////////////////
+static void bonjour_register_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *registerRegistrations = (Tcl_HashTable *)clientData;
+
+   Tcl_DeleteThreadExitHandler(bonjour_register_cleanup, registerRegistrations);
+   bonjour_register_cleanup(registerRegistrations);
 
+   Tcl_DeleteHashTable(registerRegistrations);
+   ckfree((void *)registerRegistrations);
+}
@@ -0,0 +1,672 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "replay.h"
+#include "stats.h"
+
+/*
+*  Recording file format.  All integers are in native byte order.
+*
+*  The file starts with the 8 byte magic number "BJREC001" and is
+*  followed by any number of records.  Each record has a fixed
+*  28 byte header:
+*
+*     uint32   total size of the record, including this header
+*     uint8    operation (bonjour_op_type)
+*     uint8    number of fields following the header
+*     uint16   reserved
+*     int64    time since the recording started (usec)
+*     uint32   flags
+*     uint32   interface index
+*     int32    error code
+*
+*  followed by the fields, each a uint16 length and that many bytes.
+*  The fields for each operation are:
+*
+*     browse            name, regtype, domain
+*     resolve           fullname, hosttarget, port (network order), TXT
+*     resolve_address   fullname, rrtype, rrclass, rdata, ttl
+*/
+
+#define BONJOUR_RECORD_MAGIC "BJREC001"
+#define BONJOUR_RECORD_HEADER_SIZE 28
+#define BONJOUR_RECORD_MAX_FIELDS 8
+
+// a field of a record
+typedef struct {
+   const void *data;
+   uint16_t length;
+} record_field;
+
+// non-zero while a recording is in progress
+volatile int bonjourRecording = 0;
+
+// the file being recorded to, when recording began and
+// the errno of the first write to fail, or 0, protected
+// by recordMutex
+TCL_DECLARE_MUTEX(recordMutex)
+static FILE *recordFile = NULL;
+static Tcl_WideInt recordStart = 0;
+static int recordError = 0;
+
+// per-thread replay state
+typedef struct {
+   int depth;           // number of replays in progress
+} replay_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_record_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_replay_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static void bonjour_record_write(
+   bonjour_op_type op,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   int numFields,
+   const record_field *fields
+);
+static void bonjour_record_bytes(
+   const void *data,
+   size_t length
+);
+static void bonjour_record_string(
+   record_field *field,
+   const char *string
+);
+static int bonjour_record_close(void);
+static void bonjour_record_cleanup(
+   ClientData clientData
+);
+
+////////////////////////////////////////////////////
+// Function to initialize record/replay related stuff
+////////////////////////////////////////////////////
+int Replay_Init(
+   Tcl_Interp *interp
+) {
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::record", bonjour_record_cmd,
+      NULL, NULL
+   );
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::replay", bonjour_replay_cmd,
+      NULL, NULL
+   );
+
+   // make sure a recording in progress is flushed
+   // on exit
+   Tcl_CreateExitHandler(bonjour_record_cleanup, NULL);
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::record command
+////////////////////////////////////////////////////
+static int bonjour_record_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *subcommands[] = { "start", "stop", NULL };
+   int cmdIndex;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<sub-command> <args>");
+      return(TCL_ERROR);
+   }
+
+   if(Tcl_GetIndexFromObj(
+         interp, objv[1], subcommands,
+         "subcommand", 0, &cmdIndex
+      ) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   if(cmdIndex == 0) { // start
+      const char *nativePath;
+      FILE *file;
+
+      if(objc != 3) {
+         Tcl_WrongNumArgs(interp, 2, objv, "<fileName>");
+         return(TCL_ERROR);
+      }
+
+      nativePath = (const char *)Tcl_FSGetNativePath(objv[2]);
+      if(nativePath == NULL) {
+         Tcl_AppendResult(interp, "invalid file name \"",
+            Tcl_GetString(objv[2]), "\"", NULL);
+         return(TCL_ERROR);
+      }
+
+      Tcl_MutexLock(&recordMutex);
+      if(recordFile != NULL) {
+         Tcl_MutexUnlock(&recordMutex);
+         Tcl_SetResult(interp, "a recording is already in progress", TCL_STATIC);
+         return(TCL_ERROR);
+      }
+
+      file = fopen(nativePath, "wb");
+      if(file == NULL) {
+         Tcl_MutexUnlock(&recordMutex);
+         Tcl_AppendResult(interp, "couldn't open \"",
+            Tcl_GetString(objv[2]), "\": ", Tcl_PosixError(interp), NULL);
+         return(TCL_ERROR);
+      }
+      recordFile = file;
+      recordError = 0;
+      bonjour_record_bytes(BONJOUR_RECORD_MAGIC, strlen(BONJOUR_RECORD_MAGIC));
+      recordStart = bonjour_time_now();
+      bonjourRecording = 1;
+      Tcl_MutexUnlock(&recordMutex);
+   }
+   else { // stop
+      int error;
+
+      if(objc != 2) {
+         Tcl_WrongNumArgs(interp, 2, objv, NULL);
+         return(TCL_ERROR);
+      }
+
+      // the recording is incomplete if any write failed
+      error = bonjour_record_close();
+      if(error != 0) {
+         Tcl_SetErrno(error);
+         Tcl_AppendResult(interp, "couldn't write the recording: ",
+            Tcl_PosixError(interp), NULL);
+         return(TCL_ERROR);
+      }
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// stops any recording in progress, returning the
+// errno of the first write or close to fail, or 0
+////////////////////////////////////////////////////
+static int bonjour_record_close(void) {
+   int error;
+
+   Tcl_MutexLock(&recordMutex);
+   bonjourRecording = 0;
+   if(recordFile != NULL) {
+      if(fclose(recordFile) != 0 && recordError == 0) {
+         recordError = (errno != 0) ? errno : EIO;
+      }
+      recordFile = NULL;
+   }
+   error = recordError;
+   recordError = 0;
+   Tcl_MutexUnlock(&recordMutex);
+
+   return(error);
+}
+
+////////////////////////////////////////////////////
+// stops any recording in progress when the process
+// exits
+////////////////////////////////////////////////////
+static void bonjour_record_cleanup(
+   ClientData clientData
+) {
+   bonjour_record_close();
+}
+
+////////////////////////////////////////////////////
+// writes bytes to the recording, remembering the
+// first failure.  Nothing more is written after a
+// failure, as the records would no longer line up.
+// Called with recordMutex held.
+////////////////////////////////////////////////////
+static void bonjour_record_bytes(
+   const void *data,
+   size_t length
+) {
+   if(recordError != 0 || length == 0) {
+      return;
+   }
+   errno = 0;
+   if(fwrite(data, 1, length, recordFile) != length) {
+      recordError = (errno != 0) ? errno : EIO;
+   }
+}
+
+////////////////////////////////////////////////////
+// writes a single record to the recording
+////////////////////////////////////////////////////
+static void bonjour_record_write(
+   bonjour_op_type op,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   int numFields,
+   const record_field *fields
+) {
+   unsigned char header[BONJOUR_RECORD_HEADER_SIZE];
+   uint32_t size = BONJOUR_RECORD_HEADER_SIZE;
+   uint32_t value32;
+   int32_t error32 = errorCode;
+   Tcl_WideInt time;
+   int i;
+
+   for(i = 0; i < numFields; i++) {
+      size += sizeof(uint16_t) + fields[i].length;
+   }
+
+   Tcl_MutexLock(&recordMutex);
+   if(recordFile == NULL) {
+      Tcl_MutexUnlock(&recordMutex);
+      return;
+   }
+
+   time = bonjour_time_now() - recordStart;
+
+   memset(header, 0, sizeof(header));
+   memcpy(header, &size, sizeof(uint32_t));
+   header[4] = (unsigned char)op;
+   header[5] = (unsigned char)numFields;
+   memcpy(header + 8, &time, sizeof(Tcl_WideInt));
+   value32 = flags;
+   memcpy(header + 16, &value32, sizeof(uint32_t));
+   memcpy(header + 20, &interfaceIndex, sizeof(uint32_t));
+   memcpy(header + 24, &error32, sizeof(int32_t));
+   bonjour_record_bytes(header, sizeof(header));
+
+   for(i = 0; i < numFields; i++) {
+      bonjour_record_bytes(&fields[i].length, sizeof(uint16_t));
+      bonjour_record_bytes(fields[i].data, fields[i].length);
+   }
+   Tcl_MutexUnlock(&recordMutex);
+}
+
+////////////////////////////////////////////////////
+// fills in a field from a string, allowing NULL
+////////////////////////////////////////////////////
+static void bonjour_record_string(
+   record_field *field,
+   const char *string
+) {
+   field->data = string;
+   field->length = (string == NULL) ? 0 : (uint16_t)strlen(string);
+}
+
+////////////////////////////////////////////////////
+// Functions used by the callbacks to record the
+// replies they receive
+////////////////////////////////////////////////////
+void bonjour_record_browse(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+) {
+   record_field fields[3];
+
+   bonjour_record_string(&fields[0], serviceName);
+   bonjour_record_string(&fields[1], regtype);
+   bonjour_record_string(&fields[2], domain);
+
+   bonjour_record_write(BONJOUR_OP_BROWSE,
+      flags, interfaceIndex, errorCode, 3, fields);
+}
+
+void bonjour_record_resolve(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+) {
+   record_field fields[4];
+
+   bonjour_record_string(&fields[0], fullname);
+   bonjour_record_string(&fields[1], hosttarget);
+   fields[2].data = &port;
+   fields[2].length = sizeof(port);
+   fields[3].data = txtRecord;
+   fields[3].length = (txtRecord == NULL) ? 0 : txtLen;
+
+   bonjour_record_write(BONJOUR_OP_RESOLVE,
+      flags, interfaceIndex, errorCode, 4, fields);
+}
+
+void bonjour_record_address(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   uint16_t rrtype,
+   uint16_t rrclass,
+   uint16_t rdlen,
+   const void *rdata,
+   uint32_t ttl
+) {
+   record_field fields[5];
+
+   bonjour_record_string(&fields[0], fullname);
+   fields[1].data = &rrtype;
+   fields[1].length = sizeof(rrtype);
+   fields[2].data = &rrclass;
+   fields[2].length = sizeof(rrclass);
+   fields[3].data = rdata;
+   fields[3].length = (rdata == NULL) ? 0 : rdlen;
+   fields[4].data = &ttl;
+   fields[4].length = sizeof(ttl);
+
+   bonjour_record_write(BONJOUR_OP_RESOLVE_ADDRESS,
+      flags, interfaceIndex, errorCode, 5, fields);
+}
+
+////////////////////////////////////////////////////
+// returns non-zero while ::bonjour::replay is
+// delivering replies in the calling thread
+////////////////////////////////////////////////////
+int bonjour_replaying(void) {
+   replay_thread_data *tsdPtr = (replay_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(replay_thread_data));
+
+   return(tsdPtr->depth > 0);
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::replay command
+////////////////////////////////////////////////////
+static int bonjour_replay_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *options[] = {
+      "-speed", "-browse", "-resolve", "-resolve_address", "--", NULL
+   };
+   enum optionIndex {
+      OPT_SPEED, OPT_BROWSE, OPT_RESOLVE, OPT_ADDRESS, OPT_END
+   };
+   static const char *speeds[] = { "original", "max", NULL };
+   Tcl_Obj *scripts[BONJOUR_OP_COUNT];
+   Tcl_Obj *contents, *result;
+   Tcl_Channel channel;
+   const unsigned char *bytes;
+   Tcl_WideInt startTime;
+   replay_thread_data *tsdPtr;
+   int originalSpeed = 1;
+   int length, offset;
+   int events = 0, skipped = 0;
+   int objIndex, index;
+
+   memset(scripts, 0, sizeof(scripts));
+
+   // parse options
+   for(objIndex = 1; objIndex < objc; objIndex++) {
+      if(Tcl_GetString(objv[objIndex])[0] != '-') {
+         break;
+      }
+
+      if(Tcl_GetIndexFromObj(interp, objv[objIndex], options, "option", 0, &index) != TCL_OK) {
+         return TCL_ERROR;
+      }
+
+      if(index == OPT_END) {
+         objIndex++;
+         break;
+      }
+
+      if(objIndex + 1 >= objc) {
+         Tcl_AppendResult(interp, Tcl_GetString(objv[objIndex]),
+            " requires a value", NULL);
+         return TCL_ERROR;
+      }
+      objIndex++;
+
+      switch(index) {
+      case OPT_SPEED:
+         if(Tcl_GetIndexFromObj(interp, objv[objIndex], speeds, "speed", 0, &index) != TCL_OK) {
+            return TCL_ERROR;
+         }
+         originalSpeed = (index == 0);
+         break;
+      case OPT_BROWSE:
+         scripts[BONJOUR_OP_BROWSE] = objv[objIndex];
+         break;
+      case OPT_RESOLVE:
+         scripts[BONJOUR_OP_RESOLVE] = objv[objIndex];
+         break;
+      case OPT_ADDRESS:
+         scripts[BONJOUR_OP_RESOLVE_ADDRESS] = objv[objIndex];
+         break;
+      }
+   }
+
+   if(objc - objIndex != 1) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?options? <fileName>");
+      return(TCL_ERROR);
+   }
+
+   // read the whole recording
+   channel = Tcl_FSOpenFileChannel(interp, objv[objIndex], "r", 0);
+   if(channel == NULL) {
+      return(TCL_ERROR);
+   }
+   Tcl_SetChannelOption(interp, channel, "-translation", "binary");
+
+   contents = Tcl_NewObj();
+   Tcl_IncrRefCount(contents);
+   if(Tcl_ReadChars(channel, contents, -1, 0) < 0) {
+      Tcl_AppendResult(interp, "error reading \"",
+         Tcl_GetString(objv[objIndex]), "\": ", Tcl_PosixError(interp), NULL);
+      Tcl_Close(NULL, channel);
+      Tcl_DecrRefCount(contents);
+      return(TCL_ERROR);
+   }
+   Tcl_Close(NULL, channel);
+
+   bytes = Tcl_GetByteArrayFromObj(contents, &length);
+   if(length < (int)strlen(BONJOUR_RECORD_MAGIC) ||
+      memcmp(bytes, BONJOUR_RECORD_MAGIC, strlen(BONJOUR_RECORD_MAGIC)) != 0) {
+      Tcl_DecrRefCount(contents);
+      Tcl_AppendResult(interp, "\"", Tcl_GetString(objv[objIndex]),
+         "\" is not a bonjour recording", NULL);
+      return(TCL_ERROR);
+   }
+
+   // run through the records, delivering each one
+   tsdPtr = (replay_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(replay_thread_data));
+   tsdPtr->depth++;
+   startTime = bonjour_time_now();
+   offset = strlen(BONJOUR_RECORD_MAGIC);
+   while(offset < length) {
+      record_field fields[BONJOUR_RECORD_MAX_FIELDS];
+      Tcl_DString strings[3];
+      const unsigned char *record = bytes + offset;
+      uint32_t size, flags, interfaceIndex;
+      int32_t errorCode;
+      Tcl_WideInt time;
+      int op, numFields, fieldOffset, i;
+
+      // validate the record
+      if(length - offset < BONJOUR_RECORD_HEADER_SIZE) {
+         break;
+      }
+      memcpy(&size, record, sizeof(uint32_t));
+      if(size < BONJOUR_RECORD_HEADER_SIZE || size > (uint32_t)(length - offset)) {
+         break;
+      }
+      op = record[4];
+      numFields = record[5];
+      if(numFields > BONJOUR_RECORD_MAX_FIELDS) {
+         break;
+      }
+      memcpy(&time, record + 8, sizeof(Tcl_WideInt));
+      memcpy(&flags, record + 16, sizeof(uint32_t));
+      memcpy(&interfaceIndex, record + 20, sizeof(uint32_t));
+      memcpy(&errorCode, record + 24, sizeof(int32_t));
+
+      fieldOffset = BONJOUR_RECORD_HEADER_SIZE;
+      for(i = 0; i < numFields; i++) {
+         if(fieldOffset + (int)sizeof(uint16_t) > (int)size) {
+            break;
+         }
+         memcpy(&fields[i].length, record + fieldOffset, sizeof(uint16_t));
+         fieldOffset += sizeof(uint16_t);
+         if(fieldOffset + fields[i].length > (int)size) {
+            break;
+         }
+         fields[i].data = record + fieldOffset;
+         fieldOffset += fields[i].length;
+      }
+      if(i != numFields) {
+         break;
+      }
+
+      offset += size;
+
+      if(op >= BONJOUR_OP_COUNT || scripts[op] == NULL) {
+         skipped++;
+         continue;
+      }
+
+      // wait until the reply is due
+      if(originalSpeed) {
+         Tcl_WideInt now;
+
+         while((now = bonjour_time_now()) < startTime + time) {
+            Tcl_Sleep((int)((startTime + time - now + 999) / 1000));
+         }
+      }
+
+      // strings in the recording aren't terminated
+      for(i = 0; i < 3; i++) {
+         Tcl_DStringInit(&strings[i]);
+         if(i < numFields) {
+            Tcl_DStringAppend(&strings[i], fields[i].data, fields[i].length);
+         }
+      }
+
+      if(op == BONJOUR_OP_BROWSE && numFields == 3) {
+         bonjour_browse_replay(interp, scripts[op],
+            flags, interfaceIndex, errorCode,
+            Tcl_DStringValue(&strings[0]),
+            Tcl_DStringValue(&strings[1]),
+            Tcl_DStringValue(&strings[2]));
+         BONJOUR_STATS_INCR(replayed[op]);
+         events++;
+      }
+      else if(op == BONJOUR_OP_RESOLVE && numFields == 4 &&
+              fields[2].length == sizeof(uint16_t)) {
+         uint16_t port;
+
+         memcpy(&port, fields[2].data, sizeof(uint16_t));
+         bonjour_resolve_replay(interp, scripts[op],
+            flags, interfaceIndex, errorCode,
+            Tcl_DStringValue(&strings[0]),
+            Tcl_DStringValue(&strings[1]),
+            port, fields[3].length, fields[3].data);
+         BONJOUR_STATS_INCR(replayed[op]);
+         events++;
+      }
+      else if(op == BONJOUR_OP_RESOLVE_ADDRESS && numFields == 5 &&
+              fields[1].length == sizeof(uint16_t) &&
+              fields[2].length == sizeof(uint16_t) &&
+              fields[4].length == sizeof(uint32_t) &&
+              (errorCode != kDNSServiceErr_NoError || fields[3].length >= 4)) {
+         uint16_t rrtype, rrclass;
+         uint32_t ttl;
+
+         memcpy(&rrtype, fields[1].data, sizeof(uint16_t));
+         memcpy(&rrclass, fields[2].data, sizeof(uint16_t));
+         memcpy(&ttl, fields[4].data, sizeof(uint32_t));
+         bonjour_resolve_address_replay(interp, scripts[op],
+            flags, interfaceIndex, errorCode,
+            Tcl_DStringValue(&strings[0]),
+            rrtype, rrclass, fields[3].length, fields[3].data, ttl);
+         BONJOUR_STATS_INCR(replayed[op]);
+         events++;
+      }
+      else {
+         skipped++;
+      }
+
+      for(i = 0; i < 3; i++) {
+         Tcl_DStringFree(&strings[i]);
+      }
+   }
+   tsdPtr->depth--;
+
+   if(offset != length) {
+      Tcl_DecrRefCount(contents);
+      Tcl_ResetResult(interp);
+      Tcl_AppendResult(interp, "\"", Tcl_GetString(objv[objIndex]),
+         "\" is truncated or corrupt", NULL);
+      return(TCL_ERROR);
+   }
+   Tcl_DecrRefCount(contents);
+
+   result = Tcl_NewDictObj();
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("events", -1),
+      Tcl_NewIntObj(events));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("skipped", -1),
+      Tcl_NewIntObj(skipped));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("elapsed", -1),
+      Tcl_NewWideIntObj(bonjour_time_now() - startTime));
+   Tcl_SetObjResult(interp, result);
+
+   return(TCL_OK);
+}
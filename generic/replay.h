@@ -0,0 +1,130 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+////////////////////////////////////////////////////
+// Record and replay of dns_sd replies.  While
+// recording, every reply delivered to the browse,
+// resolve and address callbacks is written to a
+// file which ::bonjour::replay can later feed back
+// through the same callbacks.
+////////////////////////////////////////////////////
+
+// non-zero while a recording is in progress
+extern volatile int bonjourRecording;
+
+////////////////////////////////////////////////////
+// returns non-zero while ::bonjour::replay is
+// delivering replies in the calling thread.
+// Replayed replies are counted under replayed
+// rather than as live replies.  They arrive without
+// a service reference, so live replies which have
+// one never need to ask.
+////////////////////////////////////////////////////
+int bonjour_replaying(void);
+
+#define BONJOUR_REPLAYED(sdRef) ((sdRef) == NULL && bonjour_replaying())
+
+////////////////////////////////////////////////////
+// Functions used by the callbacks to record the
+// replies they receive.  Callers should check
+// bonjourRecording first.
+////////////////////////////////////////////////////
+void bonjour_record_browse(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+);
+void bonjour_record_resolve(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+);
+void bonjour_record_address(
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   uint16_t rrtype,
+   uint16_t rrclass,
+   uint16_t rdlen,
+   const void *rdata,
+   uint32_t ttl
+);
+
+////////////////////////////////////////////////////
+// Functions used by ::bonjour::replay to deliver a
+// recorded reply to a callback script, through the
+// same code as a live reply
+////////////////////////////////////////////////////
+void bonjour_browse_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *serviceName,
+   const char *regtype,
+   const char *domain
+);
+void bonjour_resolve_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+);
+void bonjour_resolve_address_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   uint16_t rrtype,
+   uint16_t rrclass,
+   uint16_t rdlen,
+   const void *rdata,
+   uint32_t ttl
+);
+
+#endif
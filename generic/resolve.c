@@ -25,27 +25,84 @@ OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
 DAMAGE.
 */
 
+#include <errno.h>
 #include <string.h>
+#include <poll.h>
 
 #include <tcl.h>
 #include <arpa/inet.h>
 #include <dns_sd.h>
 
 #include "bonjour.h"
+#include "dispatch.h"
+#include "probes.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "txt_record.h"
 
+// ::bonjour::await uses the NRE API, which first appeared in 8.6
+#if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION >= 6)
+#define BONJOUR_HAVE_NRE
+#endif
+
 ////////////////////////////////////////////////////
 // Support structures
 ////////////////////////////////////////////////////
 
+// the reply to a resolve started with -wait, filled
+// in from the resolve callback
+typedef struct {
+   int done;            // set once the reply has arrived
+   int code;            // TCL_OK or TCL_ERROR
+   Tcl_Obj *reply;      // the reply or error message
+} resolve_wait;
+
 // information on a resolve currently in progress
 typedef struct {
    DNSServiceRef sdRef; // the service discovery reference
    Tcl_Obj *callback;   // the callback script
    Tcl_Interp *interp;  // interpreter in which to execute the
                         // callback
+   Tcl_WideInt startTime; // when the resolve was started, or
+                          // zero if the reply is being replayed
+   bonjour_op_type op;  // BONJOUR_OP_RESOLVE or
+                        // BONJOUR_OP_RESOLVE_ADDRESS
+   Tcl_HashEntry *hashEntry; // entry in the interpreter's table
+                             // of resolves, or NULL once the
+                             // callback has been called or if
+                             // the reply is being replayed
+   Tcl_Obj *cachedReply; // callback answered from the snapshot,
+                         // or NULL
+   Tcl_TimerToken cacheTimer; // evaluates cachedReply
+   Tcl_Obj *coroutine;  // coroutine waiting in ::bonjour::await,
+                        // resumed with the reply instead of
+                        // evaluating callback, or NULL
+   int answered;        // set once the coroutine has been resumed
+   resolve_wait *wait;  // where a resolve started with -wait
+                        // leaves its reply, or NULL
+   txt_predicate *match; // tests the TXT record must pass for
+                         // the reply to be delivered, or NULL
 } active_resolve;
 
+// each interpreter stores its active_resolve structures, hashed
+// on their handles, in a hash table kept as assoc data under
+// this key so that they can be cancelled when the interpreter
+// is deleted
+#define BONJOUR_RESOLVE_ASSOC "bonjour::resolve"
+
+// handles are numbered per thread, which makes them unique
+// within each interpreter
+typedef struct {
+   unsigned long nextHandle;
+   int initialized;     // set once the commands below exist
+   Tcl_Obj *infoCoroutine[2]; // ::info coroutine
+   Tcl_Obj *yield;      // ::yield
+} resolve_thread_data;
+
+static Tcl_ThreadDataKey dataKey;
+
 ////////////////////////////////////////////////////
 // Private function prototypes
 ////////////////////////////////////////////////////
@@ -62,6 +119,61 @@ static int bonjour_resolve_address(
    int objc,
    Tcl_Obj *const objv[]
 );
+static int bonjour_cancel(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_resolve_command(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[],
+   bonjour_op_type op
+);
+static active_resolve *bonjour_resolve_begin(
+   Tcl_Interp *interp,
+   Tcl_HashTable *resolves,
+   bonjour_op_type op,
+   uint32_t interfaceIndex,
+   txt_predicate *match,
+   Tcl_Obj *const objv[],
+   Tcl_Obj *callback
+);
+static int bonjour_resolve_reply(
+   active_resolve *activeResolve,
+   int code,
+   Tcl_Obj *reply
+);
+static int bonjour_resolve_wait(
+   Tcl_Interp *interp,
+   active_resolve *activeResolve,
+   int timeout
+);
+#ifdef BONJOUR_HAVE_NRE
+static int bonjour_await(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_await_nr(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_await_resumed(
+   ClientData data[],
+   Tcl_Interp *interp,
+   int result
+);
+static resolve_thread_data *bonjour_await_data(void);
+static void bonjour_await_cleanup(
+   ClientData clientData
+);
+#endif
 static void bonjour_resolve_callback(
    DNSServiceRef sdRef,
    DNSServiceFlags flags,
@@ -87,6 +199,31 @@ static void bonjour_resolve_address_callback(
    uint32_t ttl,
    void *context
 );
+static void bonjour_resolve_free(
+   active_resolve *activeResolve,
+   DNSServiceErrorType errorCode
+);
+static void bonjour_resolve_started(
+   Tcl_Interp *interp,
+   Tcl_HashTable *resolves,
+   active_resolve *activeResolve
+);
+static void bonjour_resolve_cached(
+   active_resolve *activeResolve,
+   const char *hostname,
+   const char *regtype,
+   const char *domain
+);
+static void bonjour_resolve_cached_reply(
+   ClientData clientData
+);
+static void bonjour_resolve_cleanup(
+   ClientData clientData
+);
+static void bonjour_resolve_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+);
 
 ////////////////////////////////////////////////////
 // Function to initialize resolve related stuff
@@ -94,16 +231,52 @@ static void bonjour_resolve_address_callback(
 int Resolve_Init(
    Tcl_Interp *interp
 ) {
+   Tcl_HashTable *resolves;
+
+   // the package may already be loaded in this interpreter
+   if(Tcl_GetAssocData(interp, BONJOUR_RESOLVE_ASSOC, NULL) != NULL) {
+      return TCL_OK;
+   }
+
+   // initialize the hash table, which is deleted along
+   // with the interpreter
+   resolves = (Tcl_HashTable *)ckalloc(sizeof(Tcl_HashTable));
+   Tcl_InitHashTable(resolves, TCL_STRING_KEYS);
+   Tcl_SetAssocData(interp, BONJOUR_RESOLVE_ASSOC,
+                    bonjour_resolve_delete, resolves);
 
    // register commands
    Tcl_CreateObjCommand(
       interp, "::bonjour::resolve", bonjour_resolve,
-      NULL, NULL
+      resolves, NULL
    );
 
    Tcl_CreateObjCommand(
       interp, "::bonjour::resolve_address", bonjour_resolve_address,
-      NULL, NULL
+      resolves, NULL
+   );
+
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::cancel", bonjour_cancel,
+      resolves, NULL
+   );
+
+#ifdef BONJOUR_HAVE_NRE
+   // coroutines need an 8.6 interpreter, whatever the
+   // headers the package was built with
+   if(Tcl_PkgPresent(interp, "Tcl", "8.6", 0) != NULL) {
+      Tcl_NRCreateCommand(
+         interp, "::bonjour::await", bonjour_await, bonjour_await_nr,
+         resolves, NULL
+      );
+   }
+   Tcl_ResetResult(interp);
+#endif
+
+   // create an exit handler for cleanup
+   Tcl_CreateThreadExitHandler(
+      bonjour_resolve_cleanup,
+      resolves
    );
 
    return TCL_OK;
@@ -118,132 +291,585 @@ static int bonjour_resolve(
    int objc,
    Tcl_Obj *const objv[]
 ) {
-   const char *hostname = NULL,
-              *regtype = NULL,
-              *domain = NULL;
-   Tcl_Obj *callbackScript = NULL;
-   active_resolve *activeResolve = NULL;
+   return(bonjour_resolve_command(clientData, interp, objc, objv,
+                                  BONJOUR_OP_RESOLVE));
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::resolve_address command
+////////////////////////////////////////////////////
+static int bonjour_resolve_address(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   return(bonjour_resolve_command(clientData, interp, objc, objv,
+                                  BONJOUR_OP_RESOLVE_ADDRESS));
+}
+
+////////////////////////////////////////////////////
+// parses the options and arguments common to the
+// resolve and resolve_address commands and starts
+// the resolve
+////////////////////////////////////////////////////
+static int bonjour_resolve_command(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[],
+   bonjour_op_type op
+) {
+   static const char *options[] = {
+      "-wait", "-interface", "-match", NULL
+   };
+   const char *usage = (op == BONJOUR_OP_RESOLVE) ?
+      "?options? <name> <regtype> <domain> <script>" :
+      "?options? <fullname> <script>";
+   int numArgs = (op == BONJOUR_OP_RESOLVE) ? 3 : 1;
+   active_resolve *activeResolve;
+   uint32_t interfaceIndex = 0;
+   Tcl_Obj *matchObj = NULL;
+   txt_predicate *match = NULL;
+   int timeout = -1;
+   int i, optIndex;
+
+   // the options are followed by the service's name and,
+   // without -wait, the script
+   for(i = 1; objc - i > numArgs + ((timeout < 0) ? 1 : 0); i++) {
+      if(Tcl_GetIndexFromObj(
+            interp, objv[i], options, "option", 0, &optIndex
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+      if(++i >= objc) {
+         Tcl_WrongNumArgs(interp, 1, objv, usage);
+         return(TCL_ERROR);
+      }
+
+      switch(optIndex) {
+      case 0: // -wait
+         if(Tcl_GetIntFromObj(interp, objv[i], &timeout) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+         if(timeout < 0) {
+            Tcl_SetResult(interp, "timeout must not be negative", TCL_STATIC);
+            return(TCL_ERROR);
+         }
+         break;
+      case 1: // -interface
+         if(bonjour_get_interface(interp, objv[i], &interfaceIndex) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+         break;
+      case 2: // -match
+         if(op != BONJOUR_OP_RESOLVE) {
+            Tcl_SetResult(interp,
+               "-match can only be used with ::bonjour::resolve", TCL_STATIC);
+            return(TCL_ERROR);
+         }
+         matchObj = objv[i];
+         break;
+      }
+   }
 
    // check for the appropriate number of arguments
-   if(objc != 5) {
-      Tcl_WrongNumArgs(interp, 1, objv, "<name> <regtype> <domain> <script>");
+   if(objc - i != numArgs + ((timeout < 0) ? 1 : 0)) {
+      Tcl_WrongNumArgs(interp, 1, objv, usage);
       return(TCL_ERROR);
    }
 
-   // retrieve the argument values
-   hostname = Tcl_GetString(objv[1]);
-   regtype = Tcl_GetString(objv[2]);
-   domain = Tcl_GetString(objv[3]);
-   callbackScript = Tcl_DuplicateObj(objv[4]);
+   if(matchObj != NULL) {
+      match = txt_predicate_compile(interp, matchObj);
+      if(match == NULL) {
+         return(TCL_ERROR);
+      }
+   }
+
+   // with -wait, the reply is returned rather than
+   // passed to a script
+   activeResolve = bonjour_resolve_begin(interp,
+      (Tcl_HashTable *)clientData, op, interfaceIndex, match, objv + i,
+      (timeout < 0) ?
+         Tcl_DuplicateObj(objv[objc - 1]) : Tcl_NewListObj(0, NULL));
+   if(activeResolve == NULL) {
+      return(TCL_ERROR);
+   }
+   if(timeout >= 0) {
+      return(bonjour_resolve_wait(interp, activeResolve, timeout));
+   }
 
-   // increment the reference count on the callback script
-   // since we will be holding onto it until the callback
-   // is executed
-   Tcl_IncrRefCount(callbackScript);
+   return(TCL_OK);
+}
 
-   // create the active_resolve structure
+////////////////////////////////////////////////////
+// starts a resolve of the service named by objv,
+// which holds the name, regtype and domain for
+// BONJOUR_OP_RESOLVE or the fullname for
+// BONJOUR_OP_RESOLVE_ADDRESS.  The reply is
+// appended to callback, which must be unshared.
+// The resolve takes over match, if not NULL.
+// Returns the new resolve, with its handle in the
+// interpreter's result, or NULL with an error
+// message in the interpreter's result.
+////////////////////////////////////////////////////
+static active_resolve *bonjour_resolve_begin(
+   Tcl_Interp *interp,
+   Tcl_HashTable *resolves,
+   bonjour_op_type op,
+   uint32_t interfaceIndex,
+   txt_predicate *match,
+   Tcl_Obj *const objv[],
+   Tcl_Obj *callback
+) {
+   const char *name = Tcl_GetString(objv[0]);
+   active_resolve *activeResolve = NULL;
+   DNSServiceErrorType error;
+
+   // create the active_resolve structure, which holds
+   // onto the callback until the reply arrives
    activeResolve = (active_resolve *)ckalloc(sizeof(active_resolve));
-   activeResolve->callback = callbackScript;
+   activeResolve->callback = callback;
+   Tcl_IncrRefCount(callback);
    activeResolve->interp = interp;
+   activeResolve->startTime = bonjour_time_now();
+   activeResolve->op = op;
+   activeResolve->cachedReply = NULL;
+   activeResolve->cacheTimer = NULL;
+   activeResolve->coroutine = NULL;
+   activeResolve->answered = 0;
+   activeResolve->wait = NULL;
+   activeResolve->match = match;
 
    // start the resolution
-   DNSServiceErrorType error =
-      DNSServiceResolve(
-         &activeResolve->sdRef,
-         0,
-         0,
-         hostname,
-         regtype,
-         domain,
-         (DNSServiceResolveReply)bonjour_resolve_callback,
-         (void *)activeResolve);
+   BONJOUR_PROBE3(operation__start, op, activeResolve, name);
+   if(op == BONJOUR_OP_RESOLVE) {
+      error =
+         DNSServiceResolve(
+            &activeResolve->sdRef,
+            0,
+            interfaceIndex,
+            name,
+            Tcl_GetString(objv[1]),
+            Tcl_GetString(objv[2]),
+            (DNSServiceResolveReply)bonjour_resolve_callback,
+            (void *)activeResolve);
+   }
+   else {
+      error =
+         DNSServiceQueryRecord(
+            &activeResolve->sdRef,
+            0,
+            interfaceIndex,
+            name,
+            kDNSServiceType_A,
+            kDNSServiceClass_IN,
+            (DNSServiceQueryRecordReply)bonjour_resolve_address_callback,
+            (void *)activeResolve);
+   }
+   BONJOUR_TRACE(BONJOUR_TRACE_START, op,
+                 (error == kDNSServiceErr_NoError) ? activeResolve->sdRef : NULL,
+                 0, 0, error, strlen(name), 0);
 
    if(error != kDNSServiceErr_NoError)
    {
+      BONJOUR_STATS_INCR(failed[op]);
+      BONJOUR_PROBE3(operation__stop, op, activeResolve, error);
+
       Tcl_DecrRefCount(activeResolve->callback);
+      if(match != NULL) {
+         txt_predicate_free(match);
+      }
       ckfree((void *)activeResolve);
 
-      Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceResolve", error));
-      return TCL_ERROR;
+      bonjour_stats_error(error);
+      Tcl_SetObjResult(interp, create_dnsservice_error(interp,
+         (op == BONJOUR_OP_RESOLVE) ?
+            "DNSServiceResolve" : "DNSServiceQueryRecord",
+         error));
+      return(NULL);
    }
 
-   // retrieve the socket being used for the resolve operation
-   // and register a file handler so that we know when
-   // there is data to be read
-   Tcl_CreateFileHandler(
-      DNSServiceRefSockFD(activeResolve->sdRef),
-      TCL_READABLE,
-      bonjour_tcl_callback,
-      activeResolve->sdRef);
+   bonjour_resolve_started(interp, resolves, activeResolve);
 
-   return(TCL_OK);
+   // answer at once if the service is in the snapshot,
+   // which doesn't record the interface it was seen on
+   if(op == BONJOUR_OP_RESOLVE && bonjourSnapshotEnabled &&
+      interfaceIndex == 0) {
+      bonjour_resolve_cached(activeResolve, name,
+         Tcl_GetString(objv[1]), Tcl_GetString(objv[2]));
+   }
+
+   return(activeResolve);
 }
 
 ////////////////////////////////////////////////////
-// ::bonjour::resolve_address command
+// ::bonjour::cancel command
 ////////////////////////////////////////////////////
-static int bonjour_resolve_address(
+static int bonjour_cancel(
    ClientData clientData,
    Tcl_Interp *interp,
    int objc,
    Tcl_Obj *const objv[]
 ) {
-   const char *fullname = NULL;
-   Tcl_Obj *callbackScript = NULL;
-   active_resolve *activeResolve = NULL;
+   Tcl_HashTable *resolves = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry;
 
    // check for the appropriate number of arguments
-   if(objc != 3) {
-      Tcl_WrongNumArgs(interp, 1, objv, "<fullname> <script>");
+   if(objc != 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<handle>");
       return(TCL_ERROR);
    }
 
-   // retrieve the argument values
-   fullname = Tcl_GetString(objv[1]);
-   callbackScript = Tcl_DuplicateObj(objv[2]);
+   // a resolve which has completed can no longer be
+   // cancelled, so its handle is simply unknown
+   hashEntry = Tcl_FindHashEntry(resolves, Tcl_GetString(objv[1]));
+   if(hashEntry == NULL) {
+      Tcl_AppendResult(interp, "no resolve with handle \"",
+         Tcl_GetString(objv[1]), "\" in progress", NULL);
+      return(TCL_ERROR);
+   }
 
-   // increment the reference count on the callback script
-   // since we will be holding onto it until the callback
-   // is executed
-   Tcl_IncrRefCount(callbackScript);
+   bonjour_resolve_free(
+      (active_resolve *)Tcl_GetHashValue(hashEntry),
+      kDNSServiceErr_NoError);
 
-   // create the active_resolve structure
-   activeResolve = (active_resolve *)ckalloc(sizeof(active_resolve));
-   activeResolve->callback = callbackScript;
-   activeResolve->interp = interp;
+   return(TCL_OK);
+}
 
-   // start the resolution
-   DNSServiceErrorType error =
-      DNSServiceQueryRecord(
-         &activeResolve->sdRef,
-         0,
-         0,
-         fullname,
-         kDNSServiceType_A,
-         kDNSServiceClass_IN,
-         (DNSServiceQueryRecordReply)bonjour_resolve_address_callback,
-         (void *)activeResolve);
-   if(error != kDNSServiceErr_NoError)
-   {
-      Tcl_DecrRefCount(activeResolve->callback);
-      ckfree((void *)activeResolve);
+////////////////////////////////////////////////////
+// delivers a reply to a resolve, evaluating its
+// callback or, for ::bonjour::await, resuming the
+// coroutine with a list of the form {code reply}.
+// activeResolve may be freed by the time this
+// returns.
+////////////////////////////////////////////////////
+static int bonjour_resolve_reply(
+   active_resolve *activeResolve,
+   int code,
+   Tcl_Obj *reply
+) {
+   // a resolve started with -wait just keeps the reply
+   if(activeResolve->wait != NULL) {
+      activeResolve->wait->done = 1;
+      activeResolve->wait->code = code;
+      activeResolve->wait->reply = reply;
+      Tcl_IncrRefCount(reply);
+      return(TCL_OK);
+   }
+
+#ifdef BONJOUR_HAVE_NRE
+   if(activeResolve->coroutine != NULL) {
+      Tcl_Obj *objv[2];
+      int result;
+
+      activeResolve->answered = 1;
+
+      // the coroutine is called directly, without
+      // parsing a script
+      objv[0] = activeResolve->coroutine;
+      objv[1] = Tcl_NewListObj(0, NULL);
+      Tcl_ListObjAppendElement(NULL, objv[1], Tcl_NewIntObj(code));
+      Tcl_ListObjAppendElement(NULL, objv[1], reply);
+      Tcl_IncrRefCount(objv[0]);
+      Tcl_IncrRefCount(objv[1]);
+      result = Tcl_EvalObjv(activeResolve->interp, 2, objv, TCL_EVAL_GLOBAL);
+      Tcl_DecrRefCount(objv[1]);
+      Tcl_DecrRefCount(objv[0]);
 
-      Tcl_SetObjResult(interp, create_dnsservice_error(interp, "DNSServiceQueryRecord", error));
-      return TCL_ERROR;
+      return(result);
    }
-      
-   // retrieve the socket being used for the resolve operation
-   // and register a file handler so that we know when
-   // there is data to be read
-   Tcl_CreateFileHandler(
-      DNSServiceRefSockFD(activeResolve->sdRef),
-      TCL_READABLE,
-      bonjour_tcl_callback,
-      activeResolve->sdRef);
+#endif
 
-   return(TCL_OK);
+   return(bonjour_eval_callback(activeResolve->interp, reply,
+                                activeResolve->op, activeResolve->sdRef));
+}
+
+////////////////////////////////////////////////////
+// waits up to timeout milliseconds for the reply to
+// a resolve started with -wait, reading the service
+// reference's socket directly rather than entering
+// the event loop.  Leaves the reply, or an error
+// message, in the interpreter's result.
+////////////////////////////////////////////////////
+static int bonjour_resolve_wait(
+   Tcl_Interp *interp,
+   active_resolve *activeResolve,
+   int timeout
+) {
+   bonjour_op_type op = activeResolve->op;
+   resolve_wait wait;
+   struct pollfd pollFd;
+   Tcl_WideInt deadline, remaining;
+   DNSServiceRef sdRef;
+   DNSServiceErrorType error;
+   int ready;
+
+   // the resolve never outlives the command, so its
+   // handle isn't returned
+   Tcl_ResetResult(interp);
+
+   wait.done = 0;
+   wait.reply = NULL;
+   activeResolve->wait = &wait;
+
+   // a reply from the snapshot is good enough
+   if(activeResolve->cachedReply != NULL) {
+      bonjour_resolve_reply(activeResolve, TCL_OK,
+                            activeResolve->cachedReply);
+      bonjour_resolve_free(activeResolve, kDNSServiceErr_NoError);
+   }
+
+   deadline = bonjour_time_now() + (Tcl_WideInt)timeout * 1000;
+   pollFd.events = POLLIN;
+   while(!wait.done) {
+      remaining = (deadline - bonjour_time_now() + 999) / 1000;
+      if(remaining < 0) {
+         remaining = 0;
+      }
+
+      // once the deadline has passed, the socket is still
+      // polled so that a reply already sent isn't missed
+      pollFd.fd = DNSServiceRefSockFD(activeResolve->sdRef);
+      ready = poll(&pollFd, 1, (int)remaining);
+      if(ready < 0 && errno != EINTR) {
+         bonjour_resolve_free(activeResolve, kDNSServiceErr_NoError);
+         Tcl_AppendResult(interp, "error waiting for resolve: ",
+            Tcl_PosixError(interp), NULL);
+         return(TCL_ERROR);
+      }
+      if(ready == 0 && remaining == 0) {
+         bonjour_resolve_free(activeResolve, kDNSServiceErr_NoError);
+         Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+            "resolve timed out after %d ms", timeout));
+         return(TCL_ERROR);
+      }
+      if(ready <= 0) {
+         continue;
+      }
+
+      // the resolve is freed by its callback once the
+      // reply has been delivered
+      BONJOUR_STATS_INCR(events);
+      sdRef = activeResolve->sdRef;
+      error = DNSServiceProcessResult(sdRef);
+      BONJOUR_TRACE(BONJOUR_TRACE_PROCESS, op, sdRef, 0, 0, error, 0, 0);
+      if(error != kDNSServiceErr_NoError && !wait.done) {
+         bonjour_stats_error(error);
+         bonjour_resolve_free(activeResolve, error);
+         Tcl_SetObjResult(interp, create_dnsservice_error(interp,
+            "DNSServiceProcessResult", error));
+         return(TCL_ERROR);
+      }
+   }
+
+   // an address is returned on its own, not as a list
+   if(wait.code == TCL_OK && op == BONJOUR_OP_RESOLVE_ADDRESS) {
+      Tcl_Obj *address;
+      Tcl_ListObjIndex(NULL, wait.reply, 0, &address);
+      Tcl_SetObjResult(interp, address);
+   }
+   else {
+      Tcl_SetObjResult(interp, wait.reply);
+   }
+   Tcl_DecrRefCount(wait.reply);
+
+   return(wait.code);
+}
+
+#ifdef BONJOUR_HAVE_NRE
+////////////////////////////////////////////////////
+// ::bonjour::await command, when not called from
+// a coroutine
+////////////////////////////////////////////////////
+static int bonjour_await(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   return(Tcl_NRCallObjProc(interp, bonjour_await_nr, clientData,
+                            objc, objv));
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::await command.  Starts a resolve and
+// yields the calling coroutine, which is resumed
+// with the reply.
+////////////////////////////////////////////////////
+static int bonjour_await_nr(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *subcommands[] = {
+      "resolve", "resolve_address", NULL
+   };
+   Tcl_HashTable *resolves = (Tcl_HashTable *)clientData;
+   resolve_thread_data *tsdPtr = bonjour_await_data();
+   active_resolve *activeResolve;
+   Tcl_Obj *coroutine, *handle;
+   int cmdIndex;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<sub-command> <args>");
+      return(TCL_ERROR);
+   }
+
+   if(Tcl_GetIndexFromObj(
+         interp, objv[1], subcommands,
+         "subcommand", 0, &cmdIndex
+      ) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   if(cmdIndex == 0 && objc != 5) {
+      Tcl_WrongNumArgs(interp, 2, objv, "<name> <regtype> <domain>");
+      return(TCL_ERROR);
+   }
+   if(cmdIndex == 1 && objc != 3) {
+      Tcl_WrongNumArgs(interp, 2, objv, "<fullname>");
+      return(TCL_ERROR);
+   }
+
+   // find the coroutine to resume
+   if(Tcl_EvalObjv(interp, 2, tsdPtr->infoCoroutine,
+                   TCL_EVAL_GLOBAL) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+   coroutine = Tcl_GetObjResult(interp);
+   if(Tcl_GetCharLength(coroutine) == 0) {
+      Tcl_SetResult(interp,
+         "::bonjour::await must be called from a coroutine", TCL_STATIC);
+      return(TCL_ERROR);
+   }
+   Tcl_IncrRefCount(coroutine);
+
+   // the reply is collected in an empty callback
+   activeResolve = bonjour_resolve_begin(interp, resolves,
+      (cmdIndex == 0) ? BONJOUR_OP_RESOLVE : BONJOUR_OP_RESOLVE_ADDRESS,
+      0, NULL, objv + 2, Tcl_NewListObj(0, NULL));
+   if(activeResolve == NULL) {
+      Tcl_DecrRefCount(coroutine);
+      return(TCL_ERROR);
+   }
+   activeResolve->coroutine = coroutine;
+
+   handle = Tcl_GetObjResult(interp);
+   Tcl_IncrRefCount(handle);
+   Tcl_ResetResult(interp);
+
+   // yield, picking up the reply when resumed
+   Tcl_NRAddCallback(interp, bonjour_await_resumed, handle,
+                     (ClientData)(size_t)cmdIndex, NULL, NULL);
+   return(Tcl_NREvalObjv(interp, 1, &tsdPtr->yield, 0));
 }
 
+////////////////////////////////////////////////////
+// returns the calling thread's resolve state, with
+// the commands ::bonjour::await evaluates, which
+// are made once so that their lookup is cached
+////////////////////////////////////////////////////
+static resolve_thread_data *bonjour_await_data(void) {
+   resolve_thread_data *tsdPtr;
+
+   tsdPtr = (resolve_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(resolve_thread_data));
+   if(!tsdPtr->initialized) {
+      tsdPtr->infoCoroutine[0] = Tcl_NewStringObj("::info", -1);
+      tsdPtr->infoCoroutine[1] = Tcl_NewStringObj("coroutine", -1);
+      tsdPtr->yield = Tcl_NewStringObj("::yield", -1);
+      Tcl_IncrRefCount(tsdPtr->infoCoroutine[0]);
+      Tcl_IncrRefCount(tsdPtr->infoCoroutine[1]);
+      Tcl_IncrRefCount(tsdPtr->yield);
+      Tcl_CreateThreadExitHandler(bonjour_await_cleanup, tsdPtr);
+      tsdPtr->initialized = 1;
+   }
+
+   return(tsdPtr);
+}
+
+////////////////////////////////////////////////////
+// called when the thread exits to free the
+// commands ::bonjour::await evaluates
+////////////////////////////////////////////////////
+static void bonjour_await_cleanup(
+   ClientData clientData
+) {
+   resolve_thread_data *tsdPtr = (resolve_thread_data *)clientData;
+
+   Tcl_DecrRefCount(tsdPtr->infoCoroutine[0]);
+   Tcl_DecrRefCount(tsdPtr->infoCoroutine[1]);
+   Tcl_DecrRefCount(tsdPtr->yield);
+   tsdPtr->initialized = 0;
+}
+
+////////////////////////////////////////////////////
+// called when the coroutine waiting in
+// ::bonjour::await is resumed or deleted
+////////////////////////////////////////////////////
+static int bonjour_await_resumed(
+   ClientData data[],
+   Tcl_Interp *interp,
+   int result
+) {
+   Tcl_Obj *handle = (Tcl_Obj *)data[0];
+   int cmdIndex = (int)(size_t)data[1];
+   Tcl_HashTable *resolves;
+   Tcl_HashEntry *hashEntry = NULL;
+   active_resolve *activeResolve = NULL;
+   Tcl_Obj *reply, **elements;
+   int numElements, code;
+
+   // the table is gone if the interpreter is being deleted
+   resolves = (Tcl_HashTable *)
+      Tcl_GetAssocData(interp, BONJOUR_RESOLVE_ASSOC, NULL);
+   if(resolves != NULL) {
+      hashEntry = Tcl_FindHashEntry(resolves, Tcl_GetString(handle));
+   }
+   if(hashEntry != NULL) {
+      activeResolve = (active_resolve *)Tcl_GetHashValue(hashEntry);
+   }
+   Tcl_DecrRefCount(handle);
+
+   // resumed by something else, or deleted, while the
+   // resolve was still waiting for a reply
+   if(activeResolve != NULL && !activeResolve->answered) {
+      bonjour_resolve_free(activeResolve, kDNSServiceErr_NoError);
+      if(result == TCL_OK) {
+         Tcl_SetResult(interp,
+            "coroutine resumed before the reply arrived", TCL_STATIC);
+         result = TCL_ERROR;
+      }
+      return(result);
+   }
+
+   if(result != TCL_OK) {
+      return(result);
+   }
+
+   // the coroutine was resumed with {code reply}
+   reply = Tcl_GetObjResult(interp);
+   if(Tcl_ListObjGetElements(NULL, reply, &numElements, &elements) != TCL_OK ||
+      numElements != 2 ||
+      Tcl_GetIntFromObj(NULL, elements[0], &code) != TCL_OK) {
+      Tcl_SetResult(interp,
+         "coroutine resumed before the reply arrived", TCL_STATIC);
+      return(TCL_ERROR);
+   }
+
+   // an address is returned on its own, not as a list
+   reply = elements[1];
+   if(code == TCL_OK && cmdIndex == 1) {
+      Tcl_ListObjIndex(NULL, reply, 0, &reply);
+   }
+   Tcl_SetObjResult(interp, reply);
+
+   return(code);
+}
+#endif
+
 ////////////////////////////////////////////////////
 // called when a service resolve result is received.
 // executes the appropriate Tcl callback to let
@@ -262,10 +888,59 @@ static void bonjour_resolve_callback(
    void *context
 ) {
    active_resolve *activeResolve = (active_resolve *)context;
+   Tcl_Interp *interp = activeResolve->interp;
    Tcl_Obj *txtRecordList = NULL;
    int result;
 
-   if(errorCode == kDNSServiceErr_NoError) {
+   // the callback may delete the interpreter, so keep
+   // it around until the resolve has been freed
+   Tcl_Preserve(interp);
+
+   // the resolve is complete, so it can't be cancelled
+   // from the callback
+   if(activeResolve->hashEntry != NULL) {
+      Tcl_DeleteHashEntry(activeResolve->hashEntry);
+      activeResolve->hashEntry = NULL;
+   }
+
+   // replayed replies arrive without a service reference
+   // and are never recorded again
+   if(bonjourRecording && sdRef != NULL) {
+      bonjour_record_resolve(flags, interfaceIndex, errorCode,
+                             fullname, hosttarget, port,
+                             txtLen, txtRecord);
+   }
+
+   if(!BONJOUR_REPLAYED(sdRef)) {
+      BONJOUR_STATS_INCR(replies[BONJOUR_OP_RESOLVE]);
+   }
+   BONJOUR_TRACE(BONJOUR_TRACE_REPLY, BONJOUR_OP_RESOLVE, sdRef,
+                 flags, interfaceIndex, errorCode, txtLen, ntohs(port));
+   if(activeResolve->startTime != 0) {
+      bonjour_histogram_record(
+         &bonjourStats.latency[BONJOUR_OP_RESOLVE],
+         bonjour_time_now() - activeResolve->startTime);
+   }
+
+   if(errorCode == kDNSServiceErr_NoError &&
+      activeResolve->match != NULL &&
+      !txt_predicate_match(activeResolve->match, txtLen, txtRecord)) {
+      // a service whose TXT record fails -match isn't
+      // delivered, so the reply is never built.  -wait
+      // returns an empty list.
+      result = TCL_OK;
+      if(activeResolve->wait != NULL) {
+         result = bonjour_resolve_reply(activeResolve, TCL_OK,
+                                        Tcl_NewListObj(0, NULL));
+      }
+   }
+   else if(errorCode == kDNSServiceErr_NoError) {
+      // keep the snapshot up to date with live replies
+      if(bonjourSnapshotEnabled && sdRef != NULL) {
+         bonjour_snapshot_resolve(fullname, hosttarget, port,
+                                  txtLen, txtRecord);
+      }
+
       // append the service name and domain
       Tcl_ListObjAppendElement(
          activeResolve->interp,
@@ -288,34 +963,49 @@ static void bonjour_resolve_callback(
          activeResolve->callback,
          txtRecordList);
 
-      // evaluate the callback
-      result = Tcl_GlobalEvalObj(activeResolve->interp, 
-                                 activeResolve->callback);
+      // evaluate the callback, unless the same reply was
+      // already given from the snapshot.  a coroutine can
+      // only be resumed once.
+      if(activeResolve->answered ||
+         (activeResolve->cachedReply != NULL &&
+          activeResolve->cacheTimer == NULL &&
+          strcmp(Tcl_GetString(activeResolve->callback),
+                 Tcl_GetString(activeResolve->cachedReply)) == 0)) {
+         result = TCL_OK;
+      }
+      else {
+         result = bonjour_resolve_reply(activeResolve, TCL_OK,
+                                        activeResolve->callback);
+      }
    } // end if no error
    else {
+      // replayed errors aren't counted
+      if(sdRef != NULL) {
+         bonjour_stats_error(errorCode);
+      }
+
       // store an appropriate error message in the
       // interpreter
-      Tcl_SetObjResult(activeResolve->interp, 
-         create_dnsservice_error(activeResolve->interp, "DNSServiceResolveReply", errorCode));
+      Tcl_SetObjResult(interp, 
+         create_dnsservice_error(interp, "DNSServiceResolveReply", errorCode));
       result = TCL_ERROR;
+      if((activeResolve->coroutine != NULL || activeResolve->wait != NULL) &&
+         !activeResolve->answered) {
+         result = bonjour_resolve_reply(activeResolve, TCL_ERROR,
+                                        Tcl_GetObjResult(interp));
+      }
    }
 
-   // remove the file handler
-   Tcl_DeleteFileHandler(DNSServiceRefSockFD(activeResolve->sdRef));
-
-   // the callback is no longer being used, so decrement the
-   // reference count
-   Tcl_DecrRefCount(activeResolve->callback);
-
-   // deallocate the resolve service reference
-   DNSServiceRefDeallocate(activeResolve->sdRef);
-
-   // deallocate the active_resolve structure
-   ckfree((void *)activeResolve);
-
    if(result == TCL_ERROR) {
-      Tcl_BackgroundError(activeResolve->interp);
+      if(!BONJOUR_REPLAYED(sdRef)) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_RESOLVE]);
+      }
+      Tcl_BackgroundError(interp);
    }
+
+   // the resolve is complete
+   bonjour_resolve_free(activeResolve, errorCode);
+   Tcl_Release(interp);
 }
 
 ////////////////////////////////////////////////////
@@ -337,8 +1027,33 @@ static void bonjour_resolve_address_callback(
    void *context
 ) {
    active_resolve *activeResolve = (active_resolve *)context;
+   Tcl_Interp *interp = activeResolve->interp;
    int result;
 
+   Tcl_Preserve(interp);
+
+   if(activeResolve->hashEntry != NULL) {
+      Tcl_DeleteHashEntry(activeResolve->hashEntry);
+      activeResolve->hashEntry = NULL;
+   }
+
+   if(bonjourRecording && sdRef != NULL) {
+      bonjour_record_address(flags, interfaceIndex, errorCode,
+                             fullname, rrtype, rrclass,
+                             rdlen, rdata, ttl);
+   }
+
+   if(!BONJOUR_REPLAYED(sdRef)) {
+      BONJOUR_STATS_INCR(replies[BONJOUR_OP_RESOLVE_ADDRESS]);
+   }
+   BONJOUR_TRACE(BONJOUR_TRACE_REPLY, BONJOUR_OP_RESOLVE_ADDRESS, sdRef,
+                 flags, interfaceIndex, errorCode, rdlen, ttl);
+   if(activeResolve->startTime != 0) {
+      bonjour_histogram_record(
+         &bonjourStats.latency[BONJOUR_OP_RESOLVE_ADDRESS],
+         bonjour_time_now() - activeResolve->startTime);
+   }
+
    if(errorCode == kDNSServiceErr_NoError) {
       char ip[16];
       unsigned char *addr = (unsigned char *)rdata;
@@ -351,31 +1066,305 @@ static void bonjour_resolve_address_callback(
          Tcl_NewStringObj(ip, -1));
 
       // evaluate the callback
-      result = Tcl_GlobalEvalObj(activeResolve->interp, 
-                                 activeResolve->callback);
+      result = bonjour_resolve_reply(activeResolve, TCL_OK,
+                                     activeResolve->callback);
    } // end if no error
    else {
+      // replayed errors aren't counted
+      if(sdRef != NULL) {
+         bonjour_stats_error(errorCode);
+      }
+
       // store an appropriate error message in the
       // interpreter
-      Tcl_SetObjResult(activeResolve->interp, 
-         create_dnsservice_error(activeResolve->interp, "DNSServiceQueryRecordReply", errorCode));
+      Tcl_SetObjResult(interp, 
+         create_dnsservice_error(interp, "DNSServiceQueryRecordReply", errorCode));
       result = TCL_ERROR;
+      if(activeResolve->coroutine != NULL || activeResolve->wait != NULL) {
+         result = bonjour_resolve_reply(activeResolve, TCL_ERROR,
+                                        Tcl_GetObjResult(interp));
+      }
+   }
+
+   if(result == TCL_ERROR) {
+      if(!BONJOUR_REPLAYED(sdRef)) {
+         BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_RESOLVE_ADDRESS]);
+      }
+      Tcl_BackgroundError(interp);
+   }
+
+   // the resolve is complete
+   bonjour_resolve_free(activeResolve, errorCode);
+   Tcl_Release(interp);
+}
+
+////////////////////////////////////////////////////
+// tears down a resolve, removing the file handler
+// and service reference (if any) and deallocating
+// the active_resolve structure
+////////////////////////////////////////////////////
+static void bonjour_resolve_free(
+   active_resolve *activeResolve,
+   DNSServiceErrorType errorCode
+) {
+   if(activeResolve->sdRef != NULL) {
+      // remove the file handler
+      bonjour_delete_file_handler(activeResolve->sdRef);
+
+      // deallocate the resolve service reference
+      bonjour_dispatch_unwatch(activeResolve->sdRef);
+      DNSServiceRefDeallocate(activeResolve->sdRef);
+      BONJOUR_STATS_DECR(inFlight[activeResolve->op]);
+      BONJOUR_TRACE(BONJOUR_TRACE_STOP, activeResolve->op, activeResolve->sdRef,
+                    0, 0, 0, 0, 0);
+      BONJOUR_PROBE3(operation__stop, activeResolve->op, activeResolve, errorCode);
    }
 
-   // remove the file handler
-   Tcl_DeleteFileHandler(DNSServiceRefSockFD(activeResolve->sdRef));
+   if(activeResolve->hashEntry != NULL) {
+      Tcl_DeleteHashEntry(activeResolve->hashEntry);
+   }
+
+   if(activeResolve->cacheTimer != NULL) {
+      Tcl_DeleteTimerHandler(activeResolve->cacheTimer);
+   }
+   if(activeResolve->cachedReply != NULL) {
+      Tcl_DecrRefCount(activeResolve->cachedReply);
+   }
+   if(activeResolve->coroutine != NULL) {
+      Tcl_DecrRefCount(activeResolve->coroutine);
+   }
+   if(activeResolve->match != NULL) {
+      txt_predicate_free(activeResolve->match);
+   }
 
    // the callback is no longer being used, so decrement the
    // reference count
    Tcl_DecrRefCount(activeResolve->callback);
 
-   // deallocate the resolve service reference
-   DNSServiceRefDeallocate(activeResolve->sdRef);
-
    // deallocate the active_resolve structure
    ckfree((void *)activeResolve);
+}
 
-   if(result == TCL_ERROR) {
-      Tcl_BackgroundError(activeResolve->interp);
+////////////////////////////////////////////////////
+// records a resolve which has been started in the
+// interpreter's table under a new handle, which is
+// left in the interpreter's result, and registers
+// its file handler
+////////////////////////////////////////////////////
+static void bonjour_resolve_started(
+   Tcl_Interp *interp,
+   Tcl_HashTable *resolves,
+   active_resolve *activeResolve
+) {
+   resolve_thread_data *tsdPtr;
+   char handle[32];
+   int newFlag;
+
+   BONJOUR_STATS_INCR(started[activeResolve->op]);
+   BONJOUR_STATS_INCR(inFlight[activeResolve->op]);
+
+   tsdPtr = (resolve_thread_data *)
+      Tcl_GetThreadData(&dataKey, sizeof(resolve_thread_data));
+   sprintf(handle, "resolve%lu", ++tsdPtr->nextHandle);
+
+   activeResolve->hashEntry =
+      Tcl_CreateHashEntry(resolves, handle, &newFlag);
+   Tcl_SetHashValue(activeResolve->hashEntry, activeResolve);
+   Tcl_SetObjResult(interp, Tcl_NewStringObj(handle, -1));
+
+   // retrieve the socket being used for the resolve operation
+   // and register a file handler so that we know when
+   // there is data to be read
+   bonjour_create_file_handler(activeResolve->sdRef, activeResolve->op);
+
+   // replies to resolves are processed ahead of browse
+   // callbacks when there is a browse budget
+   bonjour_dispatch_watch(activeResolve->sdRef);
+}
+
+////////////////////////////////////////////////////
+// looks up a resolve in the snapshot and, if found,
+// arranges for the callback to be answered from it
+// while the live resolve continues
+////////////////////////////////////////////////////
+static void bonjour_resolve_cached(
+   active_resolve *activeResolve,
+   const char *hostname,
+   const char *regtype,
+   const char *domain
+) {
+   char fullname[kDNSServiceMaxDomainName];
+   Tcl_DString hosttarget, txtRecord;
+   Tcl_Obj *txtRecordList = NULL;
+   Tcl_Obj *reply;
+   uint16_t port;
+
+   if(DNSServiceConstructFullName(fullname, hostname, regtype, domain) != 0) {
+      return;
    }
+
+   Tcl_DStringInit(&hosttarget);
+   Tcl_DStringInit(&txtRecord);
+   // a snapshot record which fails -match isn't used,
+   // and neither will the live reply be
+   if(bonjour_snapshot_lookup(fullname, &hosttarget, &port, &txtRecord) &&
+      (activeResolve->match == NULL ||
+       txt_predicate_match(activeResolve->match,
+                           Tcl_DStringLength(&txtRecord),
+                           Tcl_DStringValue(&txtRecord)))) {
+      // build the callback as the live reply would
+      reply = Tcl_DuplicateObj(activeResolve->callback);
+      Tcl_ListObjAppendElement(NULL, reply,
+         Tcl_NewStringObj(fullname, -1));
+      Tcl_ListObjAppendElement(NULL, reply,
+         Tcl_NewStringObj(Tcl_DStringValue(&hosttarget), -1));
+      Tcl_ListObjAppendElement(NULL, reply,
+         Tcl_NewIntObj(ntohs(port)));
+      txt2list(Tcl_DStringLength(&txtRecord),
+               Tcl_DStringValue(&txtRecord), &txtRecordList);
+      Tcl_ListObjAppendElement(NULL, reply, txtRecordList);
+
+      activeResolve->cachedReply = reply;
+      Tcl_IncrRefCount(reply);
+      activeResolve->cacheTimer =
+         Tcl_CreateTimerHandler(0, bonjour_resolve_cached_reply,
+                                activeResolve);
+   }
+   Tcl_DStringFree(&hosttarget);
+   Tcl_DStringFree(&txtRecord);
+}
+
+////////////////////////////////////////////////////
+// timer handler answering a resolve from the
+// snapshot
+////////////////////////////////////////////////////
+static void bonjour_resolve_cached_reply(
+   ClientData clientData
+) {
+   active_resolve *activeResolve = (active_resolve *)clientData;
+   Tcl_Interp *interp = activeResolve->interp;
+   Tcl_Obj *reply = activeResolve->cachedReply;
+
+   activeResolve->cacheTimer = NULL;
+
+   // the callback may cancel the resolve, so don't
+   // use activeResolve after evaluating it
+   Tcl_Preserve(interp);
+   Tcl_IncrRefCount(reply);
+   if(bonjour_resolve_reply(activeResolve, TCL_OK, reply) == TCL_ERROR) {
+      BONJOUR_STATS_INCR(callbackErrors[BONJOUR_OP_RESOLVE]);
+      Tcl_BackgroundError(interp);
+   }
+   Tcl_DecrRefCount(reply);
+   Tcl_Release(interp);
+}
+
+////////////////////////////////////////////////////
+// cancel any resolves still in progress
+////////////////////////////////////////////////////
+static void bonjour_resolve_cleanup(
+   ClientData clientData
+) {
+   Tcl_HashTable *resolves = (Tcl_HashTable *)clientData;
+   Tcl_HashEntry *hashEntry = NULL;
+   Tcl_HashSearch searchToken;
+
+   // run through the remaining entries in the hash table,
+   // bonjour_resolve_free removes each one
+   for(hashEntry = Tcl_FirstHashEntry(resolves, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      bonjour_resolve_free(
+         (active_resolve *)Tcl_GetHashValue(hashEntry),
+         kDNSServiceErr_NoError);
+   }
+}
+
+////////////////////////////////////////////////////
+// called when the interpreter is deleted to cancel
+// its resolves and free the hash table
+////////////////////////////////////////////////////
+static void bonjour_resolve_delete(
+   ClientData clientData,
+   Tcl_Interp *interp
+) {
+   Tcl_HashTable *resolves = (Tcl_HashTable *)clientData;
+
+   Tcl_DeleteThreadExitHandler(bonjour_resolve_cleanup, resolves);
+   bonjour_resolve_cleanup(resolves);
+
+   Tcl_DeleteHashTable(resolves);
+   ckfree((void *)resolves);
+}
+
+////////////////////////////////////////////////////
+// allocates the active_resolve structure used to
+// deliver a recorded reply
+////////////////////////////////////////////////////
+static active_resolve *bonjour_resolve_replay_alloc(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   bonjour_op_type op
+) {
+   active_resolve *activeResolve;
+
+   activeResolve = (active_resolve *)ckalloc(sizeof(active_resolve));
+   activeResolve->sdRef = NULL;
+   activeResolve->callback = Tcl_DuplicateObj(callback);
+   Tcl_IncrRefCount(activeResolve->callback);
+   activeResolve->interp = interp;
+   activeResolve->startTime = 0;
+   activeResolve->op = op;
+   activeResolve->hashEntry = NULL;
+   activeResolve->cachedReply = NULL;
+   activeResolve->cacheTimer = NULL;
+   activeResolve->coroutine = NULL;
+   activeResolve->answered = 0;
+   activeResolve->wait = NULL;
+   activeResolve->match = NULL;
+
+   return(activeResolve);
+}
+
+////////////////////////////////////////////////////
+// delivers a recorded resolve reply to a callback
+// script, used by ::bonjour::replay
+////////////////////////////////////////////////////
+void bonjour_resolve_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+) {
+   bonjour_resolve_callback(NULL, flags, interfaceIndex, errorCode,
+      fullname, hosttarget, port, txtLen, txtRecord,
+      bonjour_resolve_replay_alloc(interp, callback, BONJOUR_OP_RESOLVE));
+}
+
+////////////////////////////////////////////////////
+// delivers a recorded address reply to a callback
+// script, used by ::bonjour::replay
+////////////////////////////////////////////////////
+void bonjour_resolve_address_replay(
+   Tcl_Interp *interp,
+   Tcl_Obj *callback,
+   DNSServiceFlags flags,
+   uint32_t interfaceIndex,
+   DNSServiceErrorType errorCode,
+   const char *fullname,
+   uint16_t rrtype,
+   uint16_t rrclass,
+   uint16_t rdlen,
+   const void *rdata,
+   uint32_t ttl
+) {
+   bonjour_resolve_address_callback(NULL, flags, interfaceIndex, errorCode,
+      fullname, rrtype, rrclass, rdlen, rdata, ttl,
+      bonjour_resolve_replay_alloc(interp, callback, BONJOUR_OP_RESOLVE_ADDRESS));
 }
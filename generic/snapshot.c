@@ -0,0 +1,815 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "snapshot.h"
+
+/*
+*  Snapshot file format.  All integers are in native byte order.
+*
+*  The file starts with the 8 byte magic number "BJSNAP01" and a
+*  uint32 count of the records which follow.  Each record has a
+*  12 byte header:
+*
+*     uint8    type (0 for a browsed service, 1 for a resolve)
+*     uint8    reserved
+*     uint16   port, in network byte order (resolves only)
+*     int64    when the entry was last seen live (seconds since
+*              the epoch)
+*
+*  followed by three fields, each a uint16 length and that many
+*  bytes:
+*
+*     service  regtype, name, domain
+*     resolve  fullname, hosttarget, TXT record
+*/
+
+#define BONJOUR_SNAPSHOT_MAGIC "BJSNAP01"
+#define BONJOUR_SNAPSHOT_HEADER_SIZE 12
+
+// entries not seen live for this long (in seconds) are
+// dropped when a snapshot is loaded
+#define BONJOUR_SNAPSHOT_MAX_AGE (24 * 60 * 60)
+
+// default revalidation period in milliseconds
+#define BONJOUR_SNAPSHOT_REVALIDATE 5000
+
+// environment variable naming a snapshot to load at
+// startup and save at exit
+#define BONJOUR_SNAPSHOT_ENV "BONJOUR_SNAPSHOT"
+
+////////////////////////////////////////////////////
+// Support structures
+////////////////////////////////////////////////////
+
+enum {
+   SNAPSHOT_SERVICE,
+   SNAPSHOT_RESOLVE
+};
+
+// a cached service or resolve.  The fields are stored
+// following the structure, each terminated by a null.
+typedef struct {
+   int stale;            // loaded from a file and not yet
+                         // seen live
+   Tcl_WideInt seen;     // when last seen live
+   uint16_t port;        // resolves only, network byte order
+   uint16_t lengths[3];  // lengths of the fields
+   char *fields[3];      // service: regtype, name, domain
+                         // resolve: fullname, hosttarget, TXT
+} snapshot_entry;
+
+// non-zero once a snapshot has been loaded
+volatile int bonjourSnapshotEnabled = 0;
+
+// the cache, protected by snapshotMutex
+TCL_DECLARE_MUTEX(snapshotMutex)
+static struct {
+   int initialized;       // non-zero once the tables exist
+   char *fileName;        // native name of the snapshot file
+   int revalidate;        // revalidation period (msec)
+   Tcl_HashTable services; // snapshot_entry structures hashed
+                           // on "regtype\nname\ndomain"
+   Tcl_HashTable resolves; // snapshot_entry structures hashed
+                           // on the fullname
+} snapshot;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_snapshot_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static void bonjour_snapshot_init(void);
+static int bonjour_snapshot_load(
+   Tcl_Interp *interp,
+   const char *fileName
+);
+static int bonjour_snapshot_save(
+   Tcl_Interp *interp,
+   const char *fileName
+);
+static void bonjour_snapshot_exit(
+   ClientData clientData
+);
+static snapshot_entry *bonjour_snapshot_entry(
+   const char *const fields[3],
+   const uint16_t lengths[3]
+);
+static void bonjour_snapshot_put(
+   Tcl_HashTable *table,
+   const char *key,
+   snapshot_entry *entry,
+   int replace
+);
+static void bonjour_snapshot_remove(
+   Tcl_HashTable *table,
+   const char *key
+);
+static void bonjour_snapshot_service_key(
+   Tcl_DString *key,
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+);
+
+////////////////////////////////////////////////////
+// Function to initialize snapshot related stuff
+////////////////////////////////////////////////////
+int Snapshot_Init(
+   Tcl_Interp *interp
+) {
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::snapshot", bonjour_snapshot_cmd,
+      NULL, NULL
+   );
+
+   // the snapshot named in the environment is loaded
+   // once per process
+   Tcl_MutexLock(&snapshotMutex);
+   if(!snapshot.initialized) {
+      const char *fileName = getenv(BONJOUR_SNAPSHOT_ENV);
+
+      bonjour_snapshot_init();
+      if(fileName != NULL && *fileName != '\0') {
+         // a missing snapshot just means a cold start,
+         // an unreadable one leaves the cache disabled
+         bonjour_snapshot_load(NULL, fileName);
+      }
+   }
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::snapshot command
+////////////////////////////////////////////////////
+static int bonjour_snapshot_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *subcommands[] = { "load", "save", "info", NULL };
+   enum { CMD_LOAD, CMD_SAVE, CMD_INFO };
+   int cmdIndex, result = TCL_OK;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<sub-command> <args>");
+      return(TCL_ERROR);
+   }
+
+   if(Tcl_GetIndexFromObj(
+         interp, objv[1], subcommands,
+         "subcommand", 0, &cmdIndex
+      ) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   switch(cmdIndex) {
+   case CMD_LOAD: {
+      const char *nativePath;
+      int revalidate = BONJOUR_SNAPSHOT_REVALIDATE;
+
+      if(objc == 5 && strcmp(Tcl_GetString(objv[2]), "-revalidate") == 0) {
+         if(Tcl_GetIntFromObj(interp, objv[3], &revalidate) != TCL_OK) {
+            return(TCL_ERROR);
+         }
+         if(revalidate < 0) {
+            Tcl_SetResult(interp, "-revalidate must not be negative", TCL_STATIC);
+            return(TCL_ERROR);
+         }
+      }
+      else if(objc != 3) {
+         Tcl_WrongNumArgs(interp, 2, objv, "?-revalidate <ms>? <fileName>");
+         return(TCL_ERROR);
+      }
+
+      nativePath = (const char *)Tcl_FSGetNativePath(objv[objc - 1]);
+      if(nativePath == NULL) {
+         Tcl_AppendResult(interp, "invalid file name \"",
+            Tcl_GetString(objv[objc - 1]), "\"", NULL);
+         return(TCL_ERROR);
+      }
+
+      Tcl_MutexLock(&snapshotMutex);
+      bonjour_snapshot_init();
+      snapshot.revalidate = revalidate;
+      result = bonjour_snapshot_load(interp, nativePath);
+      Tcl_MutexUnlock(&snapshotMutex);
+      break;
+   }
+   case CMD_SAVE: {
+      const char *nativePath = NULL;
+
+      if(objc > 3) {
+         Tcl_WrongNumArgs(interp, 2, objv, "?fileName?");
+         return(TCL_ERROR);
+      }
+
+      if(objc == 3) {
+         nativePath = (const char *)Tcl_FSGetNativePath(objv[2]);
+         if(nativePath == NULL) {
+            Tcl_AppendResult(interp, "invalid file name \"",
+               Tcl_GetString(objv[2]), "\"", NULL);
+            return(TCL_ERROR);
+         }
+      }
+
+      Tcl_MutexLock(&snapshotMutex);
+      if(nativePath == NULL) {
+         nativePath = snapshot.fileName;
+      }
+      if(nativePath == NULL) {
+         Tcl_SetResult(interp, "no snapshot has been loaded", TCL_STATIC);
+         result = TCL_ERROR;
+      }
+      else {
+         result = bonjour_snapshot_save(interp, nativePath);
+      }
+      Tcl_MutexUnlock(&snapshotMutex);
+      break;
+   }
+   case CMD_INFO: {
+      Tcl_Obj *info = Tcl_NewDictObj();
+      Tcl_HashEntry *hashEntry;
+      Tcl_HashSearch searchToken;
+      int stale = 0;
+
+      if(objc != 2) {
+         Tcl_WrongNumArgs(interp, 2, objv, NULL);
+         return(TCL_ERROR);
+      }
+
+      Tcl_MutexLock(&snapshotMutex);
+      bonjour_snapshot_init();
+      for(hashEntry = Tcl_FirstHashEntry(&snapshot.services, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         stale += ((snapshot_entry *)Tcl_GetHashValue(hashEntry))->stale;
+      }
+      for(hashEntry = Tcl_FirstHashEntry(&snapshot.resolves, &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         stale += ((snapshot_entry *)Tcl_GetHashValue(hashEntry))->stale;
+      }
+
+      Tcl_DictObjPut(NULL, info, Tcl_NewStringObj("file", -1),
+         Tcl_NewStringObj(snapshot.fileName ? snapshot.fileName : "", -1));
+      Tcl_DictObjPut(NULL, info, Tcl_NewStringObj("services", -1),
+         Tcl_NewIntObj(snapshot.services.numEntries));
+      Tcl_DictObjPut(NULL, info, Tcl_NewStringObj("resolves", -1),
+         Tcl_NewIntObj(snapshot.resolves.numEntries));
+      Tcl_DictObjPut(NULL, info, Tcl_NewStringObj("stale", -1),
+         Tcl_NewIntObj(stale));
+      Tcl_DictObjPut(NULL, info, Tcl_NewStringObj("revalidate", -1),
+         Tcl_NewIntObj(snapshot.revalidate));
+      Tcl_MutexUnlock(&snapshotMutex);
+
+      Tcl_SetObjResult(interp, info);
+      break;
+   }
+   }
+
+   return(result);
+}
+
+////////////////////////////////////////////////////
+// initializes the cache.  Called with snapshotMutex
+// held.
+////////////////////////////////////////////////////
+static void bonjour_snapshot_init(void) {
+   if(snapshot.initialized) {
+      return;
+   }
+
+   Tcl_InitHashTable(&snapshot.services, TCL_STRING_KEYS);
+   Tcl_InitHashTable(&snapshot.resolves, TCL_STRING_KEYS);
+   snapshot.revalidate = BONJOUR_SNAPSHOT_REVALIDATE;
+   snapshot.initialized = 1;
+}
+
+////////////////////////////////////////////////////
+// loads a snapshot into the cache as stale entries
+// and enables the cache.  A file which doesn't exist
+// yet is an empty snapshot, any other failure to open
+// it leaves the cache as it was.  Entries already in
+// the cache are kept.  Called with snapshotMutex held.
+////////////////////////////////////////////////////
+static int bonjour_snapshot_load(
+   Tcl_Interp *interp,
+   const char *fileName
+) {
+   const unsigned char *bytes = NULL;
+   struct stat info;
+   size_t offset, length = 0;
+   Tcl_WideInt now = (Tcl_WideInt)time(NULL);
+   uint32_t count, i;
+   int fd, corrupt = 0;
+
+   fd = open(fileName, O_RDONLY);
+   if(fd < 0 && errno != ENOENT) {
+      if(interp != NULL) {
+         Tcl_AppendResult(interp, "couldn't open \"", fileName, "\": ",
+            Tcl_PosixError(interp), NULL);
+      }
+      return(TCL_ERROR);
+   }
+
+   // remember the file and start caching even if it
+   // isn't a snapshot, so that it is written at exit
+   if(snapshot.fileName == NULL) {
+      Tcl_CreateExitHandler(bonjour_snapshot_exit, NULL);
+   }
+   else {
+      ckfree(snapshot.fileName);
+   }
+   snapshot.fileName = (char *)ckalloc(strlen(fileName) + 1);
+   strcpy(snapshot.fileName, fileName);
+   bonjourSnapshotEnabled = 1;
+
+   if(fd < 0) {
+      return(TCL_OK);
+   }
+
+   if(fstat(fd, &info) == 0 && info.st_size > 0) {
+      length = (size_t)info.st_size;
+      bytes = (const unsigned char *)
+         mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+   }
+   close(fd);
+
+   if(bytes == NULL || bytes == MAP_FAILED ||
+      length < strlen(BONJOUR_SNAPSHOT_MAGIC) + sizeof(uint32_t) ||
+      memcmp(bytes, BONJOUR_SNAPSHOT_MAGIC, strlen(BONJOUR_SNAPSHOT_MAGIC)) != 0) {
+      if(bytes != NULL && bytes != MAP_FAILED) {
+         munmap((void *)bytes, length);
+      }
+      if(interp != NULL) {
+         Tcl_AppendResult(interp, "\"", fileName,
+            "\" is not a bonjour snapshot", NULL);
+      }
+      return(TCL_ERROR);
+   }
+
+   offset = strlen(BONJOUR_SNAPSHOT_MAGIC);
+   memcpy(&count, bytes + offset, sizeof(uint32_t));
+   offset += sizeof(uint32_t);
+
+   for(i = 0; i < count && !corrupt; i++) {
+      const char *fields[3];
+      uint16_t lengths[3];
+      snapshot_entry *entry;
+      Tcl_WideInt seen;
+      uint16_t port;
+      int type, field;
+
+      if(length - offset < BONJOUR_SNAPSHOT_HEADER_SIZE) {
+         corrupt = 1;
+         break;
+      }
+      type = bytes[offset];
+      memcpy(&port, bytes + offset + 2, sizeof(uint16_t));
+      memcpy(&seen, bytes + offset + 4, sizeof(Tcl_WideInt));
+      offset += BONJOUR_SNAPSHOT_HEADER_SIZE;
+
+      for(field = 0; field < 3; field++) {
+         if(length - offset < sizeof(uint16_t)) {
+            corrupt = 1;
+            break;
+         }
+         memcpy(&lengths[field], bytes + offset, sizeof(uint16_t));
+         offset += sizeof(uint16_t);
+         if(length - offset < lengths[field]) {
+            corrupt = 1;
+            break;
+         }
+         fields[field] = (const char *)bytes + offset;
+         offset += lengths[field];
+      }
+
+      if(corrupt || (type != SNAPSHOT_SERVICE && type != SNAPSHOT_RESOLVE)) {
+         corrupt = 1;
+         break;
+      }
+
+      if(now - seen > BONJOUR_SNAPSHOT_MAX_AGE) {
+         continue;
+      }
+
+      entry = bonjour_snapshot_entry(fields, lengths);
+      entry->stale = 1;
+      entry->seen = seen;
+      entry->port = port;
+
+      if(type == SNAPSHOT_SERVICE) {
+         Tcl_DString key;
+
+         bonjour_snapshot_service_key(&key, entry->fields[0],
+            entry->fields[1], entry->fields[2]);
+         bonjour_snapshot_put(&snapshot.services,
+            Tcl_DStringValue(&key), entry, 0);
+         Tcl_DStringFree(&key);
+      }
+      else {
+         bonjour_snapshot_put(&snapshot.resolves,
+            entry->fields[0], entry, 0);
+      }
+   }
+
+   munmap((void *)bytes, length);
+
+   if(corrupt) {
+      if(interp != NULL) {
+         Tcl_AppendResult(interp, "\"", fileName,
+            "\" is truncated or corrupt", NULL);
+      }
+      return(TCL_ERROR);
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// writes the cache to a snapshot file.  The file is
+// replaced atomically.  Called with snapshotMutex
+// held.
+////////////////////////////////////////////////////
+static int bonjour_snapshot_save(
+   Tcl_Interp *interp,
+   const char *fileName
+) {
+   Tcl_HashTable *tables[2];
+   Tcl_DString tempName;
+   FILE *file;
+   uint32_t count;
+   int type, error;
+
+   if(!snapshot.initialized) {
+      bonjour_snapshot_init();
+   }
+   tables[SNAPSHOT_SERVICE] = &snapshot.services;
+   tables[SNAPSHOT_RESOLVE] = &snapshot.resolves;
+
+   Tcl_DStringInit(&tempName);
+   Tcl_DStringAppend(&tempName, fileName, -1);
+   Tcl_DStringAppend(&tempName, ".tmp", -1);
+
+   file = fopen(Tcl_DStringValue(&tempName), "wb");
+   if(file == NULL) {
+      if(interp != NULL) {
+         Tcl_AppendResult(interp, "couldn't open \"",
+            Tcl_DStringValue(&tempName), "\": ", Tcl_PosixError(interp), NULL);
+      }
+      Tcl_DStringFree(&tempName);
+      return(TCL_ERROR);
+   }
+
+   count = snapshot.services.numEntries + snapshot.resolves.numEntries;
+   fwrite(BONJOUR_SNAPSHOT_MAGIC, 1, strlen(BONJOUR_SNAPSHOT_MAGIC), file);
+   fwrite(&count, sizeof(uint32_t), 1, file);
+
+   for(type = SNAPSHOT_SERVICE; type <= SNAPSHOT_RESOLVE; type++) {
+      Tcl_HashEntry *hashEntry;
+      Tcl_HashSearch searchToken;
+
+      for(hashEntry = Tcl_FirstHashEntry(tables[type], &searchToken);
+          hashEntry != NULL;
+          hashEntry = Tcl_NextHashEntry(&searchToken)) {
+         snapshot_entry *entry = (snapshot_entry *)Tcl_GetHashValue(hashEntry);
+         unsigned char header[BONJOUR_SNAPSHOT_HEADER_SIZE];
+         int field;
+
+         memset(header, 0, sizeof(header));
+         header[0] = (unsigned char)type;
+         memcpy(header + 2, &entry->port, sizeof(uint16_t));
+         memcpy(header + 4, &entry->seen, sizeof(Tcl_WideInt));
+         fwrite(header, 1, sizeof(header), file);
+
+         for(field = 0; field < 3; field++) {
+            fwrite(&entry->lengths[field], sizeof(uint16_t), 1, file);
+            fwrite(entry->fields[field], 1, entry->lengths[field], file);
+         }
+      }
+   }
+
+   error = ferror(file);
+   if(fclose(file) != 0) {
+      error = 1;
+   }
+   if(error || rename(Tcl_DStringValue(&tempName), fileName) != 0) {
+      if(interp != NULL) {
+         Tcl_AppendResult(interp, "couldn't write \"", fileName, "\": ",
+            Tcl_PosixError(interp), NULL);
+      }
+      unlink(Tcl_DStringValue(&tempName));
+      Tcl_DStringFree(&tempName);
+      return(TCL_ERROR);
+   }
+
+   Tcl_DStringFree(&tempName);
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// writes the snapshot when the process exits
+////////////////////////////////////////////////////
+static void bonjour_snapshot_exit(
+   ClientData clientData
+) {
+   Tcl_MutexLock(&snapshotMutex);
+   if(snapshot.fileName != NULL) {
+      bonjour_snapshot_save(NULL, snapshot.fileName);
+   }
+   Tcl_MutexUnlock(&snapshotMutex);
+}
+
+////////////////////////////////////////////////////
+// allocates a cache entry holding copies of the
+// given fields
+////////////////////////////////////////////////////
+static snapshot_entry *bonjour_snapshot_entry(
+   const char *const fields[3],
+   const uint16_t lengths[3]
+) {
+   snapshot_entry *entry;
+   char *data;
+   int field;
+
+   entry = (snapshot_entry *)ckalloc(sizeof(snapshot_entry) +
+      lengths[0] + lengths[1] + lengths[2] + 3);
+   entry->stale = 0;
+   entry->seen = (Tcl_WideInt)time(NULL);
+   entry->port = 0;
+
+   data = (char *)(entry + 1);
+   for(field = 0; field < 3; field++) {
+      entry->lengths[field] = lengths[field];
+      entry->fields[field] = data;
+      memcpy(data, fields[field], lengths[field]);
+      data[lengths[field]] = '\0';
+      data += lengths[field] + 1;
+   }
+
+   return(entry);
+}
+
+////////////////////////////////////////////////////
+// stores an entry in one of the tables, replacing
+// any existing entry if requested.  Called with
+// snapshotMutex held.
+////////////////////////////////////////////////////
+static void bonjour_snapshot_put(
+   Tcl_HashTable *table,
+   const char *key,
+   snapshot_entry *entry,
+   int replace
+) {
+   Tcl_HashEntry *hashEntry;
+   int newFlag;
+
+   hashEntry = Tcl_CreateHashEntry(table, key, &newFlag);
+   if(!newFlag) {
+      if(!replace) {
+         ckfree((void *)entry);
+         return;
+      }
+      ckfree((void *)Tcl_GetHashValue(hashEntry));
+   }
+   Tcl_SetHashValue(hashEntry, entry);
+}
+
+////////////////////////////////////////////////////
+// removes an entry from one of the tables.  Called
+// with snapshotMutex held.
+////////////////////////////////////////////////////
+static void bonjour_snapshot_remove(
+   Tcl_HashTable *table,
+   const char *key
+) {
+   Tcl_HashEntry *hashEntry;
+
+   hashEntry = Tcl_FindHashEntry(table, key);
+   if(hashEntry != NULL) {
+      ckfree((void *)Tcl_GetHashValue(hashEntry));
+      Tcl_DeleteHashEntry(hashEntry);
+   }
+}
+
+////////////////////////////////////////////////////
+// builds the key of a browsed service
+////////////////////////////////////////////////////
+static void bonjour_snapshot_service_key(
+   Tcl_DString *key,
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_DStringInit(key);
+   Tcl_DStringAppend(key, regtype, -1);
+   Tcl_DStringAppend(key, "\n", 1);
+   Tcl_DStringAppend(key, serviceName, -1);
+   Tcl_DStringAppend(key, "\n", 1);
+   Tcl_DStringAppend(key, domain, -1);
+}
+
+////////////////////////////////////////////////////
+// records a live browse reply in the cache
+////////////////////////////////////////////////////
+void bonjour_snapshot_browse(
+   const char *regtype,
+   DNSServiceFlags flags,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_DString key;
+
+   bonjour_snapshot_service_key(&key, regtype, serviceName, domain);
+
+   Tcl_MutexLock(&snapshotMutex);
+   if(flags & kDNSServiceFlagsAdd) {
+      const char *fields[3];
+      uint16_t lengths[3];
+
+      fields[0] = regtype;
+      fields[1] = serviceName;
+      fields[2] = domain;
+      lengths[0] = strlen(regtype);
+      lengths[1] = strlen(serviceName);
+      lengths[2] = strlen(domain);
+
+      bonjour_snapshot_put(&snapshot.services, Tcl_DStringValue(&key),
+         bonjour_snapshot_entry(fields, lengths), 1);
+   }
+   else {
+      bonjour_snapshot_remove(&snapshot.services, Tcl_DStringValue(&key));
+   }
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   Tcl_DStringFree(&key);
+}
+
+////////////////////////////////////////////////////
+// returns the stale services of a regtype
+////////////////////////////////////////////////////
+Tcl_Obj *bonjour_snapshot_stale(
+   const char *regtype
+) {
+   Tcl_Obj *services = NULL;
+   Tcl_HashEntry *hashEntry;
+   Tcl_HashSearch searchToken;
+
+   Tcl_MutexLock(&snapshotMutex);
+   for(hashEntry = Tcl_FirstHashEntry(&snapshot.services, &searchToken);
+       hashEntry != NULL;
+       hashEntry = Tcl_NextHashEntry(&searchToken)) {
+      snapshot_entry *entry = (snapshot_entry *)Tcl_GetHashValue(hashEntry);
+
+      if(!entry->stale || strcmp(entry->fields[0], regtype) != 0) {
+         continue;
+      }
+
+      if(services == NULL) {
+         services = Tcl_NewListObj(0, NULL);
+      }
+      Tcl_ListObjAppendElement(NULL, services,
+         Tcl_NewStringObj(entry->fields[1], entry->lengths[1]));
+      Tcl_ListObjAppendElement(NULL, services,
+         Tcl_NewStringObj(entry->fields[2], entry->lengths[2]));
+   }
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   return(services);
+}
+
+////////////////////////////////////////////////////
+// removes a stale service from the cache
+////////////////////////////////////////////////////
+void bonjour_snapshot_expire(
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+) {
+   Tcl_DString key;
+
+   bonjour_snapshot_service_key(&key, regtype, serviceName, domain);
+
+   Tcl_MutexLock(&snapshotMutex);
+   bonjour_snapshot_remove(&snapshot.services, Tcl_DStringValue(&key));
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   Tcl_DStringFree(&key);
+}
+
+////////////////////////////////////////////////////
+// records a live resolve reply in the cache
+////////////////////////////////////////////////////
+void bonjour_snapshot_resolve(
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+) {
+   const char *fields[3];
+   uint16_t lengths[3];
+   snapshot_entry *entry;
+
+   fields[0] = fullname;
+   fields[1] = hosttarget;
+   fields[2] = (txtRecord == NULL) ? "" : txtRecord;
+   lengths[0] = strlen(fullname);
+   lengths[1] = strlen(hosttarget);
+   lengths[2] = (txtRecord == NULL) ? 0 : txtLen;
+
+   entry = bonjour_snapshot_entry(fields, lengths);
+   entry->port = port;
+
+   Tcl_MutexLock(&snapshotMutex);
+   bonjour_snapshot_put(&snapshot.resolves, fullname, entry, 1);
+   Tcl_MutexUnlock(&snapshotMutex);
+}
+
+////////////////////////////////////////////////////
+// looks up a cached resolve
+////////////////////////////////////////////////////
+int bonjour_snapshot_lookup(
+   const char *fullname,
+   Tcl_DString *hosttarget,
+   uint16_t *port,
+   Tcl_DString *txtRecord
+) {
+   Tcl_HashEntry *hashEntry;
+   int found = 0;
+
+   Tcl_MutexLock(&snapshotMutex);
+   hashEntry = Tcl_FindHashEntry(&snapshot.resolves, fullname);
+   if(hashEntry != NULL) {
+      snapshot_entry *entry = (snapshot_entry *)Tcl_GetHashValue(hashEntry);
+
+      Tcl_DStringAppend(hosttarget, entry->fields[1], entry->lengths[1]);
+      Tcl_DStringAppend(txtRecord, entry->fields[2], entry->lengths[2]);
+      *port = entry->port;
+      found = 1;
+   }
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   return(found);
+}
+
+////////////////////////////////////////////////////
+// returns the revalidation period
+////////////////////////////////////////////////////
+int bonjour_snapshot_revalidate(void) {
+   int revalidate;
+
+   Tcl_MutexLock(&snapshotMutex);
+   revalidate = snapshot.revalidate;
+   Tcl_MutexUnlock(&snapshotMutex);
+
+   return(revalidate);
+}
@@ -0,0 +1,92 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+////////////////////////////////////////////////////
+// Warm-start snapshot.  When enabled, the services
+// found by browses and the results of resolves are
+// kept in a process-wide cache which can be saved
+// to a file and loaded by a later process.  Loaded
+// entries are "stale": browses report them at once
+// and remove any that a live reply hasn't confirmed
+// within the revalidation period, and resolves of a
+// cached service are answered immediately while the
+// live resolve refreshes the cache.
+////////////////////////////////////////////////////
+
+// non-zero once a snapshot has been loaded
+extern volatile int bonjourSnapshotEnabled;
+
+// records a live browse reply in the cache
+void bonjour_snapshot_browse(
+   const char *regtype,
+   DNSServiceFlags flags,
+   const char *serviceName,
+   const char *domain
+);
+
+// returns a list of the form {name domain ...} of
+// the stale services of a regtype, or NULL if there
+// are none
+Tcl_Obj *bonjour_snapshot_stale(
+   const char *regtype
+);
+
+// removes a stale service which wasn't confirmed
+void bonjour_snapshot_expire(
+   const char *regtype,
+   const char *serviceName,
+   const char *domain
+);
+
+// records a live resolve reply in the cache
+void bonjour_snapshot_resolve(
+   const char *fullname,
+   const char *hosttarget,
+   uint16_t port,
+   uint16_t txtLen,
+   const char *txtRecord
+);
+
+// looks up a cached resolve, filling in the host
+// and TXT record (which must be initialized) and
+// the port in network byte order.  Returns zero if
+// the service isn't cached.
+int bonjour_snapshot_lookup(
+   const char *fullname,
+   Tcl_DString *hosttarget,
+   uint16_t *port,
+   Tcl_DString *txtRecord
+);
+
+// how long browses wait for stale services to be
+// confirmed, in milliseconds
+int bonjour_snapshot_revalidate(void);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <string.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "stats.h"
+
+// the process-wide counters
+bonjour_stats bonjourStats;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_stats_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static Tcl_Obj *bonjour_stats_snapshot(
+   const bonjour_stats *stats
+);
+static void bonjour_stats_reset(void);
+static int bonjour_latency_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static Tcl_Obj *bonjour_histogram_summary(
+   const bonjour_histogram *histogram
+);
+static Tcl_WideInt bonjour_histogram_percentile(
+   const bonjour_histogram *histogram,
+   double percentile
+);
+
+////////////////////////////////////////////////////
+// Function to initialize stats related stuff
+////////////////////////////////////////////////////
+int Stats_Init(
+   Tcl_Interp *interp
+) {
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::stats", bonjour_stats_cmd,
+      NULL, NULL
+   );
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::latency", bonjour_latency_cmd,
+      NULL, NULL
+   );
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// records an error code returned by dns_sd
+////////////////////////////////////////////////////
+void bonjour_stats_error(
+   DNSServiceErrorType errorCode
+) {
+   int index = kDNSServiceErr_Unknown - errorCode;
+
+   if(index < 0 || index >= BONJOUR_STATS_NUM_ERRORS) {
+      index = BONJOUR_STATS_NUM_ERRORS;
+   }
+
+   BONJOUR_STATS_INCR(errors[index]);
+}
+
+////////////////////////////////////////////////////
+// adds a sample, in microseconds, to a histogram
+////////////////////////////////////////////////////
+void bonjour_histogram_record(
+   bonjour_histogram *histogram,
+   Tcl_WideInt usec
+) {
+   int bucket = 0;
+   Tcl_WideInt value;
+
+   if(usec < 0) {
+      usec = 0;
+   }
+
+   // find the base 2 logarithm of the sample
+   for(value = usec >> 1;
+       value != 0 && bucket < BONJOUR_HISTOGRAM_BUCKETS - 1;
+       value >>= 1) {
+      bucket++;
+   }
+
+#if defined(TCL_THREADS) && defined(__GNUC__)
+   __sync_fetch_and_add(&histogram->buckets[bucket], 1);
+   __sync_fetch_and_add(&histogram->count, 1);
+   __sync_fetch_and_add(&histogram->total, usec);
+#else
+   histogram->buckets[bucket]++;
+   histogram->count++;
+   histogram->total += usec;
+#endif
+
+   // the maximum is only advisory, so a lost update
+   // between threads is acceptable
+   if(usec > histogram->max) {
+      histogram->max = usec;
+   }
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::stats command
+////////////////////////////////////////////////////
+static int bonjour_stats_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *options[] = { "-reset", NULL };
+   int index;
+
+   if(objc > 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-reset?");
+      return(TCL_ERROR);
+   }
+
+   if(objc == 2) {
+      if(Tcl_GetIndexFromObj(
+            interp, objv[1], options, "option", 0, &index
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+   }
+
+   // the snapshot is taken before any reset so that
+   // "-reset" can be used to sample over an interval
+   Tcl_SetObjResult(interp, bonjour_stats_snapshot(&bonjourStats));
+
+   if(objc == 2) {
+      bonjour_stats_reset();
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// builds a dictionary describing the current
+// state of the counters
+////////////////////////////////////////////////////
+static Tcl_Obj *bonjour_stats_snapshot(
+   const bonjour_stats *stats
+) {
+   Tcl_Obj *result = Tcl_NewDictObj();
+   Tcl_Obj *operations = Tcl_NewDictObj();
+   Tcl_Obj *errors = Tcl_NewDictObj();
+   int op, i;
+
+   // per operation counters
+   for(op = 0; op < BONJOUR_OP_COUNT; op++) {
+      Tcl_Obj *counters = Tcl_NewDictObj();
+
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("started", -1),
+         Tcl_NewWideIntObj(stats->started[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("failed", -1),
+         Tcl_NewWideIntObj(stats->failed[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("replies", -1),
+         Tcl_NewWideIntObj(stats->replies[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("replayed", -1),
+         Tcl_NewWideIntObj(stats->replayed[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("callbackErrors", -1),
+         Tcl_NewWideIntObj(stats->callbackErrors[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("inFlight", -1),
+         Tcl_NewWideIntObj(stats->inFlight[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("dropped", -1),
+         Tcl_NewWideIntObj(stats->dropped[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("coalesced", -1),
+         Tcl_NewWideIntObj(stats->coalesced[op]));
+      Tcl_DictObjPut(NULL, counters, Tcl_NewStringObj("pauses", -1),
+         Tcl_NewWideIntObj(stats->pauses[op]));
+
+      Tcl_DictObjPut(NULL, operations,
+         Tcl_NewStringObj(get_operation_name(op), -1), counters);
+   }
+
+   // errors by code, only listing those which have
+   // actually occurred
+   for(i = 0; i <= BONJOUR_STATS_NUM_ERRORS; i++) {
+      const char *name = NULL;
+
+      if(stats->errors[i] == 0) {
+         continue;
+      }
+
+      if(i < BONJOUR_STATS_NUM_ERRORS) {
+         name = get_dnsserviceerror_string(kDNSServiceErr_Unknown - i);
+      }
+
+      Tcl_DictObjPut(NULL, errors,
+         (name == NULL) ?
+            Tcl_ObjPrintf("%d", (int)(kDNSServiceErr_Unknown - i)) :
+            Tcl_NewStringObj(name, -1),
+         Tcl_NewWideIntObj(stats->errors[i]));
+   }
+   if(stats->errors[BONJOUR_STATS_NUM_ERRORS] != 0) {
+      Tcl_DictObjPut(NULL, errors, Tcl_NewStringObj("other", -1),
+         Tcl_NewWideIntObj(stats->errors[BONJOUR_STATS_NUM_ERRORS]));
+   }
+
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("operations", -1), operations);
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("errors", -1), errors);
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("events", -1),
+      Tcl_NewWideIntObj(stats->events));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("openFds", -1),
+      Tcl_NewWideIntObj(stats->openFds));
+
+   return result;
+}
+
+////////////////////////////////////////////////////
+// zeroes the counters.  Gauges (operations in
+// flight, open sockets) describe current state
+// and are left alone.
+////////////////////////////////////////////////////
+static void bonjour_stats_reset(void)
+{
+   memset(bonjourStats.started, 0, sizeof(bonjourStats.started));
+   memset(bonjourStats.failed, 0, sizeof(bonjourStats.failed));
+   memset(bonjourStats.replies, 0, sizeof(bonjourStats.replies));
+   memset(bonjourStats.replayed, 0, sizeof(bonjourStats.replayed));
+   memset(bonjourStats.callbackErrors, 0, sizeof(bonjourStats.callbackErrors));
+   memset(bonjourStats.dropped, 0, sizeof(bonjourStats.dropped));
+   memset(bonjourStats.coalesced, 0, sizeof(bonjourStats.coalesced));
+   memset(bonjourStats.pauses, 0, sizeof(bonjourStats.pauses));
+   memset(bonjourStats.errors, 0, sizeof(bonjourStats.errors));
+   bonjourStats.events = 0;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::latency command
+////////////////////////////////////////////////////
+static int bonjour_latency_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *options[] = { "-reset", NULL };
+   Tcl_Obj *result;
+   int index, op;
+
+   if(objc > 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "?-reset?");
+      return(TCL_ERROR);
+   }
+
+   if(objc == 2) {
+      if(Tcl_GetIndexFromObj(
+            interp, objv[1], options, "option", 0, &index
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+   }
+
+   result = Tcl_NewDictObj();
+   for(op = 0; op < BONJOUR_OP_COUNT; op++) {
+      Tcl_Obj *histograms = Tcl_NewDictObj();
+
+      Tcl_DictObjPut(NULL, histograms, Tcl_NewStringObj("reply", -1),
+         bonjour_histogram_summary(&bonjourStats.latency[op]));
+      Tcl_DictObjPut(NULL, histograms, Tcl_NewStringObj("callback", -1),
+         bonjour_histogram_summary(&bonjourStats.callback[op]));
+
+      Tcl_DictObjPut(NULL, result,
+         Tcl_NewStringObj(get_operation_name(op), -1), histograms);
+   }
+   Tcl_SetObjResult(interp, result);
+
+   if(objc == 2) {
+      memset(bonjourStats.latency, 0, sizeof(bonjourStats.latency));
+      memset(bonjourStats.callback, 0, sizeof(bonjourStats.callback));
+   }
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// builds a dictionary summarizing a histogram.
+// All times are in microseconds.
+////////////////////////////////////////////////////
+static Tcl_Obj *bonjour_histogram_summary(
+   const bonjour_histogram *histogram
+) {
+   Tcl_Obj *result = Tcl_NewDictObj();
+   Tcl_WideInt mean = 0;
+
+   if(histogram->count != 0) {
+      mean = histogram->total / histogram->count;
+   }
+
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("count", -1),
+      Tcl_NewWideIntObj(histogram->count));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("mean", -1),
+      Tcl_NewWideIntObj(mean));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("p50", -1),
+      Tcl_NewWideIntObj(bonjour_histogram_percentile(histogram, 0.50)));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("p90", -1),
+      Tcl_NewWideIntObj(bonjour_histogram_percentile(histogram, 0.90)));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("p99", -1),
+      Tcl_NewWideIntObj(bonjour_histogram_percentile(histogram, 0.99)));
+   Tcl_DictObjPut(NULL, result, Tcl_NewStringObj("max", -1),
+      Tcl_NewWideIntObj(histogram->max));
+
+   return result;
+}
+
+////////////////////////////////////////////////////
+// estimates a percentile from a histogram.  The
+// upper bound of the bucket holding the requested
+// sample is returned, limited to the largest
+// sample seen.
+////////////////////////////////////////////////////
+static Tcl_WideInt bonjour_histogram_percentile(
+   const bonjour_histogram *histogram,
+   double percentile
+) {
+   Tcl_WideInt rank, seen = 0;
+   Tcl_WideInt bound;
+   int bucket;
+
+   if(histogram->count == 0) {
+      return 0;
+   }
+
+   rank = (Tcl_WideInt)(percentile * histogram->count);
+   if(rank >= histogram->count) {
+      rank = histogram->count - 1;
+   }
+
+   for(bucket = 0; bucket < BONJOUR_HISTOGRAM_BUCKETS - 1; bucket++) {
+      seen += histogram->buckets[bucket];
+      if(seen > rank) {
+         break;
+      }
+   }
+
+   bound = ((Tcl_WideInt)1 << (bucket + 1)) - 1;
+   if(bound > histogram->max) {
+      bound = histogram->max;
+   }
+
+   return bound;
+}
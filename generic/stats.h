@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __STATS_H
+#define __STATS_H
+
+////////////////////////////////////////////////////
+// Runtime counters.  These are process-wide so
+// that they reflect everything the extension is
+// doing, regardless of which interpreter started it.
+////////////////////////////////////////////////////
+
+// number of distinct dns_sd error codes tracked.  The
+// codes run downwards from kDNSServiceErr_Unknown;
+// anything outside that range is counted as "other"
+#define BONJOUR_STATS_NUM_ERRORS 32
+
+// number of buckets in a latency histogram.  Bucket
+// n holds samples in the range [2^n, 2^(n+1))
+// microseconds, with bucket 0 also holding zero and
+// the last bucket holding everything larger
+#define BONJOUR_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+   Tcl_WideInt buckets[BONJOUR_HISTOGRAM_BUCKETS];
+   Tcl_WideInt count;      // number of samples
+   Tcl_WideInt total;      // sum of all samples (usec)
+   Tcl_WideInt max;        // largest sample (usec)
+} bonjour_histogram;
+
+typedef struct {
+   // per operation type counters
+   Tcl_WideInt started[BONJOUR_OP_COUNT];       // operations started
+   Tcl_WideInt failed[BONJOUR_OP_COUNT];        // operations that failed to start
+   Tcl_WideInt replies[BONJOUR_OP_COUNT];       // replies received from dns_sd
+   Tcl_WideInt replayed[BONJOUR_OP_COUNT];      // replies delivered by a replay
+   Tcl_WideInt callbackErrors[BONJOUR_OP_COUNT]; // callbacks returning an error
+   Tcl_WideInt inFlight[BONJOUR_OP_COUNT];      // gauge: operations in progress
+   Tcl_WideInt dropped[BONJOUR_OP_COUNT];       // queued replies discarded
+   Tcl_WideInt coalesced[BONJOUR_OP_COUNT];     // queued replies cancelled out
+   Tcl_WideInt pauses[BONJOUR_OP_COUNT];        // times reading was paused
+
+   Tcl_WideInt events;     // calls to DNSServiceProcessResult
+   Tcl_WideInt openFds;    // gauge: sockets registered with Tcl
+
+   // dns_sd errors by code, with the last slot for
+   // codes we don't recognize
+   Tcl_WideInt errors[BONJOUR_STATS_NUM_ERRORS + 1];
+
+   // time from starting an operation to its first
+   // reply, and time spent evaluating callbacks
+   bonjour_histogram latency[BONJOUR_OP_COUNT];
+   bonjour_histogram callback[BONJOUR_OP_COUNT];
+} bonjour_stats;
+
+extern bonjour_stats bonjourStats;
+
+////////////////////////////////////////////////////
+// Counter update macros.  Updates are atomic when
+// built with thread support, plain increments
+// otherwise.
+////////////////////////////////////////////////////
+#if defined(TCL_THREADS) && defined(__GNUC__)
+#define BONJOUR_STATS_ADD(field, n) \
+   ((void)__sync_fetch_and_add(&bonjourStats.field, (Tcl_WideInt)(n)))
+#else
+#define BONJOUR_STATS_ADD(field, n) \
+   ((void)(bonjourStats.field += (n)))
+#endif
+
+#define BONJOUR_STATS_INCR(field) BONJOUR_STATS_ADD(field, 1)
+#define BONJOUR_STATS_DECR(field) BONJOUR_STATS_ADD(field, -1)
+
+////////////////////////////////////////////////////
+// records an error code returned by dns_sd
+////////////////////////////////////////////////////
+void bonjour_stats_error(
+   DNSServiceErrorType errorCode
+);
+
+////////////////////////////////////////////////////
+// adds a sample, in microseconds, to a histogram
+////////////////////////////////////////////////////
+void bonjour_histogram_record(
+   bonjour_histogram *histogram,
+   Tcl_WideInt usec
+);
+
+#endif
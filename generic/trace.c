@@ -0,0 +1,310 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#include <string.h>
+
+#include <tcl.h>
+#include <dns_sd.h>
+
+#include "bonjour.h"
+#include "trace.h"
+
+// magic number written at the start of trace files
+#define BONJOUR_TRACE_MAGIC "BJTRACE2"
+
+// non-zero while tracing is enabled
+volatile int bonjourTraceEnabled = 0;
+
+// the ring buffer and the total number of records
+// ever written to it.  The slot for a record is the
+// count modulo the buffer size.
+static bonjour_trace_record traceBuffer[BONJOUR_TRACE_SIZE];
+static volatile unsigned long traceNext = 0;
+
+////////////////////////////////////////////////////
+// Private function prototypes
+////////////////////////////////////////////////////
+
+static int bonjour_trace_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+);
+static int bonjour_trace_dump(
+   Tcl_Interp *interp,
+   const char *fileName
+);
+static int bonjour_trace_write(
+   Tcl_Channel channel,
+   const void *data,
+   int length
+);
+static const char *get_trace_event_name(
+   bonjour_trace_event event
+);
+
+////////////////////////////////////////////////////
+// Function to initialize trace related stuff
+////////////////////////////////////////////////////
+int Trace_Init(
+   Tcl_Interp *interp
+) {
+
+   // register commands
+   Tcl_CreateObjCommand(
+      interp, "::bonjour::trace", bonjour_trace_cmd,
+      NULL, NULL
+   );
+
+   return TCL_OK;
+}
+
+////////////////////////////////////////////////////
+// records an event in the ring buffer.  Writers
+// claim a slot with an atomic increment and never
+// block one another.
+////////////////////////////////////////////////////
+void bonjour_trace_add(
+   bonjour_trace_event event,
+   bonjour_op_type op,
+   DNSServiceRef sdRef,
+   uint32_t flags,
+   uint32_t interfaceIndex,
+   int32_t errorCode,
+   uint32_t size1,
+   uint32_t size2
+) {
+   bonjour_trace_record *record;
+   unsigned long slot;
+
+#if defined(TCL_THREADS) && defined(__GNUC__)
+   slot = __sync_fetch_and_add(&traceNext, 1);
+#else
+   slot = traceNext++;
+#endif
+
+   record = &traceBuffer[slot & (BONJOUR_TRACE_SIZE - 1)];
+   record->time = bonjour_time_now();
+   record->id = (uint64_t)(uintptr_t)sdRef;
+   record->event = (uint8_t)event;
+   record->op = (uint8_t)op;
+   record->reserved = 0;
+   record->flags = flags;
+   record->interfaceIndex = interfaceIndex;
+   record->errorCode = errorCode;
+   record->size1 = size1;
+   record->size2 = size2;
+}
+
+////////////////////////////////////////////////////
+// ::bonjour::trace command
+////////////////////////////////////////////////////
+static int bonjour_trace_cmd(
+   ClientData clientData,
+   Tcl_Interp *interp,
+   int objc,
+   Tcl_Obj *const objv[]
+) {
+   static const char *subcommands[] = {
+      "enable", "disable", "clear", "dump", NULL
+   };
+   static const char *dumpOptions[] = { "-file", NULL };
+   int cmdIndex, index;
+
+   if(objc < 2) {
+      Tcl_WrongNumArgs(interp, 1, objv, "<sub-command> <args>");
+      return(TCL_ERROR);
+   }
+
+   if(Tcl_GetIndexFromObj(
+         interp, objv[1], subcommands,
+         "subcommand", 0, &cmdIndex
+      ) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+
+   switch(cmdIndex) {
+   case 0: // enable
+   case 1: // disable
+   case 2: // clear
+      if(objc != 2) {
+         Tcl_WrongNumArgs(interp, 2, objv, NULL);
+         return(TCL_ERROR);
+      }
+
+      if(cmdIndex == 0) {
+         bonjourTraceEnabled = 1;
+      }
+      else if(cmdIndex == 1) {
+         bonjourTraceEnabled = 0;
+      }
+      else {
+         traceNext = 0;
+      }
+      return(TCL_OK);
+   case 3: // dump
+      if(objc == 2) {
+         return bonjour_trace_dump(interp, NULL);
+      }
+
+      if(objc != 4) {
+         Tcl_WrongNumArgs(interp, 2, objv, "?-file <fileName>?");
+         return(TCL_ERROR);
+      }
+
+      if(Tcl_GetIndexFromObj(
+            interp, objv[2], dumpOptions, "option", 0, &index
+         ) != TCL_OK) {
+         return(TCL_ERROR);
+      }
+
+      return bonjour_trace_dump(interp, Tcl_GetString(objv[3]));
+   } // end switch(cmdIndex)
+
+   return(TCL_OK);
+}
+
+////////////////////////////////////////////////////
+// writes the contents of the ring buffer, oldest
+// first, either as a list in the interpreter
+// result or as raw records to a binary file
+////////////////////////////////////////////////////
+static int bonjour_trace_dump(
+   Tcl_Interp *interp,
+   const char *fileName
+) {
+   unsigned long next = traceNext;
+   unsigned long first = 0;
+   unsigned long i;
+
+   if(next > BONJOUR_TRACE_SIZE) {
+      first = next - BONJOUR_TRACE_SIZE;
+   }
+
+   if(fileName == NULL) {
+      Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+
+      for(i = first; i < next; i++) {
+         const bonjour_trace_record *record =
+            &traceBuffer[i & (BONJOUR_TRACE_SIZE - 1)];
+         const char *opName = get_operation_name(record->op);
+         Tcl_Obj *elements[9];
+
+         elements[0] = Tcl_NewWideIntObj(record->time);
+         elements[1] = Tcl_NewStringObj(
+            get_trace_event_name(record->event), -1);
+         elements[2] = Tcl_NewStringObj((opName == NULL) ? "" : opName, -1);
+         elements[3] = Tcl_NewWideIntObj((Tcl_WideInt)record->id);
+         elements[4] = Tcl_NewWideIntObj(record->flags);
+         elements[5] = Tcl_NewWideIntObj(record->interfaceIndex);
+         elements[6] = Tcl_NewIntObj(record->errorCode);
+         elements[7] = Tcl_NewWideIntObj(record->size1);
+         elements[8] = Tcl_NewWideIntObj(record->size2);
+
+         Tcl_ListObjAppendElement(NULL, result, Tcl_NewListObj(9, elements));
+      }
+
+      Tcl_SetObjResult(interp, result);
+      return(TCL_OK);
+   }
+   else {
+      Tcl_Channel channel;
+      uint32_t header[2];
+      int ok;
+
+      channel = Tcl_OpenFileChannel(interp, fileName, "w", 0644);
+      if(channel == NULL) {
+         return(TCL_ERROR);
+      }
+      Tcl_SetChannelOption(interp, channel, "-translation", "binary");
+
+      // the header holds the magic number, the size of
+      // each record and the number of records
+      header[0] = sizeof(bonjour_trace_record);
+      header[1] = (uint32_t)(next - first);
+      ok = bonjour_trace_write(channel, BONJOUR_TRACE_MAGIC,
+                               strlen(BONJOUR_TRACE_MAGIC)) &&
+           bonjour_trace_write(channel, header, sizeof(header));
+
+      for(i = first; ok && i < next; i++) {
+         ok = bonjour_trace_write(channel,
+            &traceBuffer[i & (BONJOUR_TRACE_SIZE - 1)],
+            sizeof(bonjour_trace_record));
+      }
+
+      if(ok) {
+         ok = (Tcl_Flush(channel) == TCL_OK);
+      }
+
+      // the file is incomplete, so don't let it pass
+      // for a trace
+      if(!ok) {
+         Tcl_AppendResult(interp, "error writing \"", fileName, "\": ",
+            Tcl_PosixError(interp), NULL);
+         Tcl_Close(NULL, channel);
+         return(TCL_ERROR);
+      }
+
+      return Tcl_Close(interp, channel);
+   }
+}
+
+////////////////////////////////////////////////////
+// writes a block to a trace file, returning zero if
+// it couldn't all be written
+////////////////////////////////////////////////////
+static int bonjour_trace_write(
+   Tcl_Channel channel,
+   const void *data,
+   int length
+) {
+   return(Tcl_Write(channel, (const char *)data, length) == length);
+}
+
+////////////////////////////////////////////////////
+// translates a bonjour_trace_event into a string
+////////////////////////////////////////////////////
+static const char *get_trace_event_name(
+   bonjour_trace_event event
+) {
+   switch(event)
+   {
+      case BONJOUR_TRACE_START:
+         return "start";
+      case BONJOUR_TRACE_STOP:
+         return "stop";
+      case BONJOUR_TRACE_PROCESS:
+         return "process";
+      case BONJOUR_TRACE_REPLY:
+         return "reply";
+      case BONJOUR_TRACE_DISPATCH:
+         return "dispatch";
+   } // end switch(event)
+
+   return "unknown";
+}
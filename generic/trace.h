@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2006, Blair Kitchen All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer. Redistributions in binary
+form must reproduce the above copyright notice, this list of conditions and
+the following disclaimer in the documentation and/or other materials
+provided with the distribution. Neither the name of Blair Kitchen nor
+the names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+DAMAGE.
+*/
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+////////////////////////////////////////////////////
+// Per-operation trace buffer.  Each dns_sd call,
+// reply and Tcl dispatch can be recorded in a
+// fixed-size ring buffer for later inspection with
+// ::bonjour::trace.
+////////////////////////////////////////////////////
+
+// number of records held by the ring buffer.  Must
+// be a power of two.
+#ifndef BONJOUR_TRACE_SIZE
+#define BONJOUR_TRACE_SIZE 4096
+#endif
+
+// kinds of event recorded
+typedef enum {
+   BONJOUR_TRACE_START,     // dns_sd operation started
+   BONJOUR_TRACE_STOP,      // service reference deallocated
+   BONJOUR_TRACE_PROCESS,   // DNSServiceProcessResult called
+   BONJOUR_TRACE_REPLY,     // reply callback from dns_sd
+   BONJOUR_TRACE_DISPATCH   // Tcl callback evaluated
+} bonjour_trace_event;
+
+// a single trace record.  Records are tied to their
+// operation by the address of its service reference,
+// which is the same for its start, replies, processing
+// and stop.  Operations sharing a connection are
+// processed under the connection's reference.  The
+// meaning of size1 and size2 depends on the operation:
+//    browse reply - service name and domain lengths
+//    resolve reply - TXT record length and port
+//    resolve_address reply - rdata length and TTL
+//    dispatch - evaluation time (usec) and unused
+typedef struct {
+   Tcl_WideInt time;          // monotonic time (usec)
+   uint64_t id;               // service reference of the operation
+   uint8_t event;             // bonjour_trace_event
+   uint8_t op;                // bonjour_op_type
+   uint16_t reserved;
+   uint32_t flags;            // dns_sd flags
+   uint32_t interfaceIndex;   // interface index
+   int32_t errorCode;         // dns_sd error or Tcl result code
+   uint32_t size1;
+   uint32_t size2;
+} bonjour_trace_record;
+
+// non-zero while tracing is enabled
+extern volatile int bonjourTraceEnabled;
+
+////////////////////////////////////////////////////
+// records an event.  The check on
+// bonjourTraceEnabled keeps the cost to a single
+// branch while tracing is disabled.
+////////////////////////////////////////////////////
+#define BONJOUR_TRACE(event, op, sdRef, flags, interfaceIndex, errorCode, size1, size2) \
+   do { \
+      if(bonjourTraceEnabled) { \
+         bonjour_trace_add((event), (op), (sdRef), (flags), (interfaceIndex), \
+                           (errorCode), (size1), (size2)); \
+      } \
+   } while(0)
+
+void bonjour_trace_add(
+   bonjour_trace_event event,
+   bonjour_op_type op,
+   DNSServiceRef sdRef,
+   uint32_t flags,
+   uint32_t interfaceIndex,
+   int32_t errorCode,
+   uint32_t size1,
+   uint32_t size2
+);
+
+#endif
@@ -26,12 +26,59 @@ DAMAGE.
 */
 
 #include <dns_sd.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tcl.h>
 
 #include "bonjour.h"
 #include "txt_record.h"
 
+// the comparisons made by a test in a txt_predicate
+enum {
+   TXT_PRESENT,         // key
+   TXT_ABSENT,          // !key
+   TXT_EQ,              // key=value
+   TXT_NE,              // key!=value
+   TXT_LT,              // key<n
+   TXT_LE,              // key<=n
+   TXT_GT,              // key>n
+   TXT_GE               // key>=n
+};
+
+// a single test of a txt_predicate
+typedef struct {
+   int op;              // one of the TXT_ values
+   char *key;           // the key, followed in the same
+                        // allocation by the value
+   const char *value;   // the value compared by TXT_EQ and TXT_NE
+   int valueLen;
+   Tcl_WideInt number;  // the value compared by TXT_LT and above
+} txt_test;
+
+struct txt_predicate {
+   int numTests;
+   txt_test tests[1];
+};
+
+///////////////////////////////////////////////////////////
+// Function to build the key holding a piece of a value
+// split across several strings.  The first piece is
+// held by the key itself, and piece n by "key*n".
+///////////////////////////////////////////////////////////
+static void txt_chunk_key(
+   char *buffer,           // at least TXT_MAX_KEY + 16 bytes
+   const char *key,
+   int chunk
+) {
+   if(chunk == 0) {
+      strcpy(buffer, key);
+   }
+   else {
+      sprintf(buffer, "%s*%d", key, chunk);
+   }
+}
+
 ///////////////////////////////////////////////////////////
 // Function to convert a txt record to a Tcl list.
 // The list will be of the format {key val ?key val? ...}
@@ -42,63 +89,436 @@ void txt2list(
    Tcl_Obj **tclList       // Pointer to uninitialized Tcl object
 ) {
    Tcl_Obj *result = Tcl_NewListObj(0, NULL);
+   Tcl_Obj *lastValue = NULL;
+   char lastKey[TXT_MAX_KEY + 1];
+   int nextChunk = 0;
+   int split = TXTRecordContainsKey(txtLen, txtRecord, TXT_SPLIT_MARKER);
 
    uint16_t numRecords = TXTRecordGetCount(txtLen, txtRecord);
    uint16_t i;
    for(i = 0; i < numRecords; i++)
    {
       char key[256];
+      char chunkKey[TXT_MAX_KEY + 16];
       uint8_t valueLen;
       const void *value;
 
       TXTRecordGetItemAtIndex(txtLen, txtRecord,
          i, 255, key,
          &valueLen, &value);
+
+      // the marker is only there for us
+      if(split && strcmp(key, TXT_SPLIT_MARKER) == 0) {
+         continue;
+      }
+
+      // the next piece of a value which has been split
+      // is appended to it
+      if(lastValue != NULL) {
+         txt_chunk_key(chunkKey, lastKey, nextChunk);
+         if(strcmp(key, chunkKey) == 0) {
+            int length;
+            unsigned char *bytes;
+
+            Tcl_GetByteArrayFromObj(lastValue, &length);
+            bytes = Tcl_SetByteArrayLength(lastValue, length + valueLen);
+            memcpy(bytes + length, value, valueLen);
+            nextChunk++;
+            continue;
+         }
+      }
       
+      lastValue = Tcl_NewByteArrayObj(value, valueLen);
       Tcl_ListObjAppendElement(NULL,
          result, Tcl_NewStringObj(key, strlen(key)));
       Tcl_ListObjAppendElement(NULL,
-         result, Tcl_NewByteArrayObj(value, valueLen));
+         result, lastValue);
+
+      // only values of keys short enough can have been split,
+      // and only in a record with the marker
+      if(split && strlen(key) <= TXT_MAX_KEY) {
+         strcpy(lastKey, key);
+         nextChunk = 1;
+      }
+      else {
+         lastValue = NULL;
+      }
    }
 
    *tclList = result;
 }
 
 ///////////////////////////////////////////////////////////
-// Function to convert a Tcl list of the form 
-// {key val ?key val?...} into a TXT record.
+// Function to check a key given for a TXT record, which
+// must be printable ASCII, leaving "=" to separate it
+// from the value and "*" for the keys of split values
+///////////////////////////////////////////////////////////
+static int txt_key_valid(
+   const char *key,
+   int keyLen
+) {
+   int i;
+
+   if(keyLen == 0 || keyLen > TXT_MAX_KEY) {
+      return 0;
+   }
+   for(i = 0; i < keyLen; i++) {
+      unsigned char c = (unsigned char)key[i];
+
+      if(c < 0x20 || c > 0x7e || c == '=' || c == '*') {
+         return 0;
+      }
+   }
+
+   return 1;
+}
+
 ///////////////////////////////////////////////////////////
-void list2txt(
-   Tcl_Obj *tclList,    // Tcl list
-   uint16_t *txtLen,    // length of TXT record
-   void **txtRecord     // TXT record (must be deallocated by caller)
+// Function to add a string to a TXT record being built,
+// leaving an error message in the interpreter if it
+// can't be added
+///////////////////////////////////////////////////////////
+static int txt_set_value(
+   Tcl_Interp *interp,
+   TXTRecordRef *txtRecordRef,
+   const char *key,
+   uint8_t valueSize,
+   const void *value
 ) {
+   size_t itemLen = strlen(key) + ((value == NULL) ? 0 : 1 + valueSize);
+   DNSServiceErrorType error;
+
+   // the library reports an overflow as an invalid
+   // argument, so it is caught here
+   if(TXTRecordGetLength(txtRecordRef) + 1 + itemLen > 65535) {
+      error = kDNSServiceErr_NoMemory;
+   }
+   else {
+      error = TXTRecordSetValue(txtRecordRef, key, valueSize, value);
+   }
+
+   if(error == kDNSServiceErr_NoMemory) {
+      Tcl_SetResult(interp,
+         "TXT record is longer than 65535 bytes", TCL_STATIC);
+   }
+   else if(error != kDNSServiceErr_NoError) {
+      Tcl_SetObjResult(interp,
+         create_dnsservice_error(interp, "TXTRecordSetValue", error));
+   }
 
-   int listLen;
+   return(error == kDNSServiceErr_NoError ? TCL_OK : TCL_ERROR);
+}
+
+///////////////////////////////////////////////////////////
+// Function to convert a Tcl list of the form 
+// {key val ?key val?...} into a TXT record.  Values too
+// long for a single string are split across several.
+///////////////////////////////////////////////////////////
+int list2txt(
+   Tcl_Interp *interp,     // interpreter for error messages
+   Tcl_Obj *tclList,       // Tcl list
+   uint16_t *txtLen,       // length of TXT record
+   void **txtRecord        // TXT record (must be deallocated by caller)
+) {
+   Tcl_Obj **elements;
+   int listLen, split = 0;
    TXTRecordRef txtRecordRef;
 
-   Tcl_ListObjLength(NULL, tclList, &listLen);
+   if(Tcl_ListObjGetElements(interp, tclList, &listLen, &elements) != TCL_OK) {
+      return(TCL_ERROR);
+   }
+   if(listLen % 2 != 0) {
+      Tcl_SetResult(interp,
+         "TXT record list must be of the form {key value ...}", TCL_STATIC);
+      return(TCL_ERROR);
+   }
 
-   // initialize the TXT record
+   // initialize the TXT record, which grows as needed
+   // up to 65535 bytes
    TXTRecordCreate(&txtRecordRef, 0, NULL);
 
    int i;
    for(i = 0; i < listLen; i+=2)
    {
-      Tcl_Obj *keyObj, *valueObj;
+      char chunkKey[TXT_MAX_KEY + 16];
+      int result = TCL_OK;
+      int keyLen, valueLen, offset, chunk;
+
+      char *key = Tcl_GetStringFromObj(elements[i], &keyLen);
+      unsigned char *value = Tcl_GetByteArrayFromObj(elements[i + 1], &valueLen);
+
+      if(!txt_key_valid(key, keyLen)) {
+         TXTRecordDeallocate(&txtRecordRef);
+         Tcl_AppendResult(interp, "invalid TXT key \"", key,
+            "\": keys must be 1 to 240 printable ASCII characters",
+            " other than \"=\" and \"*\"", NULL);
+         return(TCL_ERROR);
+      }
+
+      // drop an earlier value of the key, so that the pieces
+      // of the new one are added next to each other
+      for(chunk = 0; ; chunk++) {
+         txt_chunk_key(chunkKey, key, chunk);
+         if(TXTRecordRemoveValue(&txtRecordRef, chunkKey) !=
+            kDNSServiceErr_NoError) {
+            break;
+         }
+      }
+
+      // each string holds "key=value" in at most 255 bytes
+      offset = 0;
+      chunk = 0;
+      do {
+         int size;
 
-      Tcl_ListObjIndex(NULL, tclList, i, &keyObj);
-      Tcl_ListObjIndex(NULL, tclList, i+1, &valueObj);
+         txt_chunk_key(chunkKey, key, chunk++);
+         size = 255 - (int)strlen(chunkKey) - 1;
+         if(size > valueLen - offset) {
+            size = valueLen - offset;
+         }
 
-      char *key = Tcl_GetStringFromObj(keyObj, NULL);
-      int valueLen;
-      unsigned char *value = Tcl_GetByteArrayFromObj(valueObj, &valueLen);
+         result = txt_set_value(interp, &txtRecordRef, chunkKey,
+                                (uint8_t)size, value + offset);
+         offset += size;
+      } while(result == TCL_OK && offset < valueLen);
+      if(chunk > 1) {
+         split = 1;
+      }
 
-      TXTRecordSetValue(&txtRecordRef, key, (uint8_t)valueLen, value);
+      if(result != TCL_OK) {
+         TXTRecordDeallocate(&txtRecordRef);
+         return(TCL_ERROR);
+      }
+   }
+
+   // mark the record so that the values are put back
+   // together
+   if(split &&
+      txt_set_value(interp, &txtRecordRef, TXT_SPLIT_MARKER, 0, NULL)
+         != TCL_OK) {
+      TXTRecordDeallocate(&txtRecordRef);
+      return(TCL_ERROR);
    }
 
    *txtLen = TXTRecordGetLength(&txtRecordRef);
    *txtRecord = (char *)ckalloc(*txtLen);
    memcpy(*txtRecord, TXTRecordGetBytesPtr(&txtRecordRef), *txtLen);
    TXTRecordDeallocate(&txtRecordRef);
+
+   return(TCL_OK);
+}
+
+///////////////////////////////////////////////////////////
+// Function to compare a value, which may have been split
+// across several strings if split is non-zero, with the
+// given bytes
+///////////////////////////////////////////////////////////
+static int txt_value_equal(
+   uint16_t txtLen,
+   const void *txtRecord,
+   int split,
+   const char *key,
+   const char *expected,
+   int expectedLen
+) {
+   char chunkKey[TXT_MAX_KEY + 16];
+   int offset = 0, chunk;
+
+   for(chunk = 0; ; chunk++) {
+      const void *value;
+      uint8_t valueLen = 0;
+
+      txt_chunk_key(chunkKey, key, chunk);
+      if(chunk > 0 && !TXTRecordContainsKey(txtLen, txtRecord, chunkKey)) {
+         break;
+      }
+      value = TXTRecordGetValuePtr(txtLen, txtRecord, chunkKey, &valueLen);
+      if(offset + valueLen > expectedLen ||
+         (valueLen > 0 && memcmp(value, expected + offset, valueLen) != 0)) {
+         return 0;
+      }
+      offset += valueLen;
+
+      // keys too long to have been split have no pieces
+      if(!split || strlen(key) > TXT_MAX_KEY) {
+         break;
+      }
+   }
+
+   return(offset == expectedLen);
+}
+
+///////////////////////////////////////////////////////////
+// Function to compile a Tcl list of tests on the keys
+// of a TXT record
+///////////////////////////////////////////////////////////
+txt_predicate *txt_predicate_compile(
+   Tcl_Interp *interp,
+   Tcl_Obj *tclList        // Tcl list of tests
+) {
+   static const struct {
+      const char *token;
+      int op;
+   } operators[] = {
+      { "!=", TXT_NE }, { "<=", TXT_LE }, { ">=", TXT_GE },
+      { "=", TXT_EQ }, { "<", TXT_LT }, { ">", TXT_GT },
+      { NULL, 0 }
+   };
+   txt_predicate *predicate;
+   Tcl_Obj **elements;
+   int numElements, i, j;
+
+   if(Tcl_ListObjGetElements(interp, tclList, &numElements, &elements) != TCL_OK) {
+      return NULL;
+   }
+
+   predicate = (txt_predicate *)ckalloc(sizeof(txt_predicate) +
+      ((numElements > 1) ? numElements - 1 : 0) * sizeof(txt_test));
+   predicate->numTests = 0;
+
+   for(i = 0; i < numElements; i++) {
+      txt_test *test = &predicate->tests[i];
+      const char *string = Tcl_GetString(elements[i]);
+      int keyLen, length = strlen(string);
+
+      test->op = TXT_PRESENT;
+      if(*string == '!' && strpbrk(string, "=<>") == NULL) {
+         test->op = TXT_ABSENT;
+         string++;
+         length--;
+      }
+
+      // the key runs up to the operator, if any
+      keyLen = strcspn(string, "!=<>");
+      if(keyLen == 0 || (test->op == TXT_ABSENT && keyLen != length)) {
+         Tcl_AppendResult(interp, "invalid TXT test \"",
+            Tcl_GetString(elements[i]), "\"", NULL);
+         txt_predicate_free(predicate);
+         return NULL;
+      }
+      if(test->op == TXT_PRESENT && keyLen != length) {
+         for(j = 0; operators[j].token != NULL; j++) {
+            if(strncmp(string + keyLen, operators[j].token,
+                       strlen(operators[j].token)) == 0) {
+               break;
+            }
+         }
+         if(operators[j].token == NULL) {
+            Tcl_AppendResult(interp, "invalid TXT test \"",
+               Tcl_GetString(elements[i]), "\"", NULL);
+            txt_predicate_free(predicate);
+            return NULL;
+         }
+         test->op = operators[j].op;
+      }
+
+      test->key = (char *)ckalloc(length + 1);
+      strcpy(test->key, string);
+      test->key[keyLen] = '\0';
+      test->value = test->key + length;
+      test->valueLen = 0;
+      test->number = 0;
+      predicate->numTests++;
+
+      if(test->op == TXT_PRESENT || test->op == TXT_ABSENT) {
+         continue;
+      }
+      test->value = test->key + keyLen +
+         ((test->op == TXT_EQ || test->op == TXT_LT || test->op == TXT_GT) ? 1 : 2);
+      test->valueLen = strlen(test->value);
+
+      // ordered comparisons are made on integers
+      if(test->op != TXT_EQ && test->op != TXT_NE) {
+         Tcl_Obj *number = Tcl_NewStringObj(test->value, -1);
+         int result = Tcl_GetWideIntFromObj(interp, number, &test->number);
+
+         Tcl_DecrRefCount(number);
+         if(result != TCL_OK) {
+            txt_predicate_free(predicate);
+            return NULL;
+         }
+      }
+   }
+
+   return predicate;
+}
+
+///////////////////////////////////////////////////////////
+// Function to test a TXT record against a predicate
+///////////////////////////////////////////////////////////
+int txt_predicate_match(
+   const txt_predicate *predicate,
+   uint16_t txtLen,        // TXT record len
+   const void *txtRecord   // TXT record
+) {
+   int i;
+
+   for(i = 0; i < predicate->numTests; i++) {
+      const txt_test *test = &predicate->tests[i];
+      int present = TXTRecordContainsKey(txtLen, txtRecord, test->key);
+      const char *value = NULL;
+      uint8_t valueLen = 0;
+
+      if(test->op == TXT_PRESENT || test->op == TXT_ABSENT) {
+         if(present != (test->op == TXT_PRESENT)) {
+            return 0;
+         }
+         continue;
+      }
+
+      if(present) {
+         value = (const char *)TXTRecordGetValuePtr(txtLen, txtRecord,
+                                                    test->key, &valueLen);
+      }
+
+      if(test->op == TXT_EQ || test->op == TXT_NE) {
+         int equal = present &&
+            txt_value_equal(txtLen, txtRecord,
+               TXTRecordContainsKey(txtLen, txtRecord, TXT_SPLIT_MARKER),
+               test->key, test->value, test->valueLen);
+
+         if(equal != (test->op == TXT_EQ)) {
+            return 0;
+         }
+      }
+      else {
+         char buffer[256];
+         char *end;
+         Tcl_WideInt number;
+
+         // a missing or non-numeric value never passes
+         if(value == NULL || valueLen == 0) {
+            return 0;
+         }
+         memcpy(buffer, value, valueLen);
+         buffer[valueLen] = '\0';
+         number = strtoll(buffer, &end, 10);
+         if(*end != '\0') {
+            return 0;
+         }
+
+         if((test->op == TXT_LT && !(number < test->number)) ||
+            (test->op == TXT_LE && !(number <= test->number)) ||
+            (test->op == TXT_GT && !(number > test->number)) ||
+            (test->op == TXT_GE && !(number >= test->number))) {
+            return 0;
+         }
+      }
+   }
+
+   return 1;
+}
+
+///////////////////////////////////////////////////////////
+// Function to free a compiled predicate
+///////////////////////////////////////////////////////////
+void txt_predicate_free(
+   txt_predicate *predicate
+) {
+   int i;
+
+   for(i = 0; i < predicate->numTests; i++) {
+      ckfree(predicate->tests[i].key);
+   }
+   ckfree((void *)predicate);
 }
@@ -28,9 +28,27 @@ DAMAGE.
 #ifndef __TXT_RECORD_H
 #define __TXT_RECORD_H
 
+///////////////////////////////////////////////////////////
+// Longest key accepted in a TXT record.  A value too long
+// to fit in a single string with its key is split across
+// several, the first held by the key and the rest by
+// "key*1", "key*2" and so on, so the key must leave room
+// for the suffix and some of the value.
+///////////////////////////////////////////////////////////
+#define TXT_MAX_KEY 240
+
+///////////////////////////////////////////////////////////
+// Key without a value added to a TXT record whose values
+// have been split.  Keys given by the user can't contain
+// "*", so only records holding it are put back together.
+///////////////////////////////////////////////////////////
+#define TXT_SPLIT_MARKER "*"
+
 ///////////////////////////////////////////////////////////
 // Function to convert a txt record to a Tcl list.
-// The list will be of the format {key val ?key val? ...}
+// The list will be of the format {key val ?key val? ...},
+// with values which were split by list2txt put back
+// together.
 ///////////////////////////////////////////////////////////
 void txt2list(
    uint16_t txtLen,        // TXT record len
@@ -40,12 +58,53 @@ void txt2list(
 
 ///////////////////////////////////////////////////////////
 // Function to convert a Tcl list of the form 
-// {key val ?key val?...} into a TXT record.
+// {key val ?key val?...} into a TXT record of up to
+// 65535 bytes, splitting values longer than a single
+// string can hold.  Returns TCL_ERROR with a message in
+// the interpreter if the list or a key is invalid, or
+// the record would be too long.
 ///////////////////////////////////////////////////////////
-void list2txt(
+int list2txt(
+   Tcl_Interp *interp,  // interpreter for error messages
    Tcl_Obj *tclList,    // Tcl list
    uint16_t *txtLen,    // length of TXT record
    void **txtRecord     // TXT record (must be deallocated by caller)
 );
 
+///////////////////////////////////////////////////////////
+// A compiled list of tests on the keys of a TXT record,
+// such as {env=prod version>=3 !debug}, all of which
+// must pass for the record to match.
+///////////////////////////////////////////////////////////
+typedef struct txt_predicate txt_predicate;
+
+///////////////////////////////////////////////////////////
+// Function to compile a Tcl list of tests.  Each is one
+// of key, !key, key=value, key!=value, or key<n, key<=n,
+// key>n or key>=n for integer values.  Returns NULL with
+// an error message in the interpreter on failure.
+///////////////////////////////////////////////////////////
+txt_predicate *txt_predicate_compile(
+   Tcl_Interp *interp,
+   Tcl_Obj *tclList        // Tcl list of tests
+);
+
+///////////////////////////////////////////////////////////
+// Function to test a TXT record against a predicate,
+// without converting it to a Tcl list.  Returns non-zero
+// if every test passes.
+///////////////////////////////////////////////////////////
+int txt_predicate_match(
+   const txt_predicate *predicate,
+   uint16_t txtLen,        // TXT record len
+   const void *txtRecord   // TXT record
+);
+
+///////////////////////////////////////////////////////////
+// Function to free a compiled predicate
+///////////////////////////////////////////////////////////
+void txt_predicate_free(
+   txt_predicate *predicate
+);
+
 #endif
@@ -0,0 +1,18 @@
+# all.tcl --
+#
+#	This file contains a top-level script to run all of the tests of
+#	the bonjour package.  It is meant to be run through "make test",
+#	which preloads the local stand-in for the dns_sd library
+#	(bench/fake_dns_sd.c) so that no mDNS daemon or network is needed.
+#	Options are passed on to tcltest, i.e. make test TESTFLAGS="-file
+#	browse.test -verbose bpe".
+
+package require Tcl 8.5
+package require tcltest 2
+namespace import ::tcltest::*
+
+configure {*}$argv -testdir [file dirname [file normalize [info script]]]
+
+# Each test file runs in its own process, so the settings of the
+# stand-in made by one don't leak into the next
+runAllTests